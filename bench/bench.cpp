@@ -0,0 +1,329 @@
+/*
+ * bench.cpp
+ *
+ * Compile-throughput benchmark: generates Mini-Pascal programs of
+ * parameterised size, compiles each with the compiler under test and
+ * reports lines per second, peak RSS and output size, compared against a
+ * stored baseline.
+ *
+ *   bench [--scale=N] [--rounds=N] [--dir=D] [--baseline=F] [--save] compiler
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+struct Result {
+    size_t lines = 0;
+    double lines_per_sec = 0;
+    long peak_rss_kb = 0;
+    long output_bytes = 0;
+};
+
+/* Every generator stays inside the grammar in parser.y: declarations
+   before subprograms, IF always with ELSE, no empty statement lists. */
+struct Generator {
+    std::string text;
+    size_t lines = 0;
+
+    void line(const std::string &s) {
+        text += s;
+        text += '\n';
+        lines++;
+    }
+
+    static std::string num(long n) { return std::to_string(n); }
+
+    /* thousands of globals, each declared, initialised and read back */
+    void globals(int count) {
+        line("program globals(output);");
+        for (int i = 0; i < count; i += 8) {
+            std::string decl = "var ";
+            for (int k = i; k < i + 8 && k < count; k++)
+                decl += (k > i ? ", g" : "g") + num(k);
+            line(decl + ": integer;");
+        }
+        line("var sum: integer;");
+        line("begin");
+        line("  sum := 0;");
+        for (int i = 0; i < count; i++)
+            line("  g" + num(i) + " := " + num(i % 1000) + ";");
+        for (int i = 0; i < count; i++)
+            line("  sum := sum + g" + num(i) + ";");
+        line("  writelnI(sum)");
+        line("end.");
+    }
+
+    /* a chain of subprograms nested depth deep, each using its own locals
+       and those of every enclosing level */
+    void nested(int depth, int chains) {
+        line("program nested(output);");
+        line("var total: integer;");
+        for (int c = 0; c < chains; c++)
+            nested_level(c, 0, depth);
+        line("begin");
+        line("  total := 0;");
+        for (int c = 0; c < chains; c++)
+            line("  c" + num(c) + "n0(1);");
+        line("  writelnI(total)");
+        line("end.");
+    }
+
+    void nested_level(int chain, int level, int depth) {
+        std::string name = "c" + num(chain) + "n" + num(level);
+        line("procedure " + name + "(p" + num(level) + ": integer);");
+        line("var v" + num(level) + ": integer;");
+        if (level + 1 < depth)
+            nested_level(chain, level + 1, depth);
+        line("begin");
+        std::string use = "p" + num(level);
+        for (int k = 0; k < level; k += 4)
+            use += " + v" + num(k);
+        line("  v" + num(level) + " := " + use + ";");
+        if (level + 1 < depth)
+            line("  c" + num(chain) + "n" + num(level + 1) + "(v" + num(level) + ")");
+        else
+            line("  total := total + v" + num(level));
+        line("end;");
+    }
+
+    /* single assignments with very long operator chains */
+    void expressions(int statements, int terms) {
+        static const char *ops[] = {" + ", " - ", " * ", " + "};
+        line("program expressions(output);");
+        line("var a, b, c, x: integer;");
+        line("begin");
+        line("  a := 3; b := 5; c := 7; x := 0;");
+        for (int s = 0; s < statements; s++) {
+            std::string expr = "x";
+            for (int t = 0; t < terms; t++) {
+                expr += ops[(s + t) % 4];
+                expr += t % 3 == 0 ? "a" : t % 3 == 1 ? "(b - " + num(t % 97) + ")" : "c";
+                if (t % 16 == 15) {
+                    line("  x := " + expr + ";");
+                    expr = "x";
+                }
+            }
+            line("  x := " + expr + ";");
+        }
+        line("  writelnI(x)");
+        line("end.");
+    }
+
+    /* big multi-dimensional arrays swept by nested loops */
+    void arrays(int count, int extent) {
+        std::string bound = "[1 .. " + num(extent) + "]";
+        line("program arrays(output);");
+        line("var i, j, k, sum: integer;");
+        for (int n = 0; n < count; n++)
+            line("var m" + num(n) + ": array " + bound + " of array " + bound + " of array " + bound + " of integer;");
+        line("begin");
+        line("  sum := 0;");
+        for (int n = 0; n < count; n++) {
+            line("  i := 1;");
+            line("  while i <= " + num(extent) + " do");
+            line("  begin");
+            line("    j := 1;");
+            line("    while j <= " + num(extent) + " do");
+            line("    begin");
+            line("      k := 1;");
+            line("      while k <= " + num(extent) + " do");
+            line("      begin");
+            line("        m" + num(n) + "[i][j][k] := i * j + k;");
+            line("        sum := sum + m" + num(n) + "[i][j][k];");
+            line("        k := k + 1");
+            line("      end;");
+            line("      j := j + 1");
+            line("    end;");
+            line("    i := i + 1");
+            line("  end;");
+        }
+        line("  writelnI(sum)");
+        line("end.");
+    }
+
+    /* many ordinary subprograms with branchy bodies */
+    void subprograms(int count, int statements) {
+        line("program subprograms(output);");
+        line("var g: integer;");
+        for (int i = 0; i < count; i++) {
+            line("function f" + num(i) + "(x, y: integer): integer;");
+            line("var t: integer;");
+            line("begin");
+            line("  t := x;");
+            for (int s = 0; s < statements; s++)
+                line("  if t > " + num(s) + " then t := t - y else t := t + " + num(s % 13) + ";");
+            line("  f" + num(i) + " := t + g");
+            line("end;");
+        }
+        line("begin");
+        line("  g := 1;");
+        for (int i = 0; i < count; i++)
+            line("  g := f" + num(i) + "(g, " + num(i % 7) + ");");
+        line("  writelnI(g)");
+        line("end.");
+    }
+};
+
+/* runs the compiler on source once; false if it could not be run or failed */
+static bool run_once(const std::string &compiler, const std::string &source, const std::string &output,
+                     double &seconds, long &peak_rss_kb) {
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, 1);
+        dup2(null_fd, 2);
+        execl(compiler.c_str(), compiler.c_str(), source.c_str(), "-o", output.c_str(), (char*)NULL);
+        _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0)
+        return false;
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    peak_rss_kb = usage.ru_maxrss;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static std::map<std::string, Result> load_baseline(const std::string &path) {
+    std::map<std::string, Result> baseline;
+    FILE *fp = fopen(path.c_str(), "r");
+    if (fp == NULL)
+        return baseline;
+    char name[64];
+    Result result;
+    while (fscanf(fp, "%63s %zu %lf %ld %ld", name, &result.lines, &result.lines_per_sec, &result.peak_rss_kb, &result.output_bytes) == 5)
+        baseline[name] = result;
+    fclose(fp);
+    return baseline;
+}
+
+static double change(double now, double before) { return before > 0 ? 100.0 * (now - before) / before : 0.0; }
+
+int main(int argc, char *argv[]) {
+    int scale = 1;
+    int rounds = 3;
+    bool save = false;
+    std::string dir = "bench/out";
+    std::string baseline_path = "bench/baseline.txt";
+    std::string compiler;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--scale=", 8) == 0)
+            scale = atoi(argv[i] + 8);
+        else if (strncmp(argv[i], "--rounds=", 9) == 0)
+            rounds = atoi(argv[i] + 9);
+        else if (strncmp(argv[i], "--dir=", 6) == 0)
+            dir = argv[i] + 6;
+        else if (strncmp(argv[i], "--baseline=", 11) == 0)
+            baseline_path = argv[i] + 11;
+        else if (strcmp(argv[i], "--save") == 0)
+            save = true;
+        else
+            compiler = argv[i];
+    }
+    if (compiler.empty() || scale < 1 || rounds < 1) {
+        fprintf(stderr, "Usage: %s [--scale=N] [--rounds=N] [--dir=D] [--baseline=F] [--save] compiler\n", argv[0]);
+        return 2;
+    }
+    mkdir(dir.c_str(), 0755);
+
+    struct Case {
+        const char *name;
+        void (*generate)(Generator&, int);
+    };
+    const Case cases[] = {
+        {"globals", [](Generator &g, int s) { g.globals(5000 * s); }},
+        {"nested", [](Generator &g, int s) { g.nested(40, 50 * s); }},
+        {"expressions", [](Generator &g, int s) { g.expressions(2000 * s, 200); }},
+        {"arrays", [](Generator &g, int s) { g.arrays(200 * s, 100); }},
+        {"subprograms", [](Generator &g, int s) { g.subprograms(1000 * s, 60); }},
+    };
+
+    std::map<std::string, Result> baseline = load_baseline(baseline_path);
+    std::map<std::string, Result> results;
+    int regressions = 0;
+    int mismatched = 0;
+    printf("%-12s %9s %12s %8s %12s %10s   %s\n", "case", "lines", "lines/s", "", "peak RSS KB", "", "output bytes");
+    for (const Case &c : cases) {
+        Generator generator;
+        c.generate(generator, scale);
+        std::string source = dir + "/" + c.name + ".p";
+        std::string output = dir + "/" + c.name + ".j";
+        FILE *fp = fopen(source.c_str(), "w");
+        if (fp == NULL || fwrite(generator.text.data(), 1, generator.text.size(), fp) != generator.text.size()) {
+            fprintf(stderr, "[ERROR] cannot write %s\n", source.c_str());
+            return 2;
+        }
+        fclose(fp);
+
+        Result result;
+        result.lines = generator.lines;
+        double best = 0;
+        for (int r = 0; r < rounds; r++) {
+            double seconds;
+            long rss;
+            if (!run_once(compiler, source, output, seconds, rss)) {
+                fprintf(stderr, "[ERROR] %s failed on %s\n", compiler.c_str(), source.c_str());
+                return 2;
+            }
+            if (r == 0 || seconds < best)
+                best = seconds;
+            result.peak_rss_kb = rss > result.peak_rss_kb ? rss : result.peak_rss_kb;
+        }
+        struct stat st;
+        result.output_bytes = stat(output.c_str(), &st) == 0 ? (long)st.st_size : 0;
+        result.lines_per_sec = result.lines / best;
+        results[c.name] = result;
+
+        /* slower by more than 15% or 10% more memory than the baseline;
+           a baseline of another size (another --scale) is not compared */
+        auto it = baseline.find(c.name);
+        std::string speed_delta, rss_delta;
+        bool regressed = false;
+        if (it != baseline.end() && it->second.lines != result.lines) {
+            mismatched++;
+        } else if (it != baseline.end()) {
+            double speed = change(result.lines_per_sec, it->second.lines_per_sec);
+            double rss = change(result.peak_rss_kb, it->second.peak_rss_kb);
+            char text[32];
+            snprintf(text, sizeof(text), "%+.1f%%", speed);
+            speed_delta = text;
+            snprintf(text, sizeof(text), "%+.1f%%", rss);
+            rss_delta = text;
+            regressed = speed < -15 || rss > 10;
+        }
+        printf("%-12s %9zu %12.0f %8s %12ld %10s   %ld%s\n", c.name, result.lines, result.lines_per_sec, speed_delta.c_str(),
+               result.peak_rss_kb, rss_delta.c_str(), result.output_bytes, regressed ? "   REGRESSION" : "");
+        regressions += regressed;
+    }
+
+    if (save) {
+        FILE *fp = fopen(baseline_path.c_str(), "w");
+        if (fp == NULL) {
+            fprintf(stderr, "[ERROR] cannot write %s\n", baseline_path.c_str());
+            return 2;
+        }
+        for (const auto &item : results)
+            fprintf(fp, "%s %zu %.0f %ld %ld\n", item.first.c_str(), item.second.lines, item.second.lines_per_sec,
+                    item.second.peak_rss_kb, item.second.output_bytes);
+        fclose(fp);
+        printf("[INFO ] baseline saved to %s\n", baseline_path.c_str());
+    } else if (baseline.empty()) {
+        printf("[INFO ] no baseline in %s; run make bench-baseline to record one\n", baseline_path.c_str());
+    } else if (mismatched) {
+        printf("[INFO ] %d cases not compared: %s was recorded at another scale\n", mismatched, baseline_path.c_str());
+    }
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,150 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+/* Compilation-scoped bump allocator. Everything allocated from it lives until
+   release() (or destruction), which frees all blocks at once. */
+struct Arena {
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    std::vector<char*> blocks;
+    size_t first_block_size = 0;
+    char *curr = nullptr;
+    char *end = nullptr;
+    size_t bytes_used = 0;
+    size_t bytes_reserved = 0;
+
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() { release(); }
+
+    void* allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+        uintptr_t p = (reinterpret_cast<uintptr_t>(curr) + align - 1) & ~(uintptr_t)(align - 1);
+        if (curr == nullptr || p + size > reinterpret_cast<uintptr_t>(end)) {
+            size_t block_size = size + align > BLOCK_SIZE ? size + align : BLOCK_SIZE;
+            char *block = static_cast<char*>(malloc(block_size));
+            if (block == nullptr)
+                throw std::bad_alloc();
+            if (blocks.empty())
+                first_block_size = block_size;
+            blocks.push_back(block);
+            bytes_reserved += block_size;
+            curr = block;
+            end = block + block_size;
+            p = (reinterpret_cast<uintptr_t>(curr) + align - 1) & ~(uintptr_t)(align - 1);
+        }
+        curr = reinterpret_cast<char*>(p + size);
+        bytes_used += size;
+        return reinterpret_cast<void*>(p);
+    }
+
+    char* strdup(const char *s, size_t len) {
+        char *p = static_cast<char*>(allocate(len + 1, 1));
+        memcpy(p, s, len);
+        p[len] = '\0';
+        return p;
+    }
+
+    char* strdup(const char *s) { return strdup(s, strlen(s)); }
+
+    /* frees every block but the first and rewinds into it, so an owner
+       that compiles many files reuses its memory instead of calling malloc */
+    void reset() {
+        if (blocks.empty())
+            return;
+        for (size_t i = 1; i < blocks.size(); i++)
+            free(blocks[i]);
+        blocks.resize(1);
+        curr = blocks[0];
+        end = blocks[0] + first_block_size;
+        bytes_used = 0;
+        bytes_reserved = first_block_size;
+    }
+
+    void release() {
+        for (char *block : blocks)
+            free(block);
+        blocks.clear();
+        curr = end = nullptr;
+        bytes_used = bytes_reserved = 0;
+    }
+};
+
+inline void* operator new(size_t size, Arena &arena) { return arena.allocate(size); }
+inline void operator delete(void*, Arena&) {}
+
+/* Lexer-level identifier table: every distinct spelling is copied into the
+   arena once and the same pointer is handed out on each later occurrence. */
+struct InternTable {
+    struct Slot {
+        char *str;
+        uint32_t hash;
+        uint32_t len;
+    };
+
+    Arena &arena;
+    std::vector<Slot> slots;
+    size_t count = 0;
+    size_t lookups = 0;
+    size_t hits = 0;
+
+    explicit InternTable(Arena &arena) : arena(arena), slots(1024, Slot{nullptr, 0, 0}) {}
+
+    static uint32_t hash_str(const char *s, size_t len) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; i++)
+            h = (h ^ (unsigned char)s[i]) * 16777619u;
+        return h;
+    }
+
+    char* intern(const char *s, size_t len) {
+        lookups++;
+        uint32_t h = hash_str(s, len);
+        size_t mask = slots.size() - 1;
+        for (size_t i = h & mask; ; i = (i + 1) & mask) {
+            Slot &slot = slots[i];
+            if (slot.str == nullptr) {
+                char *str = arena.strdup(s, len);
+                slot = Slot{str, h, (uint32_t)len};
+                if (++count * 2 > slots.size())
+                    grow();
+                return str;
+            }
+            if (slot.hash == h && slot.len == len && memcmp(slot.str, s, len) == 0) {
+                hits++;
+                return slot.str;
+            }
+        }
+    }
+
+    char* intern(const char *s) { return intern(s, strlen(s)); }
+
+    /* forgets every entry but keeps the table size; call together with Arena::reset */
+    void clear() {
+        std::fill(slots.begin(), slots.end(), Slot{nullptr, 0, 0});
+        count = lookups = hits = 0;
+    }
+
+    void grow() {
+        std::vector<Slot> old(slots.size() * 2, Slot{nullptr, 0, 0});
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (const Slot &slot : old) {
+            if (slot.str == nullptr) continue;
+            size_t i = slot.hash & mask;
+            while (slots[i].str != nullptr)
+                i = (i + 1) & mask;
+            slots[i] = slot;
+        }
+    }
+};
+
+#endif
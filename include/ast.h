@@ -2,6 +2,8 @@
 #define AST_H
 
 #include <array>
+#include <cstdint>
+#include <vector>
 #include "loc.h"
 
 enum class NodeType { 
@@ -32,21 +34,99 @@ enum class IDType { INT, REAL, STRING, VOID, ARRAY, SUBPROG };
 enum class OpType {
   AND, OR,
   LT, GT, EQ, LET, GET, NEQ,
-  ADD, SUB, MUL, DIV
+  ADD, SUB, MUL, DIV,
+  SHL
 };
 
-struct Node {
-  NodeType node_type;
-  LocType loc;
-  std::array<Node*, 4> child;
-  Node *next;
-  union {
-    int ival;
-    double dval;
-    char *sval;
-    IDType tval;
-    OpType oval;
-  } metadata;
+typedef uint32_t NodeId;
+
+/* index 0 is reserved so that a zero NodeId plays the role of a null pointer */
+const NodeId NIL_NODE = 0;
+
+/* head and tail of a sibling chain, so the parser can append in O(1) */
+struct NodeList {
+  NodeId head;
+  NodeId tail;
+};
+
+union NodeData {
+  int ival;
+  double dval;
+  char *sval;
+  IDType tval;
+  OpType oval;
+};
+
+/* Struct-of-arrays AST: node i is kind[i], loc[i], child[i], next[i] and
+   metadata[i]. Traversals that only look at shape touch kind/child/next. */
+struct Ast {
+  std::vector<NodeType> kind;
+  std::vector<LocType> loc;
+  std::vector<std::array<NodeId, 4>> child;
+  std::vector<NodeId> next;
+  std::vector<NodeData> metadata;
+
+  Ast() { add(NodeType::PROG, {}, {}, NIL_NODE); }
+
+  NodeId add(NodeType node_type, const LocType &node_loc, const std::array<NodeId, 4> &node_child, NodeId node_next) {
+    kind.push_back(node_type);
+    loc.push_back(node_loc);
+    child.push_back(node_child);
+    next.push_back(node_next);
+    metadata.push_back(NodeData{});
+    return (NodeId)(kind.size() - 1);
+  }
+
+  NodeList append(NodeList list, NodeId node) {
+    if (list.head == NIL_NODE)
+      return NodeList{node, node};
+    next[list.tail] = node;
+    return NodeList{list.head, node};
+  }
+
+  /* drops every node but the reserved one, keeping the capacity */
+  void clear() {
+    kind.resize(1);
+    loc.resize(1);
+    child.resize(1);
+    next.resize(1);
+    metadata.resize(1);
+  }
+
+  size_t size() const { return kind.size() - 1; }
+
+  size_t bytes() const {
+    return kind.capacity() * sizeof(NodeType) + loc.capacity() * sizeof(LocType) +
+           child.capacity() * sizeof(std::array<NodeId, 4>) + next.capacity() * sizeof(NodeId) +
+           metadata.capacity() * sizeof(NodeData);
+  }
 };
 
+inline bool is_relop(OpType op) {
+  return op == OpType::LT || op == OpType::GT || op == OpType::EQ ||
+         op == OpType::LET || op == OpType::GET || op == OpType::NEQ;
+}
+
+/* true if the expression can only evaluate to 0 or 1, so that NOT, AND
+   and OR on it are logical rather than bitwise */
+inline bool is_boolean(const Ast &ast, NodeId root) {
+  std::vector<NodeId> pending{root};
+  while (!pending.empty()) {
+    NodeId node = pending.back();
+    pending.pop_back();
+    if (ast.kind[node] == NodeType::LITERAL_INT) {
+      if (ast.metadata[node].ival != 0 && ast.metadata[node].ival != 1)
+        return false;
+    } else if (ast.kind[node] == NodeType::NOT) {
+      pending.push_back(ast.child[node][0]);
+    } else if (ast.kind[node] == NodeType::OP && (ast.metadata[node].oval == OpType::AND || ast.metadata[node].oval == OpType::OR)) {
+      pending.push_back(ast.child[node][0]);
+      pending.push_back(ast.child[node][1]);
+    } else if (!(ast.kind[node] == NodeType::OP && is_relop(ast.metadata[node].oval))) {
+      return false;
+    }
+  }
+  return true;
+}
+
 #endif
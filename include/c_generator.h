@@ -0,0 +1,485 @@
+#ifndef C_GENERATOR_H
+#define C_GENERATOR_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "ast.h"
+#include "c_runtime.h"
+#include "compile_stats.h"
+#include "semantic.h"
+
+/* Second back end (--emit=c): the program as one portable C file, built
+   with the system compiler. It reads the same resolved symbols and types
+   as the traverser. Subprograms are lifted the same way: every subprogram
+   becomes a top-level C function that takes its captured variables by
+   value ahead of its own parameters, and locals are named after their JVM
+   slots. Expressions are lowered to three-address code, one temporary per
+   operation, so operands are evaluated in the order the JVM evaluates them
+   and AND/OR of booleans still short-circuit; cc -O2 removes the temporaries. */
+struct CGenerator {
+    enum class ExprTask { EVAL, OP, NOT, NEGATE, CALL, SUBSCRIPT, SHORT_CIRCUIT, JOIN, CONCAT };
+    enum class StmtTask { EXEC, ELSE, CLOSE };
+
+    struct ExprFrame {
+        ExprTask task;
+        NodeId node;
+        TypeDescriptor *type_descriptor;
+        int value;
+        int label;
+    };
+
+    struct StmtFrame {
+        StmtTask task;
+        NodeId node;
+    };
+
+    std::ostream &out_file;
+    std::string basename;
+    Ast &ast;
+    const SemanticAnalysis &sema;
+    CompileStats &stats;
+
+    /* the function being generated: its temporaries and its statements */
+    std::vector<std::string> temp_types;
+    std::string body;
+    int indent = 1;
+    int label_used = 0;
+
+    std::vector<ExprFrame> expr_work;
+    std::vector<std::string> values;
+
+    CGenerator(std::ostream &out_file, std::string basename, Ast &ast, const SemanticAnalysis &sema, CompileStats &stats) : out_file(out_file), basename(std::move(basename)), ast(ast), sema(sema), stats(stats) {}
+
+    static std::string c_type(const TypeDescriptor *type_descriptor) {
+        switch (type_descriptor->id_type) {
+            case IDType::INT:
+                return "int32_t";
+            case IDType::REAL:
+                return "float";
+            case IDType::STRING:
+                return "mp_string";
+            case IDType::ARRAY:
+                return c_type(type_descriptor->base) + "*";
+            default:
+                return "void";
+        }
+    }
+
+    static std::string c_scalar_type(IDType id_type) {
+        return id_type == IDType::INT ? "int32_t" : id_type == IDType::REAL ? "float" : "mp_string";
+    }
+
+    std::string function_name(const Symbol &symbol) const {
+        return "p" + std::to_string(symbol.subprog) + "_" + symbol.name;
+    }
+
+    static std::string local_name(int slot) { return "l" + std::to_string(slot); }
+
+    std::string var_name(const Symbol &symbol) const {
+        return symbol.storage == Storage::GLOBAL ? std::string("g_") + symbol.name : local_name(symbol.slot);
+    }
+
+    static std::string int_literal(int value) {
+        if (value == INT32_MIN)
+            return "INT32_MIN";
+        return value < 0 ? "(" + std::to_string(value) + ")" : std::to_string(value);
+    }
+
+    /* exact: a hexadecimal float literal of the value the JVM path loads */
+    static std::string float_literal(double dval) {
+        float value = (float)dval;
+        if (std::isnan(value))
+            return "NAN";
+        if (std::isinf(value))
+            return value > 0 ? "INFINITY" : "(-INFINITY)";
+        char text[48];
+        snprintf(text, sizeof(text), "%a", (double)value);
+        return value < 0 || std::signbit(value) ? std::string("(") + text + "f)" : std::string(text) + "f";
+    }
+
+    /* deeply nested statements stop indenting, or the output would grow with the square of the depth */
+    static const int MAX_INDENT = 32;
+
+    static size_t indent_width(int level) { return 4 * (size_t)(level < MAX_INDENT ? level : MAX_INDENT); }
+
+    void line(const std::string &text) {
+        body.append(indent_width(indent), ' ');
+        body += text;
+        body += '\n';
+    }
+
+    std::string new_temp(const std::string &type) {
+        temp_types.push_back(type);
+        return "t" + std::to_string(temp_types.size() - 1);
+    }
+
+    std::string pop_value() {
+        std::string value = std::move(values.back());
+        values.pop_back();
+        return value;
+    }
+
+    /* the array extents and element type of a (possibly multi-dimensional) array */
+    std::string gen_new_array(const TypeDescriptor *type_descriptor) {
+        std::string extents;
+        int dims = 0;
+        for (; type_descriptor->id_type == IDType::ARRAY; type_descriptor = type_descriptor->base, dims++)
+            extents += (dims ? ", " : "") + std::to_string(type_descriptor->upper_bound - type_descriptor->lower_bound + 1);
+        return "mp_new_array(" + std::to_string(dims) + ", (const int32_t[]){" + extents + "}, sizeof(" + c_type(type_descriptor) + "))";
+    }
+
+    bool gen_prog(NodeId root) {
+        assert(ast.kind[root] == NodeType::PROG);
+        CompileStats::Clock::time_point start = stats.start();
+        std::string text = "/* " + basename + ": generated by mini-pascal-compiler; build with cc -O2 */\n";
+        text += c_runtime();
+
+        /* globals, initialized like vinit: 0, 0.0, "" and allocated arrays */
+        std::string vinit;
+        text += "\n";
+        for (NodeId decl_list = ast.child[root][1]; decl_list != NIL_NODE; decl_list = ast.next[decl_list]) {
+            for (NodeId id = ast.child[decl_list][0]; id != NIL_NODE; id = ast.next[id]) {
+                const Symbol &symbol = sema.symbol(id);
+                text += "static " + c_type(symbol.type_descriptor) + " " + var_name(symbol) + ";\n";
+                if (symbol.type_descriptor->id_type == IDType::STRING)
+                    vinit += "    " + var_name(symbol) + " = \"\";\n";
+                else if (symbol.type_descriptor->id_type == IDType::ARRAY)
+                    vinit += "    " + var_name(symbol) + " = (" + c_type(symbol.type_descriptor) + ")" + gen_new_array(symbol.type_descriptor) + ";\n";
+            }
+        }
+
+        text += "\n";
+        for (const FreeVarAnalysis::Subprog &subprog : sema.free_vars.subprogs)
+            text += gen_signature(subprog.head) + ";\n";
+        text += "\nstatic void mp_vinit(void) {\n" + vinit + "}\n";
+        out_file << text;
+        stats.bytes_written += text.size();
+
+        for (const FreeVarAnalysis::Subprog &subprog : sema.free_vars.subprogs)
+            gen_subprog(subprog.decl);
+
+        gen_stmt(ast.child[root][3]);
+        write_function("int main(void)", "    mp_vinit();\n", "    return 0;\n");
+        stats.stop(CompileStats::CODEGEN, start);
+        stats.labels += label_used;
+        out_file.flush();
+        return (bool)out_file;
+    }
+
+    std::string gen_signature(NodeId head) {
+        const Symbol &symbol = sema.symbol(head);
+        std::string signature = "static " + c_type(symbol.type_descriptor->base) + " " + function_name(symbol) + "(";
+        int slot = 0;
+        for (TypeDescriptor *param = symbol.type_descriptor->base->next; param != nullptr; param = param->next, slot++)
+            signature += (slot ? ", " : "") + c_type(param) + " " + local_name(slot);
+        return signature + (slot ? ")" : "void)");
+    }
+
+    void gen_subprog(NodeId decl) {
+        NodeId head = ast.child[decl][0];
+        const Symbol &symbol = sema.symbol(head);
+        TypeDescriptor *return_type = symbol.type_descriptor->base;
+        std::string prologue, epilogue = "    return;\n";
+        if (return_type->id_type != IDType::VOID) {
+            prologue += "    " + c_type(return_type) + " " + local_name(symbol.slot) + " = 0;\n";
+            epilogue = "    return " + local_name(symbol.slot) + ";\n";
+        }
+        for (NodeId decl_list = ast.child[decl][1]; decl_list != NIL_NODE; decl_list = ast.next[decl_list]) {
+            for (NodeId id = ast.child[decl_list][0]; id != NIL_NODE; id = ast.next[id]) {
+                const Symbol &local = sema.symbol(id);
+                std::string value = local.type_descriptor->id_type == IDType::ARRAY ? "(" + c_type(local.type_descriptor) + ")" + gen_new_array(local.type_descriptor) :
+                                    local.type_descriptor->id_type == IDType::STRING ? "NULL" : "0";
+                prologue += "    " + c_type(local.type_descriptor) + " " + local_name(local.slot) + " = " + value + ";\n";
+            }
+        }
+        gen_stmt(ast.child[decl][3]);
+        write_function(gen_signature(head), prologue, epilogue);
+    }
+
+    void write_function(const std::string &signature, const std::string &prologue, const std::string &epilogue) {
+        std::string text = "\n" + signature + " {\n" + prologue;
+        for (size_t i = 0; i < temp_types.size(); i++)
+            text += "    " + temp_types[i] + " t" + std::to_string(i) + ";\n";
+        text += body + epilogue + "}\n";
+        out_file << text;
+        stats.bytes_written += text.size();
+        stats.methods++;
+        temp_types.clear();
+        body.clear();
+    }
+
+    /* Lowers one expression and returns the operand that holds its value:
+       a literal or a temporary, or "" for a procedure call. Like the
+       traverser, it walks with an explicit worklist. */
+    std::string gen_expr(NodeId root) {
+        size_t base = expr_work.size();
+        expr_work.push_back(ExprFrame{ExprTask::EVAL, root, nullptr, 0, 0});
+        while (expr_work.size() > base) {
+            ExprFrame frame = expr_work.back();
+            expr_work.pop_back();
+            NodeId node = frame.node;
+            if (frame.task == ExprTask::EVAL) {
+                gen_expr_eval(node);
+            } else if (frame.task == ExprTask::OP) {
+                gen_expr_op(node);
+            } else if (frame.task == ExprTask::NOT) {
+                std::string operand = pop_value();
+                std::string temp = new_temp("int32_t");
+                line(temp + " = " + operand + " ^ 1;");
+                values.push_back(temp);
+            } else if (frame.task == ExprTask::NEGATE) {
+                std::string operand = pop_value();
+                std::string temp = new_temp(c_scalar_type(sema.type(node)));
+                line(temp + " = " + (sema.type(node) == IDType::INT ? "mp_ineg(" + operand + ")" : "-" + operand) + ";");
+                values.push_back(temp);
+            } else if (frame.task == ExprTask::CALL) {
+                gen_call_end(node, frame.value);
+            } else if (frame.task == ExprTask::SUBSCRIPT) {
+                std::string index = pop_value();
+                std::string array = pop_value();
+                std::string temp = new_temp(c_type(frame.type_descriptor->base));
+                line(temp + " = " + array + "[" + gen_index(index, frame.type_descriptor) + "];");
+                values.push_back(temp);
+            } else if (frame.task == ExprTask::SHORT_CIRCUIT) {
+                /* a AND b is false / a OR b is true without evaluating b */
+                std::string temp = new_temp("int32_t");
+                int label = ++label_used;
+                line(temp + " = " + pop_value() + ";");
+                line(std::string(ast.metadata[node].oval == OpType::AND ? "if (!" : "if (") + temp + ") goto L" + std::to_string(label) + ";");
+                expr_work.push_back(ExprFrame{ExprTask::JOIN, node, nullptr, (int)temp_types.size() - 1, label});
+                expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[node][1], nullptr, 0, 0});
+            } else if (frame.task == ExprTask::JOIN) {
+                std::string temp = "t" + std::to_string(frame.value);
+                line(temp + " = " + pop_value() + ";");
+                body.append(indent_width(indent - 1), ' ');
+                body += "L" + std::to_string(frame.label) + ":;\n";
+                values.push_back(temp);
+            } else if (frame.task == ExprTask::CONCAT) {
+                std::string pieces;
+                for (size_t i = values.size() - frame.value; i < values.size(); i++)
+                    pieces += (pieces.empty() ? "" : ", ") + values[i];
+                values.resize(values.size() - frame.value);
+                std::string temp = new_temp("mp_string");
+                line(temp + " = mp_concat(" + std::to_string(frame.value) + ", (const mp_string[]){" + pieces + "});");
+                values.push_back(temp);
+            }
+        }
+        return pop_value();
+    }
+
+    void gen_expr_eval(NodeId root) {
+        NodeType kind = ast.kind[root];
+        if (kind == NodeType::LITERAL_INT) {
+            values.push_back(int_literal(ast.metadata[root].ival));
+        } else if (kind == NodeType::LITERAL_DBL) {
+            values.push_back(float_literal(ast.metadata[root].dval));
+        } else if (kind == NodeType::LITERAL_STR) {
+            values.push_back(ast.metadata[root].sval);
+        } else if (kind == NodeType::OP && (ast.metadata[root].oval == OpType::AND || ast.metadata[root].oval == OpType::OR) && is_boolean(ast, root)) {
+            expr_work.push_back(ExprFrame{ExprTask::SHORT_CIRCUIT, root, nullptr, 0, 0});
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[root][0], nullptr, 0, 0});
+        } else if (kind == NodeType::OP && ast.metadata[root].oval == OpType::ADD && sema.type(root) == IDType::STRING) {
+            gen_concat(root);
+        } else if (kind == NodeType::OP) {
+            expr_work.push_back(ExprFrame{ExprTask::OP, root, nullptr, 0, 0});
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[root][1], nullptr, 0, 0});
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[root][0], nullptr, 0, 0});
+        } else if (kind == NodeType::VAR && strcmp(ast.metadata[root].sval, "readlnI") == 0) {
+            std::string temp = new_temp("int32_t");
+            line(temp + " = mp_readlnI();");
+            values.push_back(temp);
+        } else if (kind == NodeType::PROCEDURE || (kind == NodeType::VAR && sema.symbol(root).storage == Storage::SUBPROG)) {
+            gen_call(root);
+        } else if (kind == NodeType::VAR) {
+            /* loaded into a temporary first: a call later in the expression may change the variable */
+            const Symbol &symbol = sema.symbol(root);
+            std::string temp = new_temp(c_type(symbol.type_descriptor));
+            line(temp + " = " + var_name(symbol) + ";");
+            values.push_back(temp);
+            size_t mark = expr_work.size();
+            TypeDescriptor *type_descriptor = symbol.type_descriptor;
+            for (NodeId tail = ast.child[root][0]; tail != NIL_NODE; tail = ast.next[tail], type_descriptor = type_descriptor->base) {
+                expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[tail][0], nullptr, 0, 0});
+                expr_work.push_back(ExprFrame{ExprTask::SUBSCRIPT, tail, type_descriptor, 0, 0});
+            }
+            std::reverse(expr_work.begin() + mark, expr_work.end());
+        } else if (kind == NodeType::NOT || kind == NodeType::NEGATE) {
+            expr_work.push_back(ExprFrame{kind == NodeType::NOT ? ExprTask::NOT : ExprTask::NEGATE, root, nullptr, 0, 0});
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[root][0], nullptr, 0, 0});
+        } else {
+            assert(false);
+        }
+    }
+
+    void gen_expr_op(NodeId root) {
+        std::string rhs = pop_value();
+        std::string lhs = pop_value();
+        OpType op = ast.metadata[root].oval;
+        IDType type = sema.type(ast.child[root][1]);
+        static const char *infix[] = {" & ", " | ", " < ", " > ", " == ", " <= ", " >= ", " != ", " + ", " - ", " * ", " / "};
+        std::string value;
+        if (type == IDType::INT && op == OpType::ADD)
+            value = "mp_iadd(" + lhs + ", " + rhs + ")";
+        else if (type == IDType::INT && op == OpType::SUB)
+            value = "mp_isub(" + lhs + ", " + rhs + ")";
+        else if (type == IDType::INT && op == OpType::MUL)
+            value = "mp_imul(" + lhs + ", " + rhs + ")";
+        else if (type == IDType::INT && op == OpType::DIV)
+            value = "mp_idiv(" + lhs + ", " + rhs + ")";
+        else if (op == OpType::SHL)
+            value = "mp_ishl(" + lhs + ", " + rhs + ")";
+        else
+            value = lhs + infix[(int)op] + rhs;
+        std::string temp = new_temp(c_scalar_type(sema.type(root)));
+        line(temp + " = " + value + ";");
+        values.push_back(temp);
+    }
+
+    /* evaluates the pieces of a string a + b + ... left to right, then joins them once */
+    void gen_concat(NodeId root) {
+        std::vector<NodeId> pieces;
+        std::vector<NodeId> pending{root};
+        while (!pending.empty()) {
+            NodeId node = pending.back();
+            pending.pop_back();
+            if (ast.kind[node] == NodeType::OP && ast.metadata[node].oval == OpType::ADD && sema.type(node) == IDType::STRING) {
+                pending.push_back(ast.child[node][1]);
+                pending.push_back(ast.child[node][0]);
+            } else if (!(ast.kind[node] == NodeType::LITERAL_STR && strcmp(ast.metadata[node].sval, "\"\"") == 0)) {
+                pieces.push_back(node);
+            }
+        }
+        if (pieces.empty()) {
+            values.push_back("\"\"");
+            return;
+        }
+        if (pieces.size() > 1)
+            expr_work.push_back(ExprFrame{ExprTask::CONCAT, root, nullptr, (int)pieces.size(), 0});
+        for (size_t i = pieces.size(); i-- > 0;)
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, pieces[i], nullptr, 0, 0});
+    }
+
+    void gen_call(NodeId root) {
+        int count = 0;
+        size_t mark = expr_work.size();
+        for (NodeId expr_list = ast.child[root][0]; expr_list != NIL_NODE; expr_list = ast.next[expr_list], count++)
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[expr_list][0], nullptr, 0, 0});
+        std::reverse(expr_work.begin() + mark, expr_work.end());
+        expr_work.insert(expr_work.begin() + mark, ExprFrame{ExprTask::CALL, root, nullptr, count, 0});
+    }
+
+    /* captured variables go first; they are locals of the caller, which no argument can change */
+    void gen_call_end(NodeId root, int count) {
+        const Symbol &callee = sema.symbol(root);
+        std::string args;
+        for (const SymbolId *arg = sema.captures_begin(root); arg != sema.captures_end(root); arg++)
+            args += (args.empty() ? "" : ", ") + var_name(sema.symbols[*arg]);
+        for (size_t i = values.size() - count; i < values.size(); i++)
+            args += (args.empty() ? "" : ", ") + values[i];
+        values.resize(values.size() - count);
+        std::string call = function_name(callee) + "(" + args + ")";
+        if (callee.type_descriptor->base->id_type == IDType::VOID) {
+            line(call + ";");
+            values.push_back("");
+            return;
+        }
+        std::string temp = new_temp(c_type(callee.type_descriptor->base));
+        line(temp + " = " + call + ";");
+        values.push_back(temp);
+    }
+
+    static std::string gen_index(const std::string &index, const TypeDescriptor *array) {
+        return "mp_index(mp_isub(" + index + ", " + int_literal(array->lower_bound) + "), " +
+               std::to_string(array->upper_bound - array->lower_bound + 1) + ")";
+    }
+
+    void gen_stmt(NodeId root) {
+        std::vector<StmtFrame> work{StmtFrame{StmtTask::EXEC, root}};
+        while (!work.empty()) {
+            StmtFrame frame = work.back();
+            work.pop_back();
+            if (frame.task == StmtTask::ELSE) {
+                indent--;
+                line("} else {");
+                indent++;
+            } else if (frame.task == StmtTask::CLOSE) {
+                indent--;
+                line("}");
+            } else {
+                gen_stmt_exec(frame.node, work);
+            }
+        }
+    }
+
+    void gen_stmt_exec(NodeId root, std::vector<StmtFrame> &work) {
+        if (root == NIL_NODE)
+            return;
+        NodeType kind = ast.kind[root];
+        if (kind == NodeType::STMT_LIST) {
+            size_t mark = work.size();
+            for (NodeId stmt_list = root; stmt_list != NIL_NODE; stmt_list = ast.next[stmt_list])
+                work.push_back(StmtFrame{StmtTask::EXEC, ast.child[stmt_list][0]});
+            std::reverse(work.begin() + mark, work.end());
+        } else if (kind == NodeType::ASSIGN) {
+            gen_assign(root);
+        } else if (kind == NodeType::IF) {
+            line("if (" + gen_expr(ast.child[root][0]) + ") {");
+            indent++;
+            work.push_back(StmtFrame{StmtTask::CLOSE, root});
+            if (ast.child[root][2] != NIL_NODE) {
+                work.push_back(StmtFrame{StmtTask::EXEC, ast.child[root][2]});
+                work.push_back(StmtFrame{StmtTask::ELSE, root});
+            }
+            work.push_back(StmtFrame{StmtTask::EXEC, ast.child[root][1]});
+        } else if (kind == NodeType::WHILE) {
+            line("for (;;) {");
+            indent++;
+            line("if (!(" + gen_expr(ast.child[root][0]) + ")) break;");
+            work.push_back(StmtFrame{StmtTask::CLOSE, root});
+            work.push_back(StmtFrame{StmtTask::EXEC, ast.child[root][1]});
+        } else if (kind == NodeType::PROCEDURE) {
+            const char *name = ast.metadata[root].sval;
+            if (strcmp(name, "writelnI") == 0 || strcmp(name, "writelnR") == 0 || strcmp(name, "writelnS") == 0)
+                line(std::string("mp_") + name + "(" + gen_expr(ast.child[ast.child[root][0]][0]) + ");");
+            else
+                gen_expr(root);
+        } else {
+            assert(false);
+        }
+    }
+
+    /* same order as the JVM: the array and its leading indexes, the value,
+       then the last index is checked by the store itself */
+    void gen_assign(NodeId root) {
+        NodeId var = ast.child[root][0];
+        const Symbol &symbol = sema.symbol(var);
+        if (symbol.storage == Storage::SUBPROG) {
+            line(local_name(symbol.slot) + " = " + gen_expr(ast.child[root][1]) + ";");
+            return;
+        }
+        if (ast.child[var][0] == NIL_NODE) {
+            line(var_name(symbol) + " = " + gen_expr(ast.child[root][1]) + ";");
+            return;
+        }
+        std::string array = new_temp(c_type(symbol.type_descriptor));
+        line(array + " = " + var_name(symbol) + ";");
+        TypeDescriptor *type_descriptor = symbol.type_descriptor;
+        NodeId tail = ast.child[var][0];
+        for (; ast.next[tail] != NIL_NODE; tail = ast.next[tail], type_descriptor = type_descriptor->base) {
+            std::string index = gen_expr(ast.child[tail][0]);
+            std::string element = new_temp(c_type(type_descriptor->base));
+            line(element + " = " + array + "[" + gen_index(index, type_descriptor) + "];");
+            array = element;
+        }
+        std::string index = gen_expr(ast.child[tail][0]);
+        std::string value = gen_expr(ast.child[root][1]);
+        line(array + "[" + gen_index(index, type_descriptor) + "] = " + value + ";");
+    }
+};
+
+#endif
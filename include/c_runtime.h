@@ -0,0 +1,102 @@
+#ifndef C_RUNTIME_H
+#define C_RUNTIME_H
+
+#include <string>
+#include "runtime_shared.h"
+
+/* The runtime every program built with --emit=c starts with, so the output
+   is one self-contained C file. It keeps the JVM's semantics where C would
+   differ: integer arithmetic wraps, division by zero and out-of-range
+   indexes stop the program with the JVM's exception text, a null string
+   prints as "null", and reals print like Float.toString. */
+static const char C_RUNTIME_BEGIN[] = R"RUNTIME(#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef const char *mp_string;
+
+static void mp_fail(const char *what) {
+    fflush(stdout);
+    fprintf(stderr, "Exception in thread \"main\" %s\n", what);
+    exit(1);
+}
+
+static int32_t mp_iadd(int32_t a, int32_t b) { return (int32_t)((uint32_t)a + (uint32_t)b); }
+static int32_t mp_isub(int32_t a, int32_t b) { return (int32_t)((uint32_t)a - (uint32_t)b); }
+static int32_t mp_imul(int32_t a, int32_t b) { return (int32_t)((uint32_t)a * (uint32_t)b); }
+static int32_t mp_ineg(int32_t a) { return (int32_t)(0u - (uint32_t)a); }
+static int32_t mp_ishl(int32_t a, int32_t b) { return (int32_t)((uint32_t)a << (b & 31)); }
+
+static int32_t mp_idiv(int32_t a, int32_t b) {
+    if (b == 0)
+        mp_fail("java.lang.ArithmeticException: / by zero");
+    return b == -1 ? mp_ineg(a) : a / b;
+}
+
+static int32_t mp_index(int32_t index, int32_t length) {
+    if ((uint32_t)index >= (uint32_t)length) {
+        char what[128];
+        snprintf(what, sizeof(what), "java.lang.ArrayIndexOutOfBoundsException: Index %d out of bounds for length %d", (int)index, (int)length);
+        mp_fail(what);
+    }
+    return index;
+}
+
+/* like multianewarray: every level allocated, elements zeroed (0, 0.0, null) */
+static void *mp_new_array(int dims, const int32_t *extents, size_t element_size) {
+    for (int i = 0; i < dims; i++) {
+        if (extents[i] < 0) {
+            char what[64];
+            snprintf(what, sizeof(what), "java.lang.NegativeArraySizeException: %d", (int)extents[i]);
+            mp_fail(what);
+        }
+    }
+    size_t count = extents[0] > 0 ? (size_t)extents[0] : 1;
+    void *array = calloc(count, dims == 1 ? element_size : sizeof(void*));
+    if (array == NULL)
+        mp_fail("java.lang.OutOfMemoryError");
+    for (int32_t i = 0; dims > 1 && i < extents[0]; i++)
+        ((void**)array)[i] = mp_new_array(dims - 1, extents + 1, element_size);
+    return array;
+}
+
+static mp_string mp_str(mp_string s) { return s != NULL ? s : "null"; }
+
+static mp_string mp_concat(int count, const mp_string *pieces) {
+    size_t length = 0;
+    for (int i = 0; i < count; i++)
+        length += strlen(mp_str(pieces[i]));
+    char *s = (char*)malloc(length + 1);
+    if (s == NULL)
+        mp_fail("java.lang.OutOfMemoryError");
+    char *end = s;
+    for (int i = 0; i < count; i++) {
+        size_t n = strlen(mp_str(pieces[i]));
+        memcpy(end, mp_str(pieces[i]), n);
+        end += n;
+    }
+    *end = '\0';
+    return s;
+}
+
+)RUNTIME";
+
+static const char C_RUNTIME_WRITE[] = R"RUNTIME(static void mp_writelnI(int32_t v) { printf("%d\n", (int)v); }
+static void mp_writelnS(mp_string s) { puts(mp_str(s)); }
+
+static void mp_writelnR(float v) {
+    char text[48];
+    mp_format_float(v, text);
+    puts(text);
+}
+
+)RUNTIME";
+
+/* the pieces in order, each shared function before its first use */
+static std::string c_runtime() {
+    return std::string(C_RUNTIME_BEGIN) + MP_FORMAT_FLOAT + "\n\n" + C_RUNTIME_WRITE + MP_READLN_I + "\n";
+}
+
+#endif
@@ -0,0 +1,418 @@
+#ifndef CLASS_WRITER_H
+#define CLASS_WRITER_H
+
+#include <cstdio>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "jvm.h"
+
+/* Constant pool with deduplication: every entry is keyed by its tag and
+   payload, so repeated references resolve to the same index. Indices and
+   UTF-8 lengths are u2: past either limit the pool is marked and the
+   ClassWriter refuses to write the class. */
+struct ConstantPool {
+    enum Tag : uint8_t {
+        UTF8 = 1, INTEGER = 3, FLOAT = 4, CLASS = 7, STRING = 8,
+        FIELDREF = 9, METHODREF = 10, NAME_AND_TYPE = 12
+    };
+
+    std::vector<uint8_t> bytes;
+    std::unordered_map<std::string, uint16_t> index;
+    uint16_t count = 1;
+    bool full = false;
+    bool long_utf8 = false;
+    size_t lookups = 0;
+    size_t hits = 0;
+
+    uint16_t utf8(const std::string &s) {
+        std::string key = std::string(1, (char)UTF8) + s;
+        return lookup(key, [&]() {
+            std::string encoded = modified_utf8(s);
+            long_utf8 = long_utf8 || encoded.size() > 65535;
+            put_u1(UTF8);
+            put_u2((uint16_t)encoded.size());
+            bytes.insert(bytes.end(), encoded.begin(), encoded.end());
+        });
+    }
+
+    uint16_t integer(int32_t value) {
+        std::string key = std::string(1, (char)INTEGER) + std::to_string(value);
+        return lookup(key, [&]() {
+            put_u1(INTEGER);
+            put_u4((uint32_t)value);
+        });
+    }
+
+    uint16_t float_const(float value) {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        std::string key = std::string(1, (char)FLOAT) + std::to_string(bits);
+        return lookup(key, [&]() {
+            put_u1(FLOAT);
+            put_u4(bits);
+        });
+    }
+
+    uint16_t class_ref(const std::string &name) {
+        uint16_t name_index = utf8(name);
+        return lookup(std::string(1, (char)CLASS) + name, [&]() {
+            put_u1(CLASS);
+            put_u2(name_index);
+        });
+    }
+
+    uint16_t string(const std::string &s) {
+        uint16_t utf8_index = utf8(s);
+        return lookup(std::string(1, (char)STRING) + s, [&]() {
+            put_u1(STRING);
+            put_u2(utf8_index);
+        });
+    }
+
+    uint16_t name_and_type(const std::string &name, const std::string &descriptor) {
+        uint16_t name_index = utf8(name);
+        uint16_t descriptor_index = utf8(descriptor);
+        return lookup(std::string(1, (char)NAME_AND_TYPE) + name + " " + descriptor, [&]() {
+            put_u1(NAME_AND_TYPE);
+            put_u2(name_index);
+            put_u2(descriptor_index);
+        });
+    }
+
+    /* ref is a Jasmin member reference: "owner/name desc" or "owner/name(args)ret" */
+    uint16_t member_ref(Tag tag, const std::string &ref) {
+        size_t split = tag == FIELDREF ? ref.find(' ') : ref.find('(');
+        std::string qualified_name = ref.substr(0, split);
+        std::string descriptor = ref.substr(tag == FIELDREF ? split + 1 : split);
+        size_t slash = qualified_name.find_last_of('/');
+        uint16_t class_index = class_ref(qualified_name.substr(0, slash));
+        uint16_t name_and_type_index = name_and_type(qualified_name.substr(slash + 1), descriptor);
+        return lookup(std::string(1, (char)tag) + ref, [&]() {
+            put_u1(tag);
+            put_u2(class_index);
+            put_u2(name_and_type_index);
+        });
+    }
+
+    template <typename F>
+    uint16_t lookup(const std::string &key, F append_entry) {
+        lookups++;
+        auto it = index.find(key);
+        if (it != index.end()) {
+            hits++;
+            return it->second;
+        }
+        if (count == 65535) {
+            full = true;
+            return 0;
+        }
+        append_entry();
+        index.emplace(key, count);
+        return count++;
+    }
+
+    static std::string modified_utf8(const std::string &s) {
+        std::string encoded;
+        for (char c : s) {
+            if (c == '\0')
+                encoded += "\xc0\x80";
+            else
+                encoded += c;
+        }
+        return encoded;
+    }
+
+    void put_u1(uint8_t v) { bytes.push_back(v); }
+    void put_u2(uint16_t v) { put_u1(v >> 8); put_u1(v & 0xff); }
+    void put_u4(uint32_t v) { put_u2(v >> 16); put_u2(v & 0xffff); }
+};
+
+/* Assembles a JvmClass straight into the class file format, choosing short
+   and wide instruction forms and resolving label operands to branch offsets. */
+struct ClassWriter {
+    static constexpr uint16_t MAJOR_VERSION = 49;
+
+    std::ostream &out;
+    FILE *diag;
+    ConstantPool constant_pool;
+    std::string class_name;
+
+    /* everything after the constant pool; the pool is only complete once
+       the last method is encoded, so the body is held until finish() */
+    std::vector<uint8_t> body;
+    size_t method_count_at = 0;
+    uint16_t method_count = 0;
+    bool ok = true;
+
+    explicit ClassWriter(std::ostream &out, FILE *diag = stderr) : out(out), diag(diag) {}
+
+    bool write(const JvmClass &jvm_class) {
+        begin(jvm_class);
+        for (const Method &method : jvm_class.methods)
+            add_method(method);
+        return finish();
+    }
+
+    /* the class and its fields; methods are then added one at a time */
+    void begin(const JvmClass &jvm_class) {
+        class_name = jvm_class.name;
+        uint16_t this_class = constant_pool.class_ref(jvm_class.name);
+        uint16_t super_class = constant_pool.class_ref(jvm_class.super_name);
+        put_u2(body, 0x0021);
+        put_u2(body, this_class);
+        put_u2(body, super_class);
+        put_u2(body, 0);
+
+        put_u2(body, (uint16_t)jvm_class.fields.size());
+        for (const Field &field : jvm_class.fields) {
+            put_u2(body, access_flags(field.access));
+            put_u2(body, constant_pool.utf8(field.name));
+            put_u2(body, constant_pool.utf8(field.descriptor));
+            put_u2(body, 0);
+        }
+
+        method_count_at = body.size();
+        put_u2(body, 0);
+    }
+
+    bool add_method(const Method &method) {
+        if (ok && write_method(body, method))
+            method_count++;
+        else
+            ok = false;
+        return ok;
+    }
+
+    bool finish() {
+        if (ok && constant_pool.full) {
+            fprintf(diag, "[ERROR] class %s exceeds the 65535-entry constant pool limit\n", class_name.c_str());
+            ok = false;
+        }
+        if (ok && constant_pool.long_utf8) {
+            fprintf(diag, "[ERROR] class %s has a constant over the 64KB string limit\n", class_name.c_str());
+            ok = false;
+        }
+        if (!ok)
+            return false;
+        body[method_count_at] = method_count >> 8;
+        body[method_count_at + 1] = method_count & 0xff;
+        put_u2(body, 0);
+
+        std::vector<uint8_t> header;
+        put_u4(header, 0xcafebabe);
+        put_u2(header, 0);
+        put_u2(header, MAJOR_VERSION);
+        put_u2(header, constant_pool.count);
+        out.write(reinterpret_cast<const char*>(header.data()), header.size());
+        out.write(reinterpret_cast<const char*>(constant_pool.bytes.data()), constant_pool.bytes.size());
+        out.write(reinterpret_cast<const char*>(body.data()), body.size());
+        return (bool)out;
+    }
+
+    bool write_method(std::vector<uint8_t> &body, const Method &method) {
+        std::vector<uint8_t> code;
+        std::unordered_map<int, uint32_t> label_offset;
+        if (!encode(method, code, label_offset))
+            return false;
+        put_u2(body, access_flags(method.access));
+        put_u2(body, constant_pool.utf8(method.name));
+        put_u2(body, constant_pool.utf8(method.descriptor));
+        put_u2(body, 1);
+        put_u2(body, constant_pool.utf8("Code"));
+        put_u4(body, (uint32_t)(12 + code.size() + 8 * method.handlers.size()));
+        put_u2(body, (uint16_t)method.max_stack);
+        put_u2(body, (uint16_t)method.max_locals);
+        put_u4(body, (uint32_t)code.size());
+        body.insert(body.end(), code.begin(), code.end());
+        put_u2(body, (uint16_t)method.handlers.size());
+        for (const Handler &handler : method.handlers) {
+            put_u2(body, (uint16_t)label_offset.at(handler.start));
+            put_u2(body, (uint16_t)label_offset.at(handler.end));
+            put_u2(body, (uint16_t)label_offset.at(handler.handler));
+            put_u2(body, 0);
+        }
+        put_u2(body, 0);
+        return true;
+    }
+
+    /* Two passes: the first fixes every instruction's size (resolving
+       constant pool indices, which decide ldc vs ldc_w) and so every label's
+       offset; the second emits bytes with the branch offsets filled in. */
+    bool encode(const Method &method, std::vector<uint8_t> &code, std::unordered_map<int, uint32_t> &label_offset) {
+        std::vector<uint16_t> cp_index(method.code.size(), 0);
+        std::vector<uint32_t> offset(method.code.size(), 0);
+        uint32_t pc = 0;
+        for (size_t i = 0; i < method.code.size(); i++) {
+            const Insn &insn = method.code[i];
+            offset[i] = pc;
+            cp_index[i] = resolve_constant(insn);
+            if (insn.opcode == Opcode::LABEL)
+                label_offset[insn.ival] = pc;
+            pc += insn_size(insn, cp_index[i]);
+        }
+        if (pc > 65535) {
+            fprintf(diag, "[ERROR] method %s exceeds the 64KB code limit\n", method.name.c_str());
+            return false;
+        }
+
+        for (size_t i = 0; i < method.code.size(); i++) {
+            const Insn &insn = method.code[i];
+            if (insn.opcode == Opcode::LABEL)
+                continue;
+            if (is_branch(insn.opcode)) {
+                int32_t delta = (int32_t)label_offset.at(insn.ival) - (int32_t)offset[i];
+                if (delta < -32768 || delta > 32767) {
+                    fprintf(diag, "[ERROR] branch offset out of range in method %s\n", method.name.c_str());
+                    return false;
+                }
+                code.push_back((uint8_t)insn.opcode);
+                put_u2(code, (uint16_t)delta);
+            } else {
+                encode_insn(code, insn, cp_index[i]);
+            }
+        }
+        return true;
+    }
+
+    uint16_t resolve_constant(const Insn &insn) {
+        switch (insn.opcode) {
+            case Opcode::LDC_INT: return constant_pool.integer(insn.ival);
+            case Opcode::LDC_FLOAT: return constant_pool.float_const((float)insn.dval);
+            case Opcode::LDC_STRING: return constant_pool.string(unquote(insn.sval));
+            case Opcode::GETSTATIC:
+            case Opcode::PUTSTATIC: return constant_pool.member_ref(ConstantPool::FIELDREF, insn.sval);
+            case Opcode::INVOKEVIRTUAL:
+            case Opcode::INVOKESPECIAL:
+            case Opcode::INVOKESTATIC: return constant_pool.member_ref(ConstantPool::METHODREF, insn.sval);
+            case Opcode::NEW:
+            case Opcode::ANEWARRAY:
+            case Opcode::MULTIANEWARRAY: return constant_pool.class_ref(insn.sval);
+            default: return 0;
+        }
+    }
+
+    static bool is_local_access(Opcode opcode) {
+        return opcode == Opcode::ILOAD || opcode == Opcode::FLOAD || opcode == Opcode::ALOAD ||
+               opcode == Opcode::ISTORE || opcode == Opcode::FSTORE || opcode == Opcode::ASTORE;
+    }
+
+    static uint32_t insn_size(const Insn &insn, uint16_t cp_index) {
+        if (insn.opcode == Opcode::LABEL)
+            return 0;
+        if (is_local_access(insn.opcode))
+            return insn.ival <= 3 ? 1 : insn.ival <= 255 ? 2 : 4;
+        if (insn.opcode == Opcode::IINC)
+            return insn.ival <= 255 && insn.ival2 >= -128 && insn.ival2 <= 127 ? 3 : 6;
+        if (insn.opcode == Opcode::LDC_INT || insn.opcode == Opcode::LDC_FLOAT || insn.opcode == Opcode::LDC_STRING)
+            return cp_index <= 255 ? 2 : 3;
+        if (insn.opcode == Opcode::BIPUSH || insn.opcode == Opcode::NEWARRAY)
+            return 2;
+        if (insn.opcode == Opcode::MULTIANEWARRAY)
+            return 4;
+        if (insn.opcode == Opcode::SIPUSH || is_branch(insn.opcode) ||
+            insn.opcode == Opcode::GETSTATIC || insn.opcode == Opcode::PUTSTATIC ||
+            insn.opcode == Opcode::INVOKEVIRTUAL || insn.opcode == Opcode::INVOKESPECIAL ||
+            insn.opcode == Opcode::INVOKESTATIC || insn.opcode == Opcode::NEW || insn.opcode == Opcode::ANEWARRAY)
+            return 3;
+        return 1;
+    }
+
+    static void encode_insn(std::vector<uint8_t> &code, const Insn &insn, uint16_t cp_index) {
+        if (is_local_access(insn.opcode)) {
+            uint8_t base = (uint8_t)insn.opcode;
+            if (insn.ival <= 3) {
+                /* iload_0 etc.: loads start at 0x1a, stores at 0x3b, four per type */
+                uint8_t short_base = base < 0x36 ? 0x1a + (base - 0x15) * 4 : 0x3b + (base - 0x36) * 4;
+                code.push_back(short_base + insn.ival);
+            } else if (insn.ival <= 255) {
+                code.push_back(base);
+                code.push_back((uint8_t)insn.ival);
+            } else {
+                code.push_back(0xc4);
+                code.push_back(base);
+                put_u2(code, (uint16_t)insn.ival);
+            }
+        } else if (insn.opcode == Opcode::IINC) {
+            if (insn.ival <= 255 && insn.ival2 >= -128 && insn.ival2 <= 127) {
+                code.push_back(0x84);
+                code.push_back((uint8_t)insn.ival);
+                code.push_back((uint8_t)(int8_t)insn.ival2);
+            } else {
+                code.push_back(0xc4);
+                code.push_back(0x84);
+                put_u2(code, (uint16_t)insn.ival);
+                put_u2(code, (uint16_t)(int16_t)insn.ival2);
+            }
+        } else if (insn.opcode == Opcode::LDC_INT || insn.opcode == Opcode::LDC_FLOAT || insn.opcode == Opcode::LDC_STRING) {
+            if (cp_index <= 255) {
+                code.push_back(0x12);
+                code.push_back((uint8_t)cp_index);
+            } else {
+                code.push_back(0x13);
+                put_u2(code, cp_index);
+            }
+        } else if (insn.opcode == Opcode::BIPUSH) {
+            code.push_back(0x10);
+            code.push_back((uint8_t)(int8_t)insn.ival);
+        } else if (insn.opcode == Opcode::SIPUSH) {
+            code.push_back(0x11);
+            put_u2(code, (uint16_t)(int16_t)insn.ival);
+        } else if (insn.opcode == Opcode::NEWARRAY) {
+            code.push_back(0xbc);
+            code.push_back(insn.sval == "float" ? 6 : 10);
+        } else if (insn.opcode == Opcode::MULTIANEWARRAY) {
+            code.push_back(0xc5);
+            put_u2(code, cp_index);
+            code.push_back((uint8_t)insn.ival);
+        } else if (cp_index != 0) {
+            code.push_back((uint8_t)insn.opcode);
+            put_u2(code, cp_index);
+        } else {
+            code.push_back((uint8_t)insn.opcode);
+        }
+    }
+
+    /* decodes a source string literal (with its quotes) the way Jasmin does */
+    static std::string unquote(const std::string &literal) {
+        std::string s;
+        for (size_t i = 1; i + 1 < literal.size(); i++) {
+            char c = literal[i];
+            if (c == '\\' && i + 2 < literal.size()) {
+                char e = literal[++i];
+                if (e == 'n') s += '\n';
+                else if (e == 't') s += '\t';
+                else if (e == 'r') s += '\r';
+                else if (e == 'b') s += '\b';
+                else if (e == 'f') s += '\f';
+                else s += e;
+            } else {
+                s += c;
+            }
+        }
+        return s;
+    }
+
+    static uint16_t access_flags(const std::string &access) {
+        uint16_t flags = 0;
+        if (access.find("public") != std::string::npos) flags |= 0x0001;
+        if (access.find("private") != std::string::npos) flags |= 0x0002;
+        if (access.find("static") != std::string::npos) flags |= 0x0008;
+        if (access.find("final") != std::string::npos) flags |= 0x0010;
+        return flags;
+    }
+
+    static void put_u2(std::vector<uint8_t> &v, uint16_t x) {
+        v.push_back(x >> 8);
+        v.push_back(x & 0xff);
+    }
+
+    static void put_u4(std::vector<uint8_t> &v, uint32_t x) {
+        put_u2(v, x >> 16);
+        put_u2(v, x & 0xffff);
+    }
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef COMPILE_CONTEXT_H
+#define COMPILE_CONTEXT_H
+
+#include <cstdio>
+#include "arena.h"
+#include "ast.h"
+#include "compile_stats.h"
+
+/* Everything one compilation owns. The scanner and the parser are reentrant
+   and reach their state only through this object, so several files can be
+   compiled at the same time on different threads. */
+struct CompileContext {
+    Arena arena;
+    InternTable intern_table{arena};
+    Ast ast;
+    NodeId root = NIL_NODE;
+    int pass_error = 0;
+    CompileStats stats;
+
+    /* scanner position and source listing; the source is scanned in place,
+       so the current line is the text from line_start up to the token */
+    int line_no = 1;
+    int col_no = 1;
+    int opt_list = 0;
+    int opt_token = 0;
+    const char *line_start = "";
+
+    /* where the listing, the scope and symbol trace and the diagnostics go;
+       the batch driver and the server point these at per-compile buffers */
+    FILE *listing = stdout;
+    FILE *trace = stdout;
+    FILE *diag = stderr;
+
+    /* back to the state of a fresh context, keeping the memory it holds */
+    void reset() {
+        arena.reset();
+        intern_table.clear();
+        ast.clear();
+        root = NIL_NODE;
+        pass_error = 0;
+        stats = CompileStats();
+        line_no = col_no = 1;
+        opt_list = 0;
+        opt_token = 0;
+        line_start = "";
+    }
+};
+
+#endif
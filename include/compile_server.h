@@ -0,0 +1,376 @@
+#ifndef COMPILE_SERVER_H
+#define COMPILE_SERVER_H
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Compile server: a long-lived compiler process listening on a Unix domain
+   socket, so CI does not pay process startup per file, with a cache of
+   results keyed by the source bytes and every flag that affects the output.
+   A repeated request is answered from memory or from the cache directory
+   without lexing. The client side lives here as well; the compiler's main
+   turns into a thin client when a server socket is configured. */
+
+/* one compile request; the class name comes from the output file name, so it is part of the key */
+struct CompileRequest {
+    uint32_t opt_level = 0;
+    uint32_t opt_report = 0;
+    uint32_t opt_mem_stats = 0;
+    uint32_t emit_format = 0;
+    uint32_t opt_list = 0;
+    uint32_t flat_arrays = 0;
+    uint32_t unbuffered_io = 0;
+    std::string basename;
+    std::string source;
+
+    /* the cache key: everything that can change the result, plus the
+       build of the compiler so that a rebuilt server ignores old entries */
+    std::string key() const {
+        std::string key = "mpc " __DATE__ " " __TIME__;
+        key += '\0' + std::to_string(opt_level) + ' ' + std::to_string(opt_report) + ' ' +
+               std::to_string(opt_mem_stats) + ' ' + std::to_string(emit_format) + ' ' + std::to_string(opt_list) + ' ' + std::to_string(flat_arrays) + ' ' +
+               std::to_string(unbuffered_io) + '\0' + basename + '\0';
+        key += source;
+        return key;
+    }
+};
+
+struct CompileResult {
+    uint32_t status = 0;
+    std::string output;
+    std::string listing;
+    std::string diag;
+};
+
+enum class RequestType : uint32_t { COMPILE, STATS, STOP };
+
+/* length-prefixed framing over a stream socket */
+struct Channel {
+    int fd;
+
+    bool write_all(const void *data, size_t size) {
+        const char *p = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t n = ::write(fd, p, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool read_all(void *data, size_t size) {
+        char *p = static_cast<char*>(data);
+        while (size > 0) {
+            ssize_t n = ::read(fd, p, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool put_u32(uint32_t value) { return write_all(&value, sizeof(value)); }
+    bool get_u32(uint32_t &value) { return read_all(&value, sizeof(value)); }
+
+    bool put_blob(const std::string &blob) {
+        return put_u32((uint32_t)blob.size()) && write_all(blob.data(), blob.size());
+    }
+
+    bool get_blob(std::string &blob) {
+        uint32_t size;
+        if (!get_u32(size))
+            return false;
+        blob.resize(size);
+        return read_all(&blob[0], size);
+    }
+
+    bool put_request(const CompileRequest &request) {
+        return put_u32((uint32_t)RequestType::COMPILE) && put_u32(request.opt_level) && put_u32(request.opt_report) &&
+               put_u32(request.opt_mem_stats) && put_u32(request.emit_format) && put_u32(request.opt_list) &&
+               put_u32(request.flat_arrays) && put_u32(request.unbuffered_io) && put_blob(request.basename) && put_blob(request.source);
+    }
+
+    bool get_request(CompileRequest &request) {
+        return get_u32(request.opt_level) && get_u32(request.opt_report) && get_u32(request.opt_mem_stats) &&
+               get_u32(request.emit_format) && get_u32(request.opt_list) &&
+               get_u32(request.flat_arrays) && get_u32(request.unbuffered_io) && get_blob(request.basename) && get_blob(request.source);
+    }
+
+    bool put_result(const CompileResult &result) {
+        return put_u32(result.status) && put_blob(result.output) && put_blob(result.listing) && put_blob(result.diag);
+    }
+
+    bool get_result(CompileResult &result) {
+        return get_u32(result.status) && get_blob(result.output) && get_blob(result.listing) && get_blob(result.diag);
+    }
+};
+
+static bool make_socket_address(const std::string &path, sockaddr_un &address) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+        return false;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+/* Results by key hash. Memory holds the most recently used entries up to a
+   byte budget and evicts the least recently used; every entry is also
+   written to the cache directory, which survives restarts. Entries store
+   their full key and a hit compares it, so a hash collision is a miss. */
+struct CompileCache {
+    struct Entry {
+        std::string key;
+        CompileResult result;
+        std::list<uint64_t>::iterator lru;
+    };
+
+    std::string dir;
+    size_t memory_budget;
+    size_t memory_used = 0;
+    std::unordered_map<uint64_t, Entry> entries;
+    std::list<uint64_t> lru;
+
+    size_t memory_hits = 0;
+    size_t disk_hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+
+    CompileCache(std::string dir, size_t memory_budget) : dir(std::move(dir)), memory_budget(memory_budget) {
+        mkdir(this->dir.c_str(), 0777);
+    }
+
+    static uint64_t hash_key(const std::string &key) {
+        uint64_t h = 14695981039346656037ull;
+        for (unsigned char c : key)
+            h = (h ^ c) * 1099511628211ull;
+        return h;
+    }
+
+    static size_t entry_size(const Entry &entry) {
+        return entry.key.size() + entry.result.output.size() + entry.result.listing.size() + entry.result.diag.size();
+    }
+
+    std::string path_of(uint64_t hash) const {
+        char name[17];
+        snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+        return dir + "/" + name;
+    }
+
+    bool lookup(const std::string &key, CompileResult &result) {
+        uint64_t hash = hash_key(key);
+        auto it = entries.find(hash);
+        if (it != entries.end() && it->second.key == key) {
+            lru.splice(lru.begin(), lru, it->second.lru);
+            result = it->second.result;
+            memory_hits++;
+            return true;
+        }
+        if (load(hash, key, result)) {
+            remember(hash, key, result);
+            disk_hits++;
+            return true;
+        }
+        misses++;
+        return false;
+    }
+
+    void store(const std::string &key, const CompileResult &result) {
+        uint64_t hash = hash_key(key);
+        remember(hash, key, result);
+        save(hash, key, result);
+    }
+
+    void remember(uint64_t hash, const std::string &key, const CompileResult &result) {
+        auto it = entries.find(hash);
+        if (it != entries.end()) {
+            memory_used -= entry_size(it->second);
+            lru.erase(it->second.lru);
+            entries.erase(it);
+        }
+        lru.push_front(hash);
+        Entry &entry = entries[hash];
+        entry = Entry{key, result, lru.begin()};
+        memory_used += entry_size(entry);
+        while (memory_used > memory_budget && lru.size() > 1) {
+            auto victim = entries.find(lru.back());
+            memory_used -= entry_size(victim->second);
+            entries.erase(victim);
+            lru.pop_back();
+            evictions++;
+        }
+    }
+
+    /* file layout: key, status, output, listing, diag, each length-prefixed */
+    void save(uint64_t hash, const std::string &key, const CompileResult &result) {
+        std::string path = path_of(hash);
+        std::string tmp = path + ".tmp" + std::to_string(getpid());
+        std::ofstream file(tmp, std::ios::out | std::ios::binary);
+        auto put = [&](const std::string &blob) {
+            uint32_t size = (uint32_t)blob.size();
+            file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+            file.write(blob.data(), blob.size());
+        };
+        put(key);
+        file.write(reinterpret_cast<const char*>(&result.status), sizeof(result.status));
+        put(result.output);
+        put(result.listing);
+        put(result.diag);
+        file.close();
+        if (!file || rename(tmp.c_str(), path.c_str()) != 0)
+            unlink(tmp.c_str());
+    }
+
+    bool load(uint64_t hash, const std::string &key, CompileResult &result) {
+        std::ifstream file(path_of(hash), std::ios::in | std::ios::binary);
+        if (!file)
+            return false;
+        auto get = [&](std::string &blob) {
+            uint32_t size = 0;
+            file.read(reinterpret_cast<char*>(&size), sizeof(size));
+            if (!file)
+                return false;
+            blob.resize(size);
+            file.read(&blob[0], size);
+            return (bool)file;
+        };
+        std::string stored_key;
+        if (!get(stored_key) || stored_key != key)
+            return false;
+        file.read(reinterpret_cast<char*>(&result.status), sizeof(result.status));
+        return file && get(result.output) && get(result.listing) && get(result.diag);
+    }
+
+    std::string stats() const {
+        char line[256];
+        snprintf(line, sizeof(line),
+                 "[INFO ] cache: %zu hits (%zu memory, %zu disk), %zu misses, %zu evictions, %zu entries in %zu bytes\n",
+                 memory_hits + disk_hits, memory_hits, disk_hits, misses, evictions, entries.size(), memory_used);
+        return line;
+    }
+};
+
+static volatile sig_atomic_t server_stop_requested = 0;
+
+static void request_server_stop(int) { server_stop_requested = 1; }
+
+/* Serves requests one at a time until a STOP request or SIGINT/SIGTERM.
+   Misses are handed to compile, which the caller implements with a context
+   it keeps (and resets) between requests. */
+static int run_compile_server(const std::string &socket_path, CompileCache &cache,
+                              const std::function<void(const CompileRequest&, CompileResult&)> &compile) {
+    sockaddr_un address;
+    if (!make_socket_address(socket_path, address)) {
+        fprintf(stderr, "[ERROR] socket path too long: %s\n", socket_path.c_str());
+        return 1;
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path.c_str());
+    if (listen_fd < 0 || bind(listen_fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(listen_fd, 64) != 0) {
+        fprintf(stderr, "[ERROR] cannot listen on %s: %s\n", socket_path.c_str(), strerror(errno));
+        return 1;
+    }
+
+    /* no SA_RESTART, so a signal interrupts accept() */
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_server_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "[INFO ] server: listening on %s\n", socket_path.c_str());
+    while (!server_stop_requested) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        Channel channel{fd};
+        uint32_t type;
+        if (channel.get_u32(type)) {
+            if (type == (uint32_t)RequestType::COMPILE) {
+                CompileRequest request;
+                CompileResult result;
+                if (channel.get_request(request)) {
+                    std::string key = request.key();
+                    if (!cache.lookup(key, result)) {
+                        compile(request, result);
+                        cache.store(key, result);
+                    }
+                    channel.put_result(result);
+                }
+            } else if (type == (uint32_t)RequestType::STATS) {
+                channel.put_blob(cache.stats());
+            } else if (type == (uint32_t)RequestType::STOP) {
+                server_stop_requested = 1;
+                channel.put_blob(cache.stats());
+            }
+        }
+        close(fd);
+    }
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    fputs(cache.stats().c_str(), stderr);
+    return 0;
+}
+
+static int connect_to_server(const std::string &socket_path) {
+    sockaddr_un address;
+    if (!make_socket_address(socket_path, address))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* false if the server could not be reached or hung up, so the caller can compile locally instead */
+static bool request_compile(const std::string &socket_path, const CompileRequest &request, CompileResult &result) {
+    int fd = connect_to_server(socket_path);
+    if (fd < 0)
+        return false;
+    signal(SIGPIPE, SIG_IGN);
+    Channel channel{fd};
+    bool ok = channel.put_request(request) && channel.get_result(result);
+    close(fd);
+    return ok;
+}
+
+/* sends STATS or STOP and prints the server's cache statistics */
+static int request_control(const std::string &socket_path, RequestType type) {
+    int fd = connect_to_server(socket_path);
+    if (fd < 0) {
+        fprintf(stderr, "[ERROR] cannot connect to %s\n", socket_path.c_str());
+        return 1;
+    }
+    Channel channel{fd};
+    std::string stats;
+    bool ok = channel.put_u32((uint32_t)type) && channel.get_blob(stats);
+    close(fd);
+    fputs(stats.c_str(), stderr);
+    return !ok;
+}
+
+#endif
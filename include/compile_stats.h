@@ -0,0 +1,77 @@
+#ifndef COMPILE_STATS_H
+#define COMPILE_STATS_H
+
+#include <chrono>
+#include <cstdio>
+
+/* Where one compile spends its time (--time-report, --stats). Phases are
+   timed only when timing is on, so a normal compile never reads the clock;
+   the counters are plain increments and are always kept. */
+struct CompileStats {
+    enum Phase { LEX, PARSE, SEMA, FOLD, CODEGEN, PEEPHOLE, SLOTS, FRAMES, WRITE, PHASE_COUNT };
+
+    bool timing = false;
+    double seconds[PHASE_COUNT] = {};
+
+    size_t tokens = 0;
+    size_t nodes = 0;
+    size_t symbols_added = 0;
+    size_t lookups = 0;
+    size_t scopes_walked = 0;
+    size_t labels = 0;
+    size_t insns_generated = 0;
+    size_t insns_written = 0;
+    size_t methods = 0;
+    size_t bytes_written = 0;
+
+    static const char* phase_name(int phase) {
+        static const char *names[PHASE_COUNT] = {"lex", "parse", "sema", "fold", "codegen", "peephole", "slots", "frames", "write"};
+        return names[phase];
+    }
+
+    typedef std::chrono::steady_clock Clock;
+
+    Clock::time_point start() const { return timing ? Clock::now() : Clock::time_point(); }
+
+    void stop(Phase phase, Clock::time_point since) {
+        if (timing)
+            seconds[phase] += std::chrono::duration<double>(Clock::now() - since).count();
+    }
+
+    double total() const {
+        double sum = 0;
+        for (double s : seconds)
+            sum += s;
+        return sum;
+    }
+
+    void print(FILE *out, const char *name) const {
+        fprintf(out, "[INFO ] stats for %s\n", name);
+        if (timing) {
+            double sum = total();
+            for (int phase = 0; phase < PHASE_COUNT; phase++)
+                fprintf(out, "[INFO ]   %-10s %10.3f ms %5.1f%%\n", phase_name(phase), seconds[phase] * 1e3,
+                        sum > 0 ? 100.0 * seconds[phase] / sum : 0.0);
+            fprintf(out, "[INFO ]   %-10s %10.3f ms\n", "total", sum * 1e3);
+        }
+        fprintf(out, "[INFO ]   tokens %zu, nodes %zu\n", tokens, nodes);
+        fprintf(out, "[INFO ]   symbols %zu added, %zu lookups walking %zu scopes\n", symbols_added, lookups, scopes_walked);
+        fprintf(out, "[INFO ]   labels %zu, instructions %zu generated, %zu written\n", labels, insns_generated, insns_written);
+        fprintf(out, "[INFO ]   methods %zu, bytes written %zu\n", methods, bytes_written);
+    }
+
+    void print_json(FILE *out, const char *name) const {
+        fprintf(out, "{\"class\": \"%s\"", name);
+        if (timing) {
+            fprintf(out, ", \"phases_ms\": {");
+            for (int phase = 0; phase < PHASE_COUNT; phase++)
+                fprintf(out, "%s\"%s\": %.3f", phase ? ", " : "", phase_name(phase), seconds[phase] * 1e3);
+            fprintf(out, "}, \"total_ms\": %.3f", total() * 1e3);
+        }
+        fprintf(out, ", \"tokens\": %zu, \"nodes\": %zu, \"symbols_added\": %zu, \"lookups\": %zu, \"scopes_walked\": %zu"
+                     ", \"labels\": %zu, \"insns_generated\": %zu, \"insns_written\": %zu, \"methods\": %zu, \"bytes_written\": %zu}\n",
+                tokens, nodes, symbols_added, lookups, scopes_walked, labels, insns_generated, insns_written, methods, bytes_written);
+    }
+};
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef FRAME_LIMITS_H
+#define FRAME_LIMITS_H
+
+#include <algorithm>
+#include <cassert>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "jvm.h"
+
+/* number of values a "(args)ret" method descriptor takes off the stack;
+   the compiler never uses long or double, so every value is one slot */
+static int descriptor_arg_count(const std::string &descriptor) {
+    int count = 0;
+    size_t i = descriptor.find('(') + 1;
+    while (descriptor[i] != ')') {
+        while (descriptor[i] == '[')
+            i++;
+        if (descriptor[i] == 'L')
+            i = descriptor.find(';', i);
+        i++;
+        count++;
+    }
+    return count;
+}
+
+static bool descriptor_returns_value(const std::string &descriptor) {
+    return descriptor[descriptor.find(')') + 1] != 'V';
+}
+
+/* net operand stack change of one instruction */
+static int stack_effect(const Insn &insn) {
+    switch (insn.opcode) {
+        case Opcode::ICONST_M1: case Opcode::ICONST_0: case Opcode::ICONST_1: case Opcode::ICONST_2:
+        case Opcode::ICONST_3: case Opcode::ICONST_4: case Opcode::ICONST_5:
+        case Opcode::FCONST_0: case Opcode::FCONST_1: case Opcode::FCONST_2:
+        case Opcode::BIPUSH: case Opcode::SIPUSH:
+        case Opcode::LDC_INT: case Opcode::LDC_FLOAT: case Opcode::LDC_STRING:
+        case Opcode::ILOAD: case Opcode::FLOAD: case Opcode::ALOAD:
+        case Opcode::DUP: case Opcode::DUP_X1: case Opcode::NEW:
+        case Opcode::GETSTATIC:
+            return 1;
+        case Opcode::DUP2:
+            return 2;
+        case Opcode::ISTORE: case Opcode::FSTORE: case Opcode::ASTORE:
+        case Opcode::IALOAD: case Opcode::FALOAD: case Opcode::AALOAD: case Opcode::BALOAD:
+        case Opcode::POP:
+        case Opcode::IADD: case Opcode::FADD: case Opcode::ISUB: case Opcode::FSUB:
+        case Opcode::IMUL: case Opcode::FMUL: case Opcode::IDIV: case Opcode::FDIV: case Opcode::IREM:
+        case Opcode::ISHL: case Opcode::IAND: case Opcode::IOR: case Opcode::IXOR:
+        case Opcode::FCMPL: case Opcode::FCMPG:
+        case Opcode::IFEQ: case Opcode::IFNE: case Opcode::IFLT:
+        case Opcode::IFGE: case Opcode::IFGT: case Opcode::IFLE:
+        case Opcode::IRETURN: case Opcode::FRETURN: case Opcode::ARETURN:
+        case Opcode::PUTSTATIC: case Opcode::ATHROW:
+            return -1;
+        case Opcode::IF_ICMPEQ: case Opcode::IF_ICMPNE: case Opcode::IF_ICMPLT:
+        case Opcode::IF_ICMPGE: case Opcode::IF_ICMPGT: case Opcode::IF_ICMPLE:
+            return -2;
+        case Opcode::IASTORE: case Opcode::FASTORE: case Opcode::AASTORE:
+            return -3;
+        case Opcode::INVOKEVIRTUAL: case Opcode::INVOKESPECIAL:
+            return -1 - descriptor_arg_count(insn.sval) + descriptor_returns_value(insn.sval);
+        case Opcode::INVOKESTATIC:
+            return -descriptor_arg_count(insn.sval) + descriptor_returns_value(insn.sval);
+        case Opcode::MULTIANEWARRAY:
+            return 1 - insn.ival;
+        default:
+            return 0;
+    }
+}
+
+static bool falls_through(Opcode opcode) {
+    return opcode != Opcode::GOTO && opcode != Opcode::RETURN && opcode != Opcode::ATHROW &&
+           opcode != Opcode::IRETURN && opcode != Opcode::FRETURN && opcode != Opcode::ARETURN;
+}
+
+/* Sets max_stack by propagating the stack depth along every control flow edge
+   (each instruction must be reached with one consistent depth), and
+   max_locals from the parameters and the highest slot touched. */
+static void compute_frame_limits(Method &method) {
+    const std::vector<Insn> &code = method.code;
+    std::unordered_map<int, size_t> label_index;
+    int max_locals = descriptor_arg_count(method.descriptor) + (method.access.find("static") == std::string::npos);
+    for (size_t i = 0; i < code.size(); i++) {
+        Opcode opcode = code[i].opcode;
+        if (opcode == Opcode::LABEL)
+            label_index[code[i].ival] = i;
+        else if (opcode == Opcode::ILOAD || opcode == Opcode::FLOAD || opcode == Opcode::ALOAD ||
+                 opcode == Opcode::ISTORE || opcode == Opcode::FSTORE || opcode == Opcode::ASTORE ||
+                 opcode == Opcode::IINC)
+            max_locals = std::max(max_locals, code[i].ival + 1);
+    }
+
+    std::vector<int> depth(code.size(), -1);
+    std::vector<size_t> worklist;
+    int max_stack = 0;
+    auto reach = [&](size_t i, int d) {
+        if (i >= code.size())
+            return;
+        if (depth[i] == -1) {
+            depth[i] = d;
+            worklist.push_back(i);
+        }
+        assert(depth[i] == d);
+    };
+    reach(0, 0);
+    for (const Handler &handler : method.handlers)
+        reach(label_index.at(handler.handler), 1);
+    while (!worklist.empty()) {
+        size_t i = worklist.back();
+        worklist.pop_back();
+        int d = depth[i] + stack_effect(code[i]);
+        assert(d >= 0);
+        max_stack = std::max(max_stack, d);
+        if (is_branch(code[i].opcode))
+            reach(label_index.at(code[i].ival), d);
+        if (falls_through(code[i].opcode))
+            reach(i + 1, d);
+    }
+
+    method.max_stack = max_stack;
+    method.max_locals = max_locals;
+}
+
+#endif
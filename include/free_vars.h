@@ -0,0 +1,148 @@
+#ifndef FREE_VARS_H
+#define FREE_VARS_H
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include "ast.h"
+
+/* A variable of an enclosing subprogram that a nested subprogram uses:
+   owner is the subprogram that declares it, name is interned */
+struct CapturedVar {
+    int owner;
+    const char *name;
+
+    bool operator==(const CapturedVar &other) const { return owner == other.owner && name == other.name; }
+    bool operator<(const CapturedVar &other) const {
+        return owner != other.owner ? owner < other.owner : name < other.name;
+    }
+};
+
+/* Free-variable analysis for lambda lifting. Nested subprograms become
+   static methods that receive the enclosing-scope variables they need as
+   leading parameters; this computes that list per subprogram. A subprogram
+   captures every enclosing variable it names itself, plus everything its
+   callees capture that it does not own, iterated to a fixpoint so that
+   recursion and calls between siblings are covered. Names are resolved
+   with the same lexical rules as the symbol table, by interned pointer. */
+struct FreeVarAnalysis {
+    struct Subprog {
+        NodeId decl;
+        NodeId head;
+        int parent;
+        int depth;
+        const char *name;
+        std::vector<const char*> vars;
+        std::vector<int> nested;
+        std::vector<int> callees;
+        std::vector<CapturedVar> captured;
+    };
+
+    Ast &ast;
+    std::vector<Subprog> subprogs;
+    std::vector<int> top_level;
+    std::unordered_map<NodeId, int> index_of_head;
+
+    FreeVarAnalysis(Ast &ast) : ast(ast) {}
+
+    void run(NodeId prog) {
+        collect(ast.child[prog][2], -1, top_level);
+        for (size_t i = 0; i < subprogs.size(); i++)
+            scan_body((int)i);
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t i = 0; i < subprogs.size(); i++) {
+                for (int callee : subprogs[i].callees) {
+                    for (size_t k = 0; k < subprogs[callee].captured.size(); k++) {
+                        CapturedVar var = subprogs[callee].captured[k];
+                        if (var.owner != (int)i && add_captured(subprogs[i], var))
+                            changed = true;
+                    }
+                }
+            }
+        }
+
+        /* outermost owner first, then declaration order within the owner */
+        for (Subprog &subprog : subprogs) {
+            std::sort(subprog.captured.begin(), subprog.captured.end(), [&](const CapturedVar &a, const CapturedVar &b) {
+                if (a.owner != b.owner)
+                    return subprogs[a.owner].depth < subprogs[b.owner].depth;
+                const std::vector<const char*> &vars = subprogs[a.owner].vars;
+                return std::find(vars.begin(), vars.end(), a.name) < std::find(vars.begin(), vars.end(), b.name);
+            });
+        }
+    }
+
+    const std::vector<CapturedVar>& captured(NodeId head) const {
+        return subprogs[index_of_head.at(head)].captured;
+    }
+
+    static bool add_captured(Subprog &subprog, CapturedVar var) {
+        if (std::find(subprog.captured.begin(), subprog.captured.end(), var) != subprog.captured.end())
+            return false;
+        subprog.captured.push_back(var);
+        return true;
+    }
+
+    void collect(NodeId list, int parent, std::vector<int> &siblings) {
+        for (NodeId decl = list; decl != NIL_NODE; decl = ast.next[decl]) {
+            NodeId head = ast.child[decl][0];
+            int index = (int)subprogs.size();
+            subprogs.push_back(Subprog{decl, head, parent, parent == -1 ? 0 : subprogs[parent].depth + 1, ast.metadata[head].sval, {}, {}, {}, {}});
+            index_of_head[head] = index;
+            siblings.push_back(index);
+            for (NodeId param_list = ast.child[head][0]; param_list != NIL_NODE; param_list = ast.next[param_list])
+                for (NodeId id = ast.child[param_list][0]; id != NIL_NODE; id = ast.next[id])
+                    subprogs[index].vars.push_back(ast.metadata[id].sval);
+            for (NodeId decl_list = ast.child[decl][1]; decl_list != NIL_NODE; decl_list = ast.next[decl_list])
+                for (NodeId id = ast.child[decl_list][0]; id != NIL_NODE; id = ast.next[id])
+                    subprogs[index].vars.push_back(ast.metadata[id].sval);
+            std::vector<int> nested;
+            collect(ast.child[decl][2], index, nested);
+            subprogs[index].nested = std::move(nested);
+        }
+    }
+
+    static int find_subprog(const std::vector<Subprog> &subprogs, const std::vector<int> &candidates, const char *name) {
+        for (int candidate : candidates)
+            if (subprogs[candidate].name == name)
+                return candidate;
+        return -1;
+    }
+
+    /* records every name used in the body as a captured variable or a callee */
+    void scan_body(int index) {
+        std::vector<NodeId> pending{ast.child[subprogs[index].decl][3]};
+        while (!pending.empty()) {
+            NodeId node = pending.back();
+            pending.pop_back();
+            if (node == NIL_NODE)
+                continue;
+            pending.push_back(ast.next[node]);
+            for (NodeId child : ast.child[node])
+                pending.push_back(child);
+            if (ast.kind[node] != NodeType::VAR && ast.kind[node] != NodeType::PROCEDURE)
+                continue;
+            const char *name = ast.metadata[node].sval;
+            for (int scope = index; scope != -1; scope = subprogs[scope].parent) {
+                const std::vector<const char*> &vars = subprogs[scope].vars;
+                if (std::find(vars.begin(), vars.end(), name) != vars.end()) {
+                    if (scope != index)
+                        add_captured(subprogs[index], CapturedVar{scope, name});
+                    break;
+                }
+                int callee = find_subprog(subprogs, subprogs[scope].nested, name);
+                if (callee == -1 && subprogs[scope].parent == -1)
+                    callee = find_subprog(subprogs, top_level, name);
+                if (callee != -1) {
+                    subprogs[index].callees.push_back(callee);
+                    break;
+                }
+            }
+        }
+    }
+};
+
+#endif
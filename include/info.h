@@ -14,10 +14,10 @@
 #define WRONG_ARGS "%d:%d: arguments' types and numbers of %s are wrong\n"
 #define RETURN_VAL "%d:%d: missing return value of function %s\n"
 
-/* stdout */
-#define SHOW_NEWSYM(sym) printf("add new symbol %s\n", sym)
-#define SHOW_NEWSCP() puts("create a scope")
-#define SHOW_CLSSCP() puts("close a scope")
+/* the scope and symbol trace, to stdout or the compile's own stream */
+#define SHOW_NEWSYM(out, sym) fprintf(out, "add new symbol %s\n", sym)
+#define SHOW_NEWSCP(out) fputs("create a scope\n", out)
+#define SHOW_CLSSCP(out) fputs("close a scope\n", out)
 
 #define SHOW_SYMTAB_HEAD() \
   fputs( \
@@ -0,0 +1,76 @@
+#ifndef JASMIN_WRITER_H
+#define JASMIN_WRITER_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <ostream>
+#include "jvm.h"
+
+/* Renders a JvmClass as Jasmin assembly. */
+struct JasminWriter {
+    std::ostream &out;
+
+    explicit JasminWriter(std::ostream &out) : out(out) {}
+
+    bool write(const JvmClass &jvm_class) {
+        write_header(jvm_class);
+        for (const Method &method : jvm_class.methods)
+            write_method(method);
+        return true;
+    }
+
+    /* the class line and the fields; methods can then follow one at a time */
+    void write_header(const JvmClass &jvm_class) {
+        out << ".class public " << jvm_class.name << "\n.super " << jvm_class.super_name << "\n\n";
+        for (const Field &field : jvm_class.fields)
+            out << ".field " << field.access << " " << field.name << " " << field.descriptor << "\n";
+        out << '\n';
+    }
+
+    void write_method(const Method &method) {
+        out << ".method " << method.access << " " << method.name << method.descriptor << "\n";
+        out << "    .limit locals " << method.max_locals << "\n";
+        out << "    .limit stack " << method.max_stack << "\n";
+        for (const Handler &handler : method.handlers)
+            out << "    .catch all from L" << handler.start << " to L" << handler.end << " using L" << handler.handler << "\n";
+        for (const Insn &insn : method.code)
+            write_insn(insn);
+        out << ".end method\n\n";
+    }
+
+    void write_insn(const Insn &insn) {
+        if (insn.opcode == Opcode::LABEL) {
+            out << "L" << insn.ival << ":\n";
+            return;
+        }
+        out << "    " << opcode_name(insn.opcode);
+        if (is_branch(insn.opcode))
+            out << " L" << insn.ival;
+        else if (insn.opcode == Opcode::LDC_FLOAT)
+            write_float((float)insn.dval);
+        else if (insn.opcode == Opcode::IINC)
+            out << " " << insn.ival << " " << insn.ival2;
+        else if (insn.opcode == Opcode::MULTIANEWARRAY)
+            out << " " << insn.sval << " " << insn.ival;
+        else if (!insn.sval.empty())
+            out << " " << insn.sval;
+        else if (insn.opcode == Opcode::LDC_INT || insn.opcode == Opcode::BIPUSH || insn.opcode == Opcode::SIPUSH ||
+                 insn.opcode == Opcode::ILOAD || insn.opcode == Opcode::FLOAD || insn.opcode == Opcode::ALOAD ||
+                 insn.opcode == Opcode::ISTORE || insn.opcode == Opcode::FSTORE || insn.opcode == Opcode::ASTORE)
+            out << " " << insn.ival;
+        out << "\n";
+    }
+
+    /* six significant digits unless the float needs more to read back exactly */
+    void write_float(float value) {
+        char text[32];
+        for (int precision = 6; precision <= 9; precision++) {
+            snprintf(text, sizeof(text), "%#.*g", precision, value);
+            if (strtof(text, nullptr) == value)
+                break;
+        }
+        out << " " << text;
+    }
+};
+
+#endif
@@ -0,0 +1,192 @@
+#ifndef JVM_H
+#define JVM_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* C is not a JVM format: --emit=c selects the C generator instead of the traverser */
+enum class EmitFormat { JASMIN, CLASS, C };
+
+/* JVM instructions used by the code generator. Real opcodes carry their JVM
+   encoding; loads, stores and ldc are kept generic (the writers choose the
+   short/wide forms) and LABEL marks a branch target. */
+enum class Opcode : uint16_t {
+    NOP = 0x00,
+    ICONST_M1 = 0x02, ICONST_0 = 0x03, ICONST_1 = 0x04, ICONST_2 = 0x05,
+    ICONST_3 = 0x06, ICONST_4 = 0x07, ICONST_5 = 0x08,
+    FCONST_0 = 0x0b, FCONST_1 = 0x0c, FCONST_2 = 0x0d,
+    BIPUSH = 0x10, SIPUSH = 0x11,
+    ILOAD = 0x15, FLOAD = 0x17, ALOAD = 0x19,
+    IALOAD = 0x2e, FALOAD = 0x30, AALOAD = 0x32, BALOAD = 0x33,
+    ISTORE = 0x36, FSTORE = 0x38, ASTORE = 0x3a,
+    IASTORE = 0x4f, FASTORE = 0x51, AASTORE = 0x53,
+    POP = 0x57, DUP = 0x59, DUP_X1 = 0x5a, DUP2 = 0x5c, SWAP = 0x5f,
+    IADD = 0x60, FADD = 0x62, ISUB = 0x64, FSUB = 0x66,
+    IMUL = 0x68, FMUL = 0x6a, IDIV = 0x6c, FDIV = 0x6e, IREM = 0x70,
+    INEG = 0x74, FNEG = 0x76, ISHL = 0x78,
+    IAND = 0x7e, IOR = 0x80, IXOR = 0x82, IINC = 0x84, I2F = 0x86,
+    FCMPL = 0x95, FCMPG = 0x96,
+    IFEQ = 0x99, IFNE = 0x9a, IFLT = 0x9b, IFGE = 0x9c, IFGT = 0x9d, IFLE = 0x9e,
+    IF_ICMPEQ = 0x9f, IF_ICMPNE = 0xa0, IF_ICMPLT = 0xa1,
+    IF_ICMPGE = 0xa2, IF_ICMPGT = 0xa3, IF_ICMPLE = 0xa4,
+    GOTO = 0xa7,
+    IRETURN = 0xac, FRETURN = 0xae, ARETURN = 0xb0, RETURN = 0xb1,
+    GETSTATIC = 0xb2, PUTSTATIC = 0xb3,
+    INVOKEVIRTUAL = 0xb6, INVOKESPECIAL = 0xb7, INVOKESTATIC = 0xb8,
+    NEW = 0xbb, NEWARRAY = 0xbc, ANEWARRAY = 0xbd, ARRAYLENGTH = 0xbe, ATHROW = 0xbf,
+    MULTIANEWARRAY = 0xc5,
+
+    LDC_INT = 0x100, LDC_FLOAT, LDC_STRING,
+    LABEL
+};
+
+/* ival: local slot, constant, label or dimension count; ival2: iinc delta;
+   dval: float constant; sval: member/class reference in Jasmin syntax
+   ("owner/name desc", "owner/name(args)ret", "[[I") or a quoted string. */
+struct Insn {
+    Opcode opcode;
+    int ival;
+    int ival2;
+    double dval;
+    std::string sval;
+};
+
+/* an exception table entry catching everything thrown between the labels
+   start (inclusive) and end (exclusive); the handler starts with the
+   exception on the stack */
+struct Handler {
+    int start;
+    int end;
+    int handler;
+};
+
+struct Method {
+    std::string access;
+    std::string name;
+    std::string descriptor;
+    std::vector<Insn> code;
+    int max_stack;
+    int max_locals;
+    std::vector<Handler> handlers;
+
+    void emit(Opcode opcode, int ival = 0, int ival2 = 0) {
+        code.push_back(Insn{opcode, ival, ival2, 0.0, {}});
+    }
+
+    void emit(Opcode opcode, std::string sval, int ival = 0) {
+        code.push_back(Insn{opcode, ival, 0, 0.0, std::move(sval)});
+    }
+
+    void emit_float(double dval) {
+        code.push_back(Insn{Opcode::LDC_FLOAT, 0, 0, dval, {}});
+    }
+};
+
+struct Field {
+    std::string access;
+    std::string name;
+    std::string descriptor;
+};
+
+struct JvmClass {
+    std::string name;
+    std::string super_name;
+    std::vector<Field> fields;
+    std::vector<Method> methods;
+};
+
+static bool is_branch(Opcode opcode) {
+    return (opcode >= Opcode::IFEQ && opcode <= Opcode::GOTO);
+}
+
+static const char* opcode_name(Opcode opcode) {
+    switch (opcode) {
+        case Opcode::NOP: return "nop";
+        case Opcode::ICONST_M1: return "iconst_m1";
+        case Opcode::ICONST_0: return "iconst_0";
+        case Opcode::ICONST_1: return "iconst_1";
+        case Opcode::ICONST_2: return "iconst_2";
+        case Opcode::ICONST_3: return "iconst_3";
+        case Opcode::ICONST_4: return "iconst_4";
+        case Opcode::ICONST_5: return "iconst_5";
+        case Opcode::FCONST_0: return "fconst_0";
+        case Opcode::FCONST_1: return "fconst_1";
+        case Opcode::FCONST_2: return "fconst_2";
+        case Opcode::BIPUSH: return "bipush";
+        case Opcode::SIPUSH: return "sipush";
+        case Opcode::ILOAD: return "iload";
+        case Opcode::FLOAD: return "fload";
+        case Opcode::ALOAD: return "aload";
+        case Opcode::IALOAD: return "iaload";
+        case Opcode::FALOAD: return "faload";
+        case Opcode::AALOAD: return "aaload";
+        case Opcode::BALOAD: return "baload";
+        case Opcode::ISTORE: return "istore";
+        case Opcode::FSTORE: return "fstore";
+        case Opcode::ASTORE: return "astore";
+        case Opcode::IASTORE: return "iastore";
+        case Opcode::FASTORE: return "fastore";
+        case Opcode::AASTORE: return "aastore";
+        case Opcode::POP: return "pop";
+        case Opcode::DUP: return "dup";
+        case Opcode::DUP_X1: return "dup_x1";
+        case Opcode::DUP2: return "dup2";
+        case Opcode::SWAP: return "swap";
+        case Opcode::IADD: return "iadd";
+        case Opcode::FADD: return "fadd";
+        case Opcode::ISUB: return "isub";
+        case Opcode::FSUB: return "fsub";
+        case Opcode::IMUL: return "imul";
+        case Opcode::FMUL: return "fmul";
+        case Opcode::IDIV: return "idiv";
+        case Opcode::FDIV: return "fdiv";
+        case Opcode::IREM: return "irem";
+        case Opcode::INEG: return "ineg";
+        case Opcode::FNEG: return "fneg";
+        case Opcode::ISHL: return "ishl";
+        case Opcode::IAND: return "iand";
+        case Opcode::IOR: return "ior";
+        case Opcode::IXOR: return "ixor";
+        case Opcode::IINC: return "iinc";
+        case Opcode::I2F: return "i2f";
+        case Opcode::FCMPL: return "fcmpl";
+        case Opcode::FCMPG: return "fcmpg";
+        case Opcode::IFEQ: return "ifeq";
+        case Opcode::IFNE: return "ifne";
+        case Opcode::IFLT: return "iflt";
+        case Opcode::IFGE: return "ifge";
+        case Opcode::IFGT: return "ifgt";
+        case Opcode::IFLE: return "ifle";
+        case Opcode::IF_ICMPEQ: return "if_icmpeq";
+        case Opcode::IF_ICMPNE: return "if_icmpne";
+        case Opcode::IF_ICMPLT: return "if_icmplt";
+        case Opcode::IF_ICMPGE: return "if_icmpge";
+        case Opcode::IF_ICMPGT: return "if_icmpgt";
+        case Opcode::IF_ICMPLE: return "if_icmple";
+        case Opcode::GOTO: return "goto";
+        case Opcode::IRETURN: return "ireturn";
+        case Opcode::FRETURN: return "freturn";
+        case Opcode::ARETURN: return "areturn";
+        case Opcode::RETURN: return "return";
+        case Opcode::GETSTATIC: return "getstatic";
+        case Opcode::PUTSTATIC: return "putstatic";
+        case Opcode::INVOKEVIRTUAL: return "invokevirtual";
+        case Opcode::INVOKESPECIAL: return "invokespecial";
+        case Opcode::INVOKESTATIC: return "invokestatic";
+        case Opcode::NEW: return "new";
+        case Opcode::NEWARRAY: return "newarray";
+        case Opcode::ANEWARRAY: return "anewarray";
+        case Opcode::ARRAYLENGTH: return "arraylength";
+        case Opcode::ATHROW: return "athrow";
+        case Opcode::MULTIANEWARRAY: return "multianewarray";
+        case Opcode::LDC_INT:
+        case Opcode::LDC_FLOAT:
+        case Opcode::LDC_STRING: return "ldc";
+        case Opcode::LABEL: return "";
+    }
+    return "UNKNOWN";
+}
+
+#endif
@@ -0,0 +1,380 @@
+#ifndef LOOP_OPTIMIZER_H
+#define LOOP_OPTIMIZER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "ast.h"
+#include "semantic.h"
+
+/* -O2: finds what a WHILE loop computes on every iteration that could be
+   computed once before it; the traverser emits the preheader and reads the
+   results back instead.
+   - Global arrays: the reference is never reassigned, only elements are,
+     so its getstatic can always move out.
+   - Invariant expressions: int and real arithmetic that cannot throw (no
+     integer division, subscripts or calls) over literals and variables the
+     loop does not write, such as "size - 1".
+   - Induction variables: a counter is an int variable whose only write in
+     the loop is "i := i + c" (or "- c") directly in its body. A subscript
+     or product that is linear in it, a*i + b, is kept in a local of its own
+     that the increment steps by a*c, which also absorbs the lower bound a
+     subscript subtracts.
+   Calls are summarized per subprogram: the globals it may assign, itself
+   or through the calls it makes, and which of its captured variables it
+   assigns; a captured variable passed to such a call counts as written. */
+struct LoopOptimizer {
+    /* scale * counter + offset, in wrapping int arithmetic */
+    struct Derived {
+        NodeId node;    /* the OP, or a subscript's EXPR_LIST */
+        NodeId var;     /* the subscripted VAR, or NIL_NODE */
+        SymbolId counter;
+        NodeId increment;
+        uint32_t scale;
+        uint32_t offset;
+        uint32_t step;
+    };
+
+    struct Plan {
+        std::vector<SymbolId> arrays;
+        std::vector<NodeId> invariants;
+        std::vector<Derived> derived;
+    };
+
+    /* what a statement subtree does: the scalars it assigns and how often,
+       the subprograms it calls, the global arrays it uses, and its
+       expressions (roots in order, and every node) */
+    struct Effects {
+        std::unordered_map<SymbolId, int> assigned;
+        std::unordered_set<SymbolId> callees;
+        std::vector<NodeId> calls;
+        std::vector<SymbolId> arrays;
+        std::vector<NodeId> roots;
+        std::vector<NodeId> exprs;
+    };
+
+    const Ast &ast;
+    const SemanticAnalysis &sema;
+    /* set by the traverser: the arrays stored flat, whose subscripts it
+       folds itself (see push_flat_index) */
+    std::function<bool(TypeDescriptor*)> is_flat;
+    bool summarized = false;
+    std::unordered_map<SymbolId, std::unordered_set<SymbolId>> global_writes;
+    std::unordered_map<SymbolId, std::vector<bool>> captured_writes;
+
+    size_t loops = 0;
+    size_t hoisted = 0;
+    size_t reduced = 0;
+
+    LoopOptimizer(const Ast &ast, const SemanticAnalysis &sema) : ast(ast), sema(sema) {}
+
+    void scan(NodeId root, Effects &effects) const {
+        std::vector<NodeId> pending{root};
+        while (!pending.empty()) {
+            NodeId node = pending.back();
+            pending.pop_back();
+            if (node == NIL_NODE)
+                continue;
+            if (ast.kind[node] == NodeType::STMT_LIST) {
+                for (NodeId curr = node; curr != NIL_NODE; curr = ast.next[curr])
+                    pending.push_back(ast.child[curr][0]);
+            } else if (ast.kind[node] == NodeType::ASSIGN) {
+                NodeId target = ast.child[node][0];
+                const Symbol &symbol = sema.symbol(target);
+                if (ast.child[target][0] == NIL_NODE && symbol.storage != Storage::SUBPROG)
+                    effects.assigned[sema.symbol_of[target]]++;
+                else if (ast.child[target][0] != NIL_NODE)
+                    effects.roots.push_back(target);
+                effects.roots.push_back(ast.child[node][1]);
+            } else if (ast.kind[node] == NodeType::IF) {
+                effects.roots.push_back(ast.child[node][0]);
+                pending.push_back(ast.child[node][2]);
+                pending.push_back(ast.child[node][1]);
+            } else if (ast.kind[node] == NodeType::WHILE) {
+                effects.roots.push_back(ast.child[node][0]);
+                pending.push_back(ast.child[node][1]);
+            } else if (ast.kind[node] == NodeType::PROCEDURE) {
+                effects.roots.push_back(node);
+            }
+        }
+        std::unordered_set<SymbolId> arrays;
+        std::vector<NodeId> exprs(effects.roots.begin(), effects.roots.end());
+        while (!exprs.empty()) {
+            NodeId node = exprs.back();
+            exprs.pop_back();
+            effects.exprs.push_back(node);
+            NodeType kind = ast.kind[node];
+            if (kind == NodeType::OP) {
+                exprs.push_back(ast.child[node][0]);
+                exprs.push_back(ast.child[node][1]);
+            } else if (kind == NodeType::NOT || kind == NodeType::NEGATE) {
+                exprs.push_back(ast.child[node][0]);
+            } else if (kind == NodeType::VAR || kind == NodeType::PROCEDURE) {
+                SymbolId id = sema.symbol_of[node];
+                if (id != NO_SYMBOL && sema.symbols[id].storage == Storage::SUBPROG) {
+                    effects.callees.insert(id);
+                    effects.calls.push_back(node);
+                } else if (id != NO_SYMBOL && sema.symbols[id].storage == Storage::GLOBAL &&
+                           sema.symbols[id].type_descriptor->id_type == IDType::ARRAY && arrays.insert(id).second) {
+                    effects.arrays.push_back(id);
+                }
+                for (NodeId curr = ast.child[node][0]; curr != NIL_NODE; curr = ast.next[curr])
+                    exprs.push_back(ast.child[curr][0]);
+            }
+        }
+    }
+
+    /* the per-subprogram summaries, closed over calls */
+    void summarize() {
+        summarized = true;
+        std::unordered_map<SymbolId, std::unordered_set<SymbolId>> callees;
+        for (NodeId node = 1; node < (NodeId)ast.kind.size(); node++) {
+            if (ast.kind[node] != NodeType::SUBPROG_DECL_LIST)
+                continue;
+            SymbolId self = sema.symbol_of[ast.child[node][0]];
+            Effects effects;
+            scan(ast.child[node][3], effects);
+            std::unordered_set<SymbolId> &writes = global_writes[self];
+            std::vector<bool> &captured = captured_writes[self];
+            captured.assign(sema.free_vars.subprogs[sema.symbols[self].subprog].captured.size(), false);
+            for (const auto &assigned : effects.assigned) {
+                const Symbol &symbol = sema.symbols[assigned.first];
+                if (symbol.storage == Storage::GLOBAL)
+                    writes.insert(assigned.first);
+                else if (symbol.storage == Storage::LOCAL && symbol.slot < (int)captured.size())
+                    captured[symbol.slot] = true;
+            }
+            callees[self] = std::move(effects.callees);
+        }
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (const auto &caller : callees) {
+                std::unordered_set<SymbolId> &writes = global_writes[caller.first];
+                size_t before = writes.size();
+                for (SymbolId callee : caller.second)
+                    if (callee != caller.first)
+                        writes.insert(global_writes[callee].begin(), global_writes[callee].end());
+                changed |= writes.size() != before;
+            }
+        }
+    }
+
+    /* the summary of a subprogram as text, for cache keys */
+    std::string effects_key(SymbolId subprog) {
+        if (!summarized)
+            summarize();
+        std::vector<std::string> names;
+        for (SymbolId global : global_writes[subprog])
+            names.push_back(sema.symbols[global].name);
+        std::sort(names.begin(), names.end());
+        std::string key;
+        for (const std::string &name : names)
+            key += name + ',';
+        for (bool written : captured_writes[subprog])
+            key += written ? '1' : '0';
+        return key;
+    }
+
+    /* the variable leaf of a linear int expression a*v + b, or NIL_NODE:
+       v, v + 1, 2 * v - 3, v << 2, 10 - v ... */
+    NodeId linear(NodeId expr, uint32_t &scale, uint32_t &offset) const {
+        std::vector<NodeId> ops;
+        NodeId node = expr;
+        while (ast.kind[node] == NodeType::OP) {
+            OpType op = ast.metadata[node].oval;
+            NodeId lhs = ast.child[node][0];
+            NodeId rhs = ast.child[node][1];
+            if (op != OpType::ADD && op != OpType::SUB && op != OpType::MUL && op != OpType::SHL)
+                return NIL_NODE;
+            ops.push_back(node);
+            if (ast.kind[rhs] == NodeType::LITERAL_INT)
+                node = lhs;
+            else if (ast.kind[lhs] == NodeType::LITERAL_INT && op != OpType::SHL)
+                node = rhs;
+            else
+                return NIL_NODE;
+        }
+        if (ast.kind[node] != NodeType::VAR || ast.child[node][0] != NIL_NODE || sema.symbol_of[node] == NO_SYMBOL ||
+            sema.symbol(node).storage == Storage::SUBPROG || sema.symbol(node).type_descriptor->id_type != IDType::INT)
+            return NIL_NODE;
+        scale = 1;
+        offset = 0;
+        for (auto curr = ops.rbegin(); curr != ops.rend(); ++curr) {
+            NodeId lhs = ast.child[*curr][0];
+            NodeId rhs = ast.child[*curr][1];
+            bool literal_left = ast.kind[rhs] != NodeType::LITERAL_INT;
+            uint32_t k = (uint32_t)ast.metadata[literal_left ? lhs : rhs].ival;
+            OpType op = ast.metadata[*curr].oval;
+            if (op == OpType::ADD) {
+                offset += k;
+            } else if (op == OpType::SUB && !literal_left) {
+                offset -= k;
+            } else if (op == OpType::SUB) {
+                scale = 0u - scale;
+                offset = k - offset;
+            } else if (op == OpType::MUL) {
+                scale *= k;
+                offset *= k;
+            } else {
+                scale <<= (k & 31);
+                offset <<= (k & 31);
+            }
+        }
+        return node;
+    }
+
+    Plan plan(NodeId loop) {
+        if (!summarized)
+            summarize();
+        loops++;
+        Effects effects;
+        scan(loop, effects);
+        Plan plan;
+        plan.arrays = effects.arrays;
+
+        /* what calls in the loop may write, then everything it writes */
+        std::unordered_set<SymbolId> clobbered;
+        for (NodeId call : effects.calls) {
+            SymbolId callee = sema.symbol_of[call];
+            const std::unordered_set<SymbolId> &writes = global_writes[callee];
+            clobbered.insert(writes.begin(), writes.end());
+            const std::vector<bool> &captured = captured_writes[callee];
+            size_t i = 0;
+            for (const SymbolId *arg = sema.captures_begin(call); arg != sema.captures_end(call); arg++, i++)
+                if (i < captured.size() && captured[i])
+                    clobbered.insert(*arg);
+        }
+        std::unordered_set<SymbolId> written(clobbered);
+        for (const auto &assigned : effects.assigned)
+            written.insert(assigned.first);
+
+        /* counters: assigned once, by a top-level increment of the body */
+        std::unordered_map<SymbolId, std::pair<NodeId, uint32_t>> counters;
+        NodeId body = ast.child[loop][1];
+        for (NodeId curr = body; curr != NIL_NODE; curr = ast.kind[curr] == NodeType::STMT_LIST ? ast.next[curr] : NIL_NODE) {
+            NodeId stmt = ast.kind[curr] == NodeType::STMT_LIST ? ast.child[curr][0] : curr;
+            if (stmt == NIL_NODE || ast.kind[stmt] != NodeType::ASSIGN)
+                continue;
+            uint32_t scale = 0, offset = 0;
+            NodeId leaf = linear(ast.child[stmt][1], scale, offset);
+            NodeId target = ast.child[stmt][0];
+            SymbolId id = sema.symbol_of[target];
+            if (leaf != NIL_NODE && scale == 1 && ast.child[target][0] == NIL_NODE && sema.symbol_of[leaf] == id &&
+                effects.assigned[id] == 1 && clobbered.count(id) == 0)
+                counters.emplace(id, std::make_pair(stmt, offset));
+        }
+
+        /* ids grow from children to parents, so this is bottom-up */
+        std::sort(effects.exprs.begin(), effects.exprs.end());
+        effects.exprs.erase(std::unique(effects.exprs.begin(), effects.exprs.end()), effects.exprs.end());
+        std::unordered_map<NodeId, bool> invariant;
+        for (NodeId node : effects.exprs)
+            invariant[node] = is_invariant(node, written, invariant);
+
+        std::vector<NodeId> pending(effects.roots.rbegin(), effects.roots.rend());
+        while (!pending.empty()) {
+            NodeId node = pending.back();
+            pending.pop_back();
+            NodeType kind = ast.kind[node];
+            if (invariant[node]) {
+                if (kind == NodeType::OP || kind == NodeType::NEGATE)
+                    plan.invariants.push_back(node);
+                continue;
+            }
+            uint32_t scale = 0, offset = 0;
+            NodeId leaf = kind == NodeType::OP ? linear(node, scale, offset) : NIL_NODE;
+            auto counter = leaf != NIL_NODE ? counters.find(sema.symbol_of[leaf]) : counters.end();
+            if (counter != counters.end() && scale != 1 && scale != 0u - 1 && scale != 0) {
+                plan.derived.push_back(Derived{node, NIL_NODE, counter->first, counter->second.first, scale, offset, scale * counter->second.second});
+                continue;
+            }
+            size_t mark = pending.size();
+            if (kind == NodeType::OP) {
+                pending.push_back(ast.child[node][0]);
+                pending.push_back(ast.child[node][1]);
+            } else if (kind == NodeType::NOT || kind == NodeType::NEGATE) {
+                pending.push_back(ast.child[node][0]);
+            } else if (kind == NodeType::VAR || kind == NodeType::PROCEDURE) {
+                bool subscripts = sema.symbol_of[node] != NO_SYMBOL && sema.symbol(node).storage != Storage::SUBPROG &&
+                                  !(is_flat && is_flat(sema.symbol(node).type_descriptor));
+                TypeDescriptor *dimension = subscripts ? sema.symbol(node).type_descriptor : nullptr;
+                for (NodeId curr = ast.child[node][0]; curr != NIL_NODE; curr = ast.next[curr]) {
+                    NodeId expr = ast.child[curr][0];
+                    leaf = subscripts ? linear(expr, scale, offset) : NIL_NODE;
+                    counter = leaf != NIL_NODE ? counters.find(sema.symbol_of[leaf]) : counters.end();
+                    /* scale and offset mean nothing without a leaf */
+                    if (leaf != NIL_NODE)
+                        offset -= (uint32_t)dimension->lower_bound;
+                    /* a local counter used as it is has nothing to fold */
+                    bool bare = leaf != NIL_NODE && scale == 1 && offset == 0 && leaf == expr &&
+                                sema.symbol(leaf).storage == Storage::LOCAL;
+                    if (counter != counters.end() && !bare)
+                        plan.derived.push_back(Derived{curr, node, counter->first, counter->second.first, scale, offset, scale * counter->second.second});
+                    else
+                        pending.push_back(expr);
+                    if (subscripts)
+                        dimension = dimension->base;
+                }
+            }
+            std::reverse(pending.begin() + mark, pending.end());
+        }
+        return plan;
+    }
+
+    /* equal for structurally equal expressions over the same variables */
+    std::string expr_key(NodeId root) const {
+        std::string key;
+        std::vector<NodeId> pending{root};
+        while (!pending.empty()) {
+            NodeId node = pending.back();
+            pending.pop_back();
+            key += (char)('A' + (int)ast.kind[node]);
+            if (ast.kind[node] == NodeType::OP) {
+                key += std::to_string((int)ast.metadata[node].oval);
+                pending.push_back(ast.child[node][1]);
+                pending.push_back(ast.child[node][0]);
+            } else if (ast.kind[node] == NodeType::NEGATE) {
+                pending.push_back(ast.child[node][0]);
+            } else if (ast.kind[node] == NodeType::LITERAL_INT) {
+                key += std::to_string(ast.metadata[node].ival);
+            } else if (ast.kind[node] == NodeType::LITERAL_DBL) {
+                key.append(reinterpret_cast<const char*>(&ast.metadata[node].dval), sizeof(ast.metadata[node].dval));
+            } else {
+                key += std::to_string(sema.symbol_of[node]);
+            }
+            key += ',';
+        }
+        return key;
+    }
+
+    bool is_invariant(NodeId node, const std::unordered_set<SymbolId> &written, std::unordered_map<NodeId, bool> &invariant) const {
+        NodeType kind = ast.kind[node];
+        if (kind == NodeType::LITERAL_INT || kind == NodeType::LITERAL_DBL)
+            return true;
+        if (kind == NodeType::VAR) {
+            SymbolId id = sema.symbol_of[node];
+            if (id == NO_SYMBOL || ast.child[node][0] != NIL_NODE || written.count(id) != 0)
+                return false;
+            Storage storage = sema.symbols[id].storage;
+            IDType type = sema.symbols[id].type_descriptor->id_type;
+            return (storage == Storage::GLOBAL || storage == Storage::LOCAL) && (type == IDType::INT || type == IDType::REAL);
+        }
+        if (kind != NodeType::OP && kind != NodeType::NEGATE)
+            return false;
+        IDType type = sema.type(node);
+        if (type != IDType::INT && type != IDType::REAL)
+            return false;
+        if (kind == NodeType::NEGATE)
+            return invariant[ast.child[node][0]];
+        OpType op = ast.metadata[node].oval;
+        if (op != OpType::ADD && op != OpType::SUB && op != OpType::MUL && op != OpType::SHL && !(op == OpType::DIV && type == IDType::REAL))
+            return false;
+        return invariant[ast.child[node][0]] && invariant[ast.child[node][1]];
+    }
+};
+
+#endif
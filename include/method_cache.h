@@ -0,0 +1,151 @@
+#ifndef METHOD_CACHE_H
+#define METHOD_CACHE_H
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "frame_limits.h"
+#include "jvm.h"
+
+/* Incremental code generation: the methods generated for one subprogram
+   declaration (its own and those of the subprograms nested in it), stored
+   under a hash of the declaration's AST and of every signature it refers to.
+   Labels are stored relative to the label counter at the start of the
+   declaration, so a reused body is renumbered exactly as a regenerated one
+   would be. The cache lives in a sidecar file next to the output; only the
+   entries used by the latest compile are written back. The file records the
+   build of the compiler that wrote it, and a rebuilt compiler (new opcodes,
+   fixed code generation) ignores it, as the compile server does. */
+struct MethodCache {
+    static constexpr uint32_t MAGIC = 0x4d504332;   /* "MPC2" */
+
+    static const char* build() { return __DATE__ " " __TIME__; }
+
+    struct Entry {
+        int label_count;
+        std::vector<Method> methods;
+    };
+
+    std::unordered_map<uint64_t, Entry> stored;
+    std::unordered_map<uint64_t, Entry> used;
+    size_t reused = 0;
+    size_t rebuilt = 0;
+
+    static uint64_t hash(const std::string &key) {
+        uint64_t h = 14695981039346656037ull;
+        for (unsigned char c : key)
+            h = (h ^ c) * 1099511628211ull;
+        return h;
+    }
+
+    static bool has_label(const Insn &insn) {
+        return insn.opcode == Opcode::LABEL || is_branch(insn.opcode);
+    }
+
+    /* appends the cached methods with their labels moved past label_base */
+    bool reuse(uint64_t key, int label_base, std::vector<Method> &functions, int &label_count) {
+        auto it = stored.find(key);
+        if (it == stored.end())
+            return false;
+        for (Method method : it->second.methods) {
+            for (Insn &insn : method.code)
+                if (has_label(insn))
+                    insn.ival += label_base;
+            functions.push_back(std::move(method));
+        }
+        label_count = it->second.label_count;
+        reused += it->second.methods.size();
+        used[key] = it->second;
+        return true;
+    }
+
+    void record(uint64_t key, int label_base, int label_count, const Method *first, const Method *last) {
+        Entry entry{label_count, std::vector<Method>(first, last)};
+        for (Method &method : entry.methods)
+            for (Insn &insn : method.code)
+                if (has_label(insn))
+                    insn.ival -= label_base;
+        used[key] = std::move(entry);
+    }
+
+    static void put_u32(std::ostream &out, uint32_t value) { out.write(reinterpret_cast<const char*>(&value), sizeof(value)); }
+    static void put_str(std::ostream &out, const std::string &str) {
+        put_u32(out, (uint32_t)str.size());
+        out.write(str.data(), str.size());
+    }
+    static uint32_t get_u32(std::istream &in) {
+        uint32_t value = 0;
+        in.read(reinterpret_cast<char*>(&value), sizeof(value));
+        return value;
+    }
+    static std::string get_str(std::istream &in) {
+        std::string str(get_u32(in), '\0');
+        in.read(&str[0], str.size());
+        return str;
+    }
+
+    /* a missing or unreadable file just means an empty cache */
+    void load(const std::string &path) {
+        std::ifstream in(path, std::ios::in | std::ios::binary);
+        if (!in || get_u32(in) != MAGIC || get_str(in) != build())
+            return;
+        uint32_t entries = get_u32(in);
+        for (uint32_t e = 0; e < entries && in; e++) {
+            uint64_t key;
+            in.read(reinterpret_cast<char*>(&key), sizeof(key));
+            Entry entry;
+            entry.label_count = (int)get_u32(in);
+            uint32_t methods = get_u32(in);
+            for (uint32_t m = 0; m < methods && in; m++) {
+                Method method;
+                method.access = get_str(in);
+                method.name = get_str(in);
+                method.descriptor = get_str(in);
+                uint32_t insns = get_u32(in);
+                method.code.reserve(insns);
+                for (uint32_t i = 0; i < insns && in; i++) {
+                    Insn insn;
+                    insn.opcode = (Opcode)get_u32(in);
+                    insn.ival = (int)get_u32(in);
+                    insn.ival2 = (int)get_u32(in);
+                    in.read(reinterpret_cast<char*>(&insn.dval), sizeof(insn.dval));
+                    insn.sval = get_str(in);
+                    method.code.push_back(std::move(insn));
+                }
+                entry.methods.push_back(std::move(method));
+            }
+            if (in)
+                stored[key] = std::move(entry);
+        }
+    }
+
+    bool save(const std::string &path) const {
+        std::ofstream out(path, std::ios::out | std::ios::binary);
+        put_u32(out, MAGIC);
+        put_str(out, build());
+        put_u32(out, (uint32_t)used.size());
+        for (const auto &item : used) {
+            out.write(reinterpret_cast<const char*>(&item.first), sizeof(item.first));
+            put_u32(out, (uint32_t)item.second.label_count);
+            put_u32(out, (uint32_t)item.second.methods.size());
+            for (const Method &method : item.second.methods) {
+                put_str(out, method.access);
+                put_str(out, method.name);
+                put_str(out, method.descriptor);
+                put_u32(out, (uint32_t)method.code.size());
+                for (const Insn &insn : method.code) {
+                    put_u32(out, (uint32_t)insn.opcode);
+                    put_u32(out, (uint32_t)insn.ival);
+                    put_u32(out, (uint32_t)insn.ival2);
+                    out.write(reinterpret_cast<const char*>(&insn.dval), sizeof(insn.dval));
+                    put_str(out, insn.sval);
+                }
+            }
+        }
+        return (bool)out;
+    }
+};
+
+#endif
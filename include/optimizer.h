@@ -0,0 +1,204 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_set>
+#include "ast.h"
+#include "semantic.h"
+
+/* AST simplification run between semantic analysis and code generation,
+   on a program that has type-checked as written.
+   -O1: constant folding, algebraic identities and strength reduction of
+   integer multiplication by a power of two. The language has no implicit
+   int/real conversion, so an INT (REAL) literal operand fixes the type of
+   the whole operation. A node rewritten into a copy of another takes over
+   that node's symbol, type and captured variables too. */
+struct Optimizer {
+    Ast &ast;
+    SemanticAnalysis &sema;
+    int level;
+    size_t folded = 0;
+
+    /* interned names of every subprogram: a bare VAR with one of these
+       names is a call and may have side effects */
+    std::unordered_set<const char*> subprog_names;
+
+    Optimizer(Ast &ast, SemanticAnalysis &sema, int level) : ast(ast), sema(sema), level(level) {}
+
+    void run() {
+        if (level < 1)
+            return;
+        for (NodeId i = 1; i < ast.kind.size(); i++)
+            if (ast.kind[i] == NodeType::SUBPROG_HEAD)
+                subprog_names.insert(ast.metadata[i].sval);
+        /* the parser reduces bottom-up, so every node is created after its
+           children; visiting ids in increasing order is a post-order walk */
+        for (NodeId i = 1; i < ast.kind.size(); i++) {
+            if (ast.kind[i] == NodeType::OP)
+                simplify_op(i);
+            else if (ast.kind[i] == NodeType::NEGATE)
+                simplify_negate(i);
+            else if (ast.kind[i] == NodeType::NOT)
+                simplify_not(i);
+        }
+    }
+
+    bool is_int(NodeId node, int value) {
+        return ast.kind[node] == NodeType::LITERAL_INT && ast.metadata[node].ival == value;
+    }
+
+    /* true if evaluating the node can be skipped: no calls, no input and
+       no operation that may throw (array subscript, integer division) */
+    bool is_pure(NodeId node) {
+        NodeType kind = ast.kind[node];
+        if (kind == NodeType::LITERAL_INT || kind == NodeType::LITERAL_DBL || kind == NodeType::LITERAL_STR)
+            return true;
+        if (kind == NodeType::VAR)
+            return ast.child[node][0] == NIL_NODE &&
+                   subprog_names.count(ast.metadata[node].sval) == 0 &&
+                   strcmp(ast.metadata[node].sval, "readlnI") != 0;
+        if (kind == NodeType::NOT || kind == NodeType::NEGATE)
+            return is_pure(ast.child[node][0]);
+        if (kind == NodeType::OP)
+            return ast.metadata[node].oval != OpType::DIV &&
+                   is_pure(ast.child[node][0]) && is_pure(ast.child[node][1]);
+        return false;
+    }
+
+    /* overwrites node with the contents of another node, keeping its sibling link */
+    void replace(NodeId node, NodeId with) {
+        ast.kind[node] = ast.kind[with];
+        ast.loc[node] = ast.loc[with];
+        ast.child[node] = ast.child[with];
+        ast.metadata[node] = ast.metadata[with];
+        sema.symbol_of[node] = sema.symbol_of[with];
+        sema.type_of[node] = sema.type_of[with];
+        sema.captures_at[node] = sema.captures_at[with];
+        folded++;
+    }
+
+    void set_int(NodeId node, int value) {
+        ast.kind[node] = NodeType::LITERAL_INT;
+        ast.child[node] = {};
+        ast.metadata[node].ival = value;
+        folded++;
+    }
+
+    void set_real(NodeId node, float value) {
+        ast.kind[node] = NodeType::LITERAL_DBL;
+        ast.child[node] = {};
+        ast.metadata[node].dval = value;
+        folded++;
+    }
+
+    void simplify_op(NodeId node) {
+        NodeId lhs = ast.child[node][0];
+        NodeId rhs = ast.child[node][1];
+        OpType op = ast.metadata[node].oval;
+        if (ast.kind[lhs] == NodeType::LITERAL_INT && ast.kind[rhs] == NodeType::LITERAL_INT)
+            fold_int(node, op, ast.metadata[lhs].ival, ast.metadata[rhs].ival);
+        else if (ast.kind[lhs] == NodeType::LITERAL_DBL && ast.kind[rhs] == NodeType::LITERAL_DBL)
+            fold_real(node, op, ast.metadata[lhs].dval, ast.metadata[rhs].dval);
+        else if (op == OpType::ADD && is_int(rhs, 0))
+            replace(node, lhs);
+        else if (op == OpType::ADD && is_int(lhs, 0))
+            replace(node, rhs);
+        else if (op == OpType::SUB && is_int(rhs, 0))
+            replace(node, lhs);
+        else if (op == OpType::SUB && is_int(lhs, 0)) {
+            ast.kind[node] = NodeType::NEGATE;
+            ast.child[node] = {rhs};
+            folded++;
+        } else if ((op == OpType::MUL || op == OpType::DIV) && is_int(rhs, 1))
+            replace(node, lhs);
+        else if (op == OpType::MUL && is_int(lhs, 1))
+            replace(node, rhs);
+        else if (op == OpType::MUL && is_int(rhs, 0) && is_pure(lhs))
+            set_int(node, 0);
+        else if (op == OpType::MUL && is_int(lhs, 0) && is_pure(rhs))
+            set_int(node, 0);
+        else if (op == OpType::MUL)
+            reduce_mul(node, lhs, rhs);
+    }
+
+    /* x * 2^k and 2^k * x become x << k */
+    void reduce_mul(NodeId node, NodeId lhs, NodeId rhs) {
+        if (ast.kind[lhs] == NodeType::LITERAL_INT)
+            std::swap(lhs, rhs);
+        if (ast.kind[rhs] != NodeType::LITERAL_INT)
+            return;
+        int value = ast.metadata[rhs].ival;
+        if (value <= 0 || (value & (value - 1)) != 0)
+            return;
+        int shift = 0;
+        while ((1 << shift) != value)
+            shift++;
+        ast.metadata[rhs].ival = shift;
+        ast.child[node] = {lhs, rhs};
+        ast.metadata[node].oval = OpType::SHL;
+        folded++;
+    }
+
+    void fold_int(NodeId node, OpType op, int a, int b) {
+        uint32_t ua = (uint32_t)a, ub = (uint32_t)b;
+        if (op == OpType::AND) set_int(node, a & b);
+        else if (op == OpType::OR) set_int(node, a | b);
+        else if (op == OpType::LT) set_int(node, a < b);
+        else if (op == OpType::GT) set_int(node, a > b);
+        else if (op == OpType::EQ) set_int(node, a == b);
+        else if (op == OpType::LET) set_int(node, a <= b);
+        else if (op == OpType::GET) set_int(node, a >= b);
+        else if (op == OpType::NEQ) set_int(node, a != b);
+        else if (op == OpType::ADD) set_int(node, (int)(ua + ub));
+        else if (op == OpType::SUB) set_int(node, (int)(ua - ub));
+        else if (op == OpType::MUL) set_int(node, (int)(ua * ub));
+        else if (op == OpType::SHL) set_int(node, (int)(ua << (b & 31)));
+        /* division by zero is left to throw at run time */
+        else if (op == OpType::DIV && b != 0 && !(a == INT32_MIN && b == -1)) set_int(node, a / b);
+    }
+
+    /* REAL is a JVM float: fold in single precision, and keep anything that
+       is not finite (x / 0.0, overflow) for run time */
+    void fold_real(NodeId node, OpType op, double a, double b) {
+        float fa = (float)a, fb = (float)b;
+        if (op == OpType::LT) set_int(node, fa < fb);
+        else if (op == OpType::GT) set_int(node, fa > fb);
+        else if (op == OpType::EQ) set_int(node, fa == fb);
+        else if (op == OpType::LET) set_int(node, fa <= fb);
+        else if (op == OpType::GET) set_int(node, fa >= fb);
+        else if (op == OpType::NEQ) set_int(node, fa != fb);
+        else {
+            float result;
+            if (op == OpType::ADD) result = fa + fb;
+            else if (op == OpType::SUB) result = fa - fb;
+            else if (op == OpType::MUL) result = fa * fb;
+            else if (op == OpType::DIV && fb != 0.0f) result = fa / fb;
+            else return;
+            if (std::isfinite(result))
+                set_real(node, result);
+        }
+    }
+
+    void simplify_negate(NodeId node) {
+        NodeId operand = ast.child[node][0];
+        if (ast.kind[operand] == NodeType::LITERAL_INT)
+            set_int(node, (int)(0u - (uint32_t)ast.metadata[operand].ival));
+        else if (ast.kind[operand] == NodeType::LITERAL_DBL)
+            set_real(node, -(float)ast.metadata[operand].dval);
+        else if (ast.kind[operand] == NodeType::NEGATE)
+            replace(node, ast.child[operand][0]);
+    }
+
+    /* NOT is "x xor 1" */
+    void simplify_not(NodeId node) {
+        NodeId operand = ast.child[node][0];
+        if (ast.kind[operand] == NodeType::LITERAL_INT)
+            set_int(node, ast.metadata[operand].ival ^ 1);
+        else if (ast.kind[operand] == NodeType::NOT)
+            replace(node, ast.child[operand][0]);
+    }
+};
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+#include <cstddef>
+#include <ostream>
+#include <streambuf>
+
+/* Stream buffer in front of the output file: the writers append methods to
+   it as they are finished, and it passes them on in whole 64KB chunks (only
+   the tail of the class goes out short, at the final flush). */
+struct ChunkedSink : std::streambuf {
+    static constexpr size_t CHUNK_SIZE = 1 << 16;
+
+    std::ostream &dest;
+    alignas(4096) char chunk[CHUNK_SIZE];
+    size_t bytes_written = 0;
+    size_t writes = 0;
+
+    explicit ChunkedSink(std::ostream &dest) : dest(dest) { setp(chunk, chunk + CHUNK_SIZE); }
+    ChunkedSink(const ChunkedSink&) = delete;
+    ChunkedSink& operator=(const ChunkedSink&) = delete;
+
+    bool drain() {
+        size_t size = pptr() - pbase();
+        if (size == 0)
+            return true;
+        dest.write(chunk, size);
+        bytes_written += size;
+        writes++;
+        setp(chunk, chunk + CHUNK_SIZE);
+        return (bool)dest;
+    }
+
+    int_type overflow(int_type c) override {
+        if (!drain())
+            return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+            sputc(traits_type::to_char_type(c));
+        return traits_type::not_eof(c);
+    }
+
+    /* fills the current chunk before passing anything on, so large
+       appends still leave in CHUNK_SIZE pieces */
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+        std::streamsize done = 0;
+        while (done < n) {
+            std::streamsize room = epptr() - pptr();
+            if (room == 0) {
+                if (!drain())
+                    break;
+                continue;
+            }
+            std::streamsize step = n - done < room ? n - done : room;
+            traits_type::copy(pptr(), s + done, (size_t)step);
+            pbump((int)step);
+            done += step;
+        }
+        return done;
+    }
+
+    int sync() override {
+        if (!drain())
+            return -1;
+        dest.flush();
+        return dest ? 0 : -1;
+    }
+};
+
+#endif
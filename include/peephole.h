@@ -0,0 +1,178 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include <cmath>
+#include <vector>
+#include "jvm.h"
+
+/* Peephole optimiser over a method's instruction list. Instructions are
+   copied one at a time into an output list; after each one the rule table
+   is matched against the tail of the output, and a rule that fires rewrites
+   that tail in place. Matching repeats until no rule fires, so rewrites
+   cascade (iinc folding sees constants a previous rule produced) and one
+   pass over the method is enough. */
+struct Peephole {
+    typedef bool (*Apply)(std::vector<Insn> &out);
+
+    struct Rule {
+        const char *name;
+        Apply apply;
+    };
+
+    std::vector<Rule> rules;
+    std::vector<size_t> hits;
+
+    Peephole() {
+        add_rule("drop-zero-add-sub", drop_zero_add_sub);
+        add_rule("iinc", fold_iinc);
+        add_rule("store-load-to-dup", store_load_to_dup);
+        add_rule("goto-next", drop_goto_next);
+        add_rule("int-const", select_int_const);
+        add_rule("float-const", select_float_const);
+    }
+
+    void add_rule(const char *name, Apply apply) {
+        rules.push_back(Rule{name, apply});
+        hits.push_back(0);
+    }
+
+    void run(Method &method) {
+        std::vector<Insn> out;
+        out.reserve(method.code.size());
+        for (Insn &insn : method.code) {
+            out.push_back(std::move(insn));
+            bool changed = true;
+            while (changed) {
+                changed = false;
+                for (size_t i = 0; i < rules.size(); i++) {
+                    if (rules[i].apply(out)) {
+                        hits[i]++;
+                        changed = true;
+                        break;
+                    }
+                }
+            }
+        }
+        method.code = std::move(out);
+    }
+
+    /* the value of any integer constant push */
+    static bool int_constant(const Insn &insn, int &value) {
+        if (insn.opcode >= Opcode::ICONST_M1 && insn.opcode <= Opcode::ICONST_5) {
+            value = (int)insn.opcode - (int)Opcode::ICONST_0;
+            return true;
+        }
+        if (insn.opcode == Opcode::LDC_INT || insn.opcode == Opcode::BIPUSH || insn.opcode == Opcode::SIPUSH) {
+            value = insn.ival;
+            return true;
+        }
+        return false;
+    }
+
+    static bool is_load(Opcode opcode) {
+        return opcode == Opcode::ILOAD || opcode == Opcode::FLOAD || opcode == Opcode::ALOAD;
+    }
+
+    static Opcode load_for_store(Opcode opcode) {
+        if (opcode == Opcode::ISTORE) return Opcode::ILOAD;
+        if (opcode == Opcode::FSTORE) return Opcode::FLOAD;
+        if (opcode == Opcode::ASTORE) return Opcode::ALOAD;
+        return Opcode::NOP;
+    }
+
+    /* const 0; iadd|isub  =>  (nothing), e.g. "ldc 0; isub" for 0-based subscripts */
+    static bool drop_zero_add_sub(std::vector<Insn> &out) {
+        size_t n = out.size();
+        int value;
+        if (n < 2 || (out[n - 1].opcode != Opcode::IADD && out[n - 1].opcode != Opcode::ISUB))
+            return false;
+        if (!int_constant(out[n - 2], value) || value != 0)
+            return false;
+        out.resize(n - 2);
+        return true;
+    }
+
+    /* iload n; const c; iadd|isub; istore n  =>  iinc n (+/-)c
+       const c; iload n; iadd; istore n        =>  iinc n c */
+    static bool fold_iinc(std::vector<Insn> &out) {
+        size_t n = out.size();
+        if (n < 4 || out[n - 1].opcode != Opcode::ISTORE)
+            return false;
+        int slot = out[n - 1].ival;
+        Opcode op = out[n - 2].opcode;
+        int value;
+        long long delta;
+        if (out[n - 4].opcode == Opcode::ILOAD && out[n - 4].ival == slot && int_constant(out[n - 3], value) &&
+            (op == Opcode::IADD || op == Opcode::ISUB))
+            delta = op == Opcode::IADD ? (long long)value : -(long long)value;
+        else if (out[n - 3].opcode == Opcode::ILOAD && out[n - 3].ival == slot && int_constant(out[n - 4], value) &&
+                 op == Opcode::IADD)
+            delta = value;
+        else
+            return false;
+        /* wide iinc takes a signed 16-bit increment */
+        if (delta < -32768 || delta > 32767)
+            return false;
+        out.resize(n - 4);
+        out.push_back(Insn{Opcode::IINC, slot, (int)delta, 0.0, {}});
+        return true;
+    }
+
+    /* xstore n; xload n  =>  dup; xstore n */
+    static bool store_load_to_dup(std::vector<Insn> &out) {
+        size_t n = out.size();
+        if (n < 2 || !is_load(out[n - 1].opcode))
+            return false;
+        if (load_for_store(out[n - 2].opcode) != out[n - 1].opcode || out[n - 2].ival != out[n - 1].ival)
+            return false;
+        out[n - 1] = out[n - 2];
+        out[n - 2] = Insn{Opcode::DUP, 0, 0, 0.0, {}};
+        return true;
+    }
+
+    /* goto L; L:  =>  L: */
+    static bool drop_goto_next(std::vector<Insn> &out) {
+        size_t n = out.size();
+        if (n < 2 || out[n - 1].opcode != Opcode::LABEL || out[n - 2].opcode != Opcode::GOTO ||
+            out[n - 2].ival != out[n - 1].ival)
+            return false;
+        out.erase(out.end() - 2);
+        return true;
+    }
+
+    /* ldc c  =>  iconst_c | bipush c | sipush c */
+    static bool select_int_const(std::vector<Insn> &out) {
+        Insn &insn = out.back();
+        if (insn.opcode != Opcode::LDC_INT)
+            return false;
+        int value = insn.ival;
+        if (value >= -1 && value <= 5)
+            insn = Insn{(Opcode)((int)Opcode::ICONST_0 + value), 0, 0, 0.0, {}};
+        else if (value >= -128 && value <= 127)
+            insn.opcode = Opcode::BIPUSH;
+        else if (value >= -32768 && value <= 32767)
+            insn.opcode = Opcode::SIPUSH;
+        else
+            return false;
+        return true;
+    }
+
+    /* ldc 0.0|1.0|2.0  =>  fconst_n (not -0.0, which fconst_0 would lose) */
+    static bool select_float_const(std::vector<Insn> &out) {
+        Insn &insn = out.back();
+        if (insn.opcode != Opcode::LDC_FLOAT)
+            return false;
+        float value = (float)insn.dval;
+        if (value == 0.0f && !std::signbit(value))
+            insn = Insn{Opcode::FCONST_0, 0, 0, 0.0, {}};
+        else if (value == 1.0f)
+            insn = Insn{Opcode::FCONST_1, 0, 0, 0.0, {}};
+        else if (value == 2.0f)
+            insn = Insn{Opcode::FCONST_2, 0, 0, 0.0, {}};
+        else
+            return false;
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef RUNTIME_SHARED_H
+#define RUNTIME_SHARED_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The parts of the runtime both back ends need with the same behaviour:
+   --run calls them directly, --emit=c pastes their text into every program,
+   so a real prints and an integer reads the same either way. The code is C
+   that also compiles as C++; RUNTIME_SHARED compiles it and keeps it as
+   text under name (on one line: the preprocessor folds the whitespace). */
+#define RUNTIME_SHARED(name, ...) __VA_ARGS__ static const char name[] = #__VA_ARGS__;
+
+/* Float.toString: the shortest digits that read back as the same float,
+   plain between 10^-3 and 10^7, computerized scientific notation outside */
+RUNTIME_SHARED(MP_FORMAT_FLOAT,
+static void mp_format_float(float v, char *out) {
+    if (isnan(v)) {
+        strcpy(out, "NaN");
+        return;
+    }
+    if (isinf(v)) {
+        strcpy(out, v > 0 ? "Infinity" : "-Infinity");
+        return;
+    }
+    if (v == 0) {
+        strcpy(out, signbit(v) ? "-0.0" : "0.0");
+        return;
+    }
+    char sci[32];
+    for (int precision = 0; precision < 9; precision++) {
+        snprintf(sci, sizeof(sci), "%.*e", precision, (double)v);
+        if (strtof(sci, NULL) == v)
+            break;
+    }
+    char digits[16];
+    int count = 0;
+    const char *p = sci;
+    if (*p == '-')
+        *out++ = *p++;
+    for (; *p != 'e'; p++)
+        if (*p != '.')
+            digits[count++] = *p;
+    while (count > 1 && digits[count - 1] == '0')
+        count--;
+    int exponent = atoi(p + 1);
+    float magnitude = fabsf(v);
+    if (magnitude >= 1e-3f && magnitude < 1e7f) {
+        if (exponent < 0) {
+            out += sprintf(out, "0.");
+            for (int i = -1; i > exponent; i--)
+                *out++ = '0';
+            memcpy(out, digits, count);
+            out[count] = '\0';
+            return;
+        }
+        for (int i = 0; i <= exponent; i++)
+            *out++ = i < count ? digits[i] : '0';
+        *out++ = '.';
+        if (count <= exponent + 1)
+            *out++ = '0';
+        for (int i = exponent + 1; i < count; i++)
+            *out++ = digits[i];
+        *out = '\0';
+        return;
+    }
+    *out++ = digits[0];
+    *out++ = '.';
+    if (count == 1)
+        *out++ = '0';
+    for (int i = 1; i < count; i++)
+        *out++ = digits[i];
+    sprintf(out, "E%d", exponent);
+}
+)
+
+/* one decimal integer, with an optional leading '-', terminated by a
+   space, a newline or the end of the input; wraps like the JVM */
+RUNTIME_SHARED(MP_READLN_I,
+static int32_t mp_readlnI(void) {
+    uint32_t value = 0;
+    int c = getchar();
+    int negative = c == '-';
+    if (negative)
+        c = getchar();
+    while (c != '\n' && c != ' ' && c != EOF) {
+        value = (uint32_t)(c - '0') + 10u * value;
+        c = getchar();
+    }
+    return (int32_t)(negative ? 0u - value : value);
+}
+)
+
+#endif
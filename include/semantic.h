@@ -0,0 +1,452 @@
+#ifndef SEMANTIC_H
+#define SEMANTIC_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <vector>
+#include "arena.h"
+#include "ast.h"
+#include "free_vars.h"
+#include "info.h"
+#include "symbol_table.h"
+
+typedef uint32_t SymbolId;
+
+/* index 0 is reserved: a node without a symbol */
+const SymbolId NO_SYMBOL = 0;
+
+/* where a name lives at run time */
+enum class Storage { PROGRAM, GLOBAL, LOCAL, SUBPROG };
+
+/* GLOBAL: a static field. LOCAL: JVM local slot, in the method of the
+   subprogram that declares it (captured variables included, as the
+   inherited parameter they became). SUBPROG: subprog indexes the free
+   variable analysis, and slot is the slot of its return value. */
+struct Symbol {
+    const char *name;
+    TypeDescriptor *type_descriptor;
+    Storage storage;
+    int slot;
+    int subprog;
+};
+
+/* Resolves every name once, before code generation: each VAR, PROCEDURE
+   and declared ID_LIST node gets its symbol, each expression node its type,
+   and each call the symbols of the captured variables it passes. Scopes,
+   slots and inherited parameters are laid out exactly as the generated
+   methods use them, so the traverser only reads these tables. Errors are
+   reported with the messages of info.h. */
+struct SemanticAnalysis {
+    Ast &ast;
+    Arena &arena;
+    FILE *diag;
+    FreeVarAnalysis free_vars;
+    SymbolTable symbol_table;
+    size_t errors = 0;
+
+    std::vector<Symbol> symbols;
+    std::vector<SymbolId> symbol_of;
+    std::vector<TypeDescriptor*> type_of;
+    std::vector<uint32_t> captures_at;
+    std::vector<SymbolId> capture_args;
+
+    TypeDescriptor int_type{IDType::INT, 0, 0, nullptr, nullptr};
+    TypeDescriptor real_type{IDType::REAL, 0, 0, nullptr, nullptr};
+    TypeDescriptor string_type{IDType::STRING, 0, 0, nullptr, nullptr};
+    TypeDescriptor void_type{IDType::VOID, 0, 0, nullptr, nullptr};
+
+    /* the subprogram whose body is being checked; -1 is the program */
+    struct Frame {
+        int subprog;
+        SymbolId self;
+        int slots;
+        bool returns;
+        std::map<CapturedVar, SymbolId> captured;
+    };
+    std::vector<Frame> frames;
+    std::vector<SymbolId> symbol_of_timestamp;
+    std::vector<std::pair<NodeId, bool>> expr_work;
+
+    SemanticAnalysis(Ast &ast, Arena &arena, FILE *diag = stderr) : ast(ast), arena(arena), diag(diag), free_vars(ast) {}
+
+    const Symbol& symbol(NodeId node) const { return symbols[symbol_of[node]]; }
+    IDType type(NodeId node) const { return type_of[node]->id_type; }
+
+    /* the captured variables a call passes ahead of its arguments */
+    const SymbolId* captures_begin(NodeId call) const { return capture_args.data() + captures_at[call]; }
+    const SymbolId* captures_end(NodeId call) const {
+        return captures_begin(call) + free_vars.subprogs[symbol(call).subprog].captured.size();
+    }
+
+    bool run(NodeId prog) {
+        assert(ast.kind[prog] == NodeType::PROG);
+        free_vars.run(prog);
+        symbols.push_back(Symbol{"", nullptr, Storage::PROGRAM, -1, -1});
+        symbol_of.assign(ast.kind.size(), NO_SYMBOL);
+        type_of.assign(ast.kind.size(), nullptr);
+        captures_at.assign(ast.kind.size(), 0);
+        symbol_of_timestamp.push_back(NO_SYMBOL);
+
+        symbol_table.open_scope();
+        frames.push_back(Frame{-1, NO_SYMBOL, 0, false, {}});
+        add_symbol(ast.metadata[prog].sval, &void_type, Storage::PROGRAM);
+        declare_vars(ast.child[prog][1], Storage::GLOBAL);
+        check_subprogs(ast.child[prog][2]);
+        check_stmt(ast.child[prog][3]);
+        frames.pop_back();
+        symbol_table.close_scope();
+        return errors == 0;
+    }
+
+    SymbolId add_symbol(const char *name, TypeDescriptor *type_descriptor, Storage storage, int slot = -1, int subprog = -1) {
+        SymbolTableResult result = symbol_table.add(name, type_descriptor);
+        SymbolId id = (SymbolId)symbols.size();
+        symbols.push_back(Symbol{name, type_descriptor, storage, slot, subprog});
+        symbol_of_timestamp.resize(result.timestamp + 1, NO_SYMBOL);
+        symbol_of_timestamp[result.timestamp] = id;
+        return id;
+    }
+
+    SymbolId lookup(const char *name) {
+        SymbolTableResult result;
+        if (!symbol_table.find(name, result))
+            return NO_SYMBOL;
+        return symbol_of_timestamp[result.timestamp];
+    }
+
+    /* the first location in the subtree; operators without one of their own use their operand's */
+    LocType loc_of(NodeId node) {
+        while (ast.loc[node].first_line == 0 && ast.child[node][0] != NIL_NODE)
+            node = ast.child[node][0];
+        return ast.loc[node];
+    }
+
+    template <typename... Args>
+    void error(NodeId node, const char *format, Args... args) {
+        LocType loc = loc_of(node);
+        fprintf(diag, format, (int)loc.first_line, (int)loc.first_column, args...);
+        errors++;
+    }
+
+    TypeDescriptor* get_type_descriptor(NodeId root) {
+        assert(ast.kind[root] == NodeType::TYPE);
+        IDType id_type = ast.metadata[root].tval;
+        if (id_type == IDType::ARRAY)
+            return new (arena) TypeDescriptor{IDType::ARRAY, ast.metadata[ast.child[root][0]].ival, ast.metadata[ast.child[root][1]].ival,
+                                              get_type_descriptor(ast.child[root][2]), nullptr};
+        return new (arena) TypeDescriptor{id_type, 0, 0, nullptr, nullptr};
+    }
+
+    static bool same_type(const TypeDescriptor *a, const TypeDescriptor *b) {
+        for (; a->id_type == IDType::ARRAY && b->id_type == IDType::ARRAY; a = a->base, b = b->base)
+            if (a->lower_bound != b->lower_bound || a->upper_bound != b->upper_bound)
+                return false;
+        return a->id_type == b->id_type;
+    }
+
+    void declare_vars(NodeId decl_list, Storage storage) {
+        for (; decl_list != NIL_NODE; decl_list = ast.next[decl_list]) {
+            TypeDescriptor *type_descriptor = get_type_descriptor(ast.child[decl_list][1]);
+            for (NodeId id = ast.child[decl_list][0]; id != NIL_NODE; id = ast.next[id]) {
+                if (symbol_table.declared_in_scope(ast.metadata[id].sval)) {
+                    error(id, "[ERROR] " REDEF_VAR, ast.metadata[id].sval);
+                    continue;
+                }
+                int slot = storage == Storage::LOCAL ? frames.back().slots++ : -1;
+                symbol_of[id] = add_symbol(ast.metadata[id].sval, type_descriptor, storage, slot);
+            }
+        }
+    }
+
+    /* a captured variable as seen from the subprogram being checked: its
+       own variable, or the inherited parameter it was passed as */
+    SymbolId lookup_captured(const CapturedVar &var) {
+        if (var.owner == frames.back().subprog)
+            return lookup(var.name);
+        return frames.back().captured.at(var);
+    }
+
+    /* builds the subprogram's type, inherited parameters first, and declares it in the enclosing scope */
+    SymbolId declare_subprog(NodeId head) {
+        auto *subprog_type_descriptor = new (arena) TypeDescriptor{IDType::SUBPROG, 0, 0, get_type_descriptor(ast.child[head][1]), nullptr};
+        TypeDescriptor *tail = subprog_type_descriptor->base;
+        int index = free_vars.index_of_head.at(head);
+        for (const CapturedVar &var : free_vars.subprogs[index].captured)
+            tail = tail->next = new (arena) TypeDescriptor(*symbols[lookup_captured(var)].type_descriptor);
+        for (NodeId param_list = ast.child[head][0]; param_list != NIL_NODE; param_list = ast.next[param_list]) {
+            TypeDescriptor *param_type_descriptor = get_type_descriptor(ast.child[param_list][1]);
+            for (NodeId id = ast.child[param_list][0]; id != NIL_NODE; id = ast.next[id])
+                tail = tail->next = new (arena) TypeDescriptor(*param_type_descriptor);
+        }
+        tail->next = nullptr;
+
+        const char *name = ast.metadata[head].sval;
+        if (symbol_table.declared_in_scope(name)) {
+            error(head, "[ERROR] " REDEF_FUN, name);
+            SymbolId id = (SymbolId)symbols.size();
+            symbols.push_back(Symbol{name, subprog_type_descriptor, Storage::SUBPROG, -1, index});
+            return id;
+        }
+        return add_symbol(name, subprog_type_descriptor, Storage::SUBPROG, -1, index);
+    }
+
+    void check_subprogs(NodeId list) {
+        for (NodeId decl = list; decl != NIL_NODE; decl = ast.next[decl]) {
+            NodeId head = ast.child[decl][0];
+            SymbolId self = declare_subprog(head);
+            symbol_of[head] = self;
+            int index = symbols[self].subprog;
+            const std::vector<CapturedVar> &captured = free_vars.subprogs[index].captured;
+            TypeDescriptor *param_type_descriptor = symbols[self].type_descriptor->base->next;
+
+            symbol_table.open_scope();
+            frames.push_back(Frame{index, self, 0, false, {}});
+            for (size_t k = 0; k < captured.size(); k++) {
+                const CapturedVar &var = captured[k];
+                /* captured is outermost owner first, so a later variable of the
+                   same name is an inner one: only the innermost can be named here */
+                bool shadowed = std::any_of(captured.begin() + k + 1, captured.end(),
+                                            [&](const CapturedVar &inner) { return inner.name == var.name; });
+                SymbolId id;
+                if (shadowed) {
+                    id = (SymbolId)symbols.size();
+                    symbols.push_back(Symbol{var.name, param_type_descriptor, Storage::LOCAL, frames.back().slots++, -1});
+                } else {
+                    id = add_symbol(var.name, param_type_descriptor, Storage::LOCAL, frames.back().slots++);
+                }
+                frames.back().captured[var] = id;
+                param_type_descriptor = param_type_descriptor->next;
+            }
+
+            symbol_table.open_scope();
+            for (NodeId param_list = ast.child[head][0]; param_list != NIL_NODE; param_list = ast.next[param_list]) {
+                for (NodeId id = ast.child[param_list][0]; id != NIL_NODE; id = ast.next[id], param_type_descriptor = param_type_descriptor->next) {
+                    int slot = frames.back().slots++;
+                    if (symbol_table.declared_in_scope(ast.metadata[id].sval))
+                        error(id, "[ERROR] " REDEF_ARG, ast.metadata[id].sval);
+                    else
+                        symbol_of[id] = add_symbol(ast.metadata[id].sval, param_type_descriptor, Storage::LOCAL, slot);
+                }
+            }
+            symbols[self].slot = frames.back().slots++;
+
+            declare_vars(ast.child[decl][1], Storage::LOCAL);
+            check_subprogs(ast.child[decl][2]);
+            check_stmt(ast.child[decl][3]);
+            if (symbols[self].type_descriptor->base->id_type != IDType::VOID && !frames.back().returns)
+                error(head, "[ERROR] " RETURN_VAL, ast.metadata[head].sval);
+
+            frames.pop_back();
+            symbol_table.close_scope();
+            symbol_table.close_scope();
+        }
+    }
+
+    void check_stmt(NodeId root) {
+        std::vector<NodeId> pending{root};
+        while (!pending.empty()) {
+            NodeId node = pending.back();
+            pending.pop_back();
+            if (node == NIL_NODE)
+                continue;
+            if (ast.kind[node] == NodeType::STMT_LIST) {
+                size_t mark = pending.size();
+                for (NodeId stmt_list = node; stmt_list != NIL_NODE; stmt_list = ast.next[stmt_list])
+                    pending.push_back(ast.child[stmt_list][0]);
+                std::reverse(pending.begin() + mark, pending.end());
+            } else if (ast.kind[node] == NodeType::ASSIGN) {
+                check_assign(node);
+            } else if (ast.kind[node] == NodeType::IF || ast.kind[node] == NodeType::WHILE) {
+                TypeDescriptor *cond = check_expr(ast.child[node][0]);
+                if (cond != nullptr && cond->id_type != IDType::INT)
+                    error(ast.child[node][0], "[ERROR] " ARITH_TYPE, ast.kind[node] == NodeType::IF ? "if" : "while");
+                pending.push_back(ast.child[node][2]);
+                pending.push_back(ast.child[node][1]);
+            } else if (ast.kind[node] == NodeType::PROCEDURE) {
+                check_call_stmt(node);
+            }
+        }
+    }
+
+    void check_assign(NodeId node) {
+        NodeId var = ast.child[node][0];
+        const char *name = ast.metadata[var].sval;
+        TypeDescriptor *value = check_expr(ast.child[node][1]);
+        SymbolId id = lookup(name);
+        if (id == NO_SYMBOL || symbols[id].storage == Storage::PROGRAM) {
+            error(var, "[ERROR] " UNDEC_VAR, name);
+            return;
+        }
+        symbol_of[var] = id;
+        TypeDescriptor *target;
+        if (symbols[id].storage == Storage::SUBPROG) {
+            /* the return value: only inside the function itself */
+            if (id != frames.back().self || ast.child[var][0] != NIL_NODE || symbols[id].type_descriptor->base->id_type == IDType::VOID) {
+                error(var, "[ERROR] " ASSIG_TYPE);
+                return;
+            }
+            frames.back().returns = true;
+            target = symbols[id].type_descriptor->base;
+        } else {
+            target = check_subscripts(var, symbols[id].type_descriptor);
+        }
+        type_of[var] = target;
+        if (target != nullptr && value != nullptr && (target->id_type == IDType::ARRAY || !same_type(target, value)))
+            error(var, "[ERROR] " ASSIG_TYPE);
+    }
+
+    /* the element type after the variable's subscripts, or null after an error */
+    TypeDescriptor* check_subscripts(NodeId var, TypeDescriptor *type_descriptor) {
+        bool ok = true;
+        for (NodeId tail = ast.child[var][0]; tail != NIL_NODE; tail = ast.next[tail]) {
+            TypeDescriptor *index = check_expr(ast.child[tail][0]);
+            if (index != nullptr && index->id_type != IDType::INT) {
+                error(ast.child[tail][0], "[ERROR] " INDEX_TYPE);
+                ok = false;
+            }
+            if (type_descriptor->id_type != IDType::ARRAY) {
+                error(var, "[ERROR] " INDEX_MANY, ast.metadata[var].sval);
+                return nullptr;
+            }
+            type_descriptor = type_descriptor->base;
+        }
+        return ok ? type_descriptor : nullptr;
+    }
+
+    void check_call_stmt(NodeId node) {
+        const char *name = ast.metadata[node].sval;
+        IDType builtin = strcmp(name, "writelnI") == 0 ? IDType::INT :
+                         strcmp(name, "writelnR") == 0 ? IDType::REAL :
+                         strcmp(name, "writelnS") == 0 ? IDType::STRING : IDType::VOID;
+        if (builtin == IDType::VOID) {
+            check_call(node);
+            return;
+        }
+        NodeId args = ast.child[node][0];
+        TypeDescriptor *arg = args != NIL_NODE ? check_expr(ast.child[args][0]) : nullptr;
+        if (args == NIL_NODE || ast.next[args] != NIL_NODE || (arg != nullptr && arg->id_type != builtin))
+            error(node, "[ERROR] " WRONG_ARGS, name);
+    }
+
+    /* resolves a call, checks its arguments and records the captured
+       variables it passes; returns the result type */
+    TypeDescriptor* check_call(NodeId node) {
+        const char *name = ast.metadata[node].sval;
+        bool args_ok = true;
+        for (NodeId expr_list = ast.child[node][0]; expr_list != NIL_NODE; expr_list = ast.next[expr_list])
+            args_ok = check_expr(ast.child[expr_list][0]) != nullptr && args_ok;
+        SymbolId id = lookup(name);
+        if (id == NO_SYMBOL || symbols[id].storage != Storage::SUBPROG) {
+            error(node, "[ERROR] " UNDEC_FUN, name);
+            return nullptr;
+        }
+        symbol_of[node] = id;
+        const Symbol &callee = symbols[id];
+        const std::vector<CapturedVar> &captured = free_vars.subprogs[callee.subprog].captured;
+        captures_at[node] = (uint32_t)capture_args.size();
+        for (const CapturedVar &var : captured)
+            capture_args.push_back(lookup_captured(var));
+
+        TypeDescriptor *param = callee.type_descriptor->base->next;
+        for (size_t i = 0; i < captured.size(); i++)
+            param = param->next;
+        NodeId expr_list = ast.child[node][0];
+        bool match = true;
+        for (; param != nullptr && expr_list != NIL_NODE; param = param->next, expr_list = ast.next[expr_list]) {
+            TypeDescriptor *arg = type_of[ast.child[expr_list][0]];
+            match = match && (arg == nullptr || same_type(param, arg));
+        }
+        if (param != nullptr || expr_list != NIL_NODE || !match) {
+            error(node, "[ERROR] " WRONG_ARGS, name);
+            return nullptr;
+        }
+        return args_ok ? callee.type_descriptor->base : nullptr;
+    }
+
+    static const char* op_text(OpType op) {
+        static const char *texts[] = {"and", "or", "<", ">", "=", "<=", ">=", "!=", "+", "-", "*", "/", "<<"};
+        return texts[(int)op];
+    }
+
+    /* Types every node of the expression, operands before operators, with
+       an explicit stack like the code generator. The language has no
+       implicit conversion: both operands of an operation have one type,
+       which the generated code takes from the right operand. */
+    TypeDescriptor* check_expr(NodeId root) {
+        size_t base = expr_work.size();
+        expr_work.push_back({root, false});
+        while (expr_work.size() > base) {
+            NodeId node = expr_work.back().first;
+            bool operands_done = expr_work.back().second;
+            expr_work.pop_back();
+            NodeType kind = ast.kind[node];
+            if (!operands_done && (kind == NodeType::OP || kind == NodeType::NOT || kind == NodeType::NEGATE)) {
+                expr_work.push_back({node, true});
+                if (kind == NodeType::OP)
+                    expr_work.push_back({ast.child[node][1], false});
+                expr_work.push_back({ast.child[node][0], false});
+                continue;
+            }
+            type_of[node] = type_node(node);
+        }
+        return type_of[root];
+    }
+
+    TypeDescriptor* type_node(NodeId node) {
+        NodeType kind = ast.kind[node];
+        if (kind == NodeType::LITERAL_INT)
+            return &int_type;
+        if (kind == NodeType::LITERAL_DBL)
+            return &real_type;
+        if (kind == NodeType::LITERAL_STR)
+            return &string_type;
+        if (kind == NodeType::PROCEDURE)
+            return check_call(node);
+        if (kind == NodeType::VAR) {
+            const char *name = ast.metadata[node].sval;
+            if (strcmp(name, "readlnI") == 0)
+                return &int_type;
+            SymbolId id = lookup(name);
+            if (id == NO_SYMBOL || symbols[id].storage == Storage::PROGRAM) {
+                error(node, "[ERROR] " UNDEC_VAR, name);
+                return nullptr;
+            }
+            if (symbols[id].storage == Storage::SUBPROG)
+                return check_call(node);
+            symbol_of[node] = id;
+            return check_subscripts(node, symbols[id].type_descriptor);
+        }
+
+        TypeDescriptor *lhs = type_of[ast.child[node][0]];
+        if (lhs == nullptr)
+            return nullptr;
+        if (kind == NodeType::NOT || kind == NodeType::NEGATE) {
+            if (lhs->id_type == IDType::INT || (kind == NodeType::NEGATE && lhs->id_type == IDType::REAL))
+                return lhs;
+            error(node, "[ERROR] " ARITH_TYPE, kind == NodeType::NOT ? "not" : "-");
+            return nullptr;
+        }
+
+        TypeDescriptor *rhs = type_of[ast.child[node][1]];
+        if (rhs == nullptr)
+            return nullptr;
+        OpType op = ast.metadata[node].oval;
+        IDType type = rhs->id_type;
+        bool ok = lhs->id_type == type;
+        if (op == OpType::AND || op == OpType::OR || op == OpType::SHL)
+            ok = ok && type == IDType::INT;
+        else if (op == OpType::ADD)
+            ok = ok && (type == IDType::INT || type == IDType::REAL || type == IDType::STRING);
+        else
+            ok = ok && (type == IDType::INT || type == IDType::REAL);
+        if (!ok) {
+            error(node, "[ERROR] " ARITH_TYPE, op_text(op));
+            return nullptr;
+        }
+        return is_relop(op) ? &int_type : rhs;
+    }
+};
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef SLOT_ALLOCATOR_H
+#define SLOT_ALLOCATOR_H
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "frame_limits.h"
+#include "jvm.h"
+
+/* Reassigns JVM local slots from liveness: two locals whose live ranges
+   never overlap share a slot. Parameters keep their slots (the caller puts
+   them there), other locals and temporaries are greedily given the lowest
+   slot not taken by anything they interfere with. The class file version we
+   write is verified by type inference, so a slot may hold values of
+   different types at different points as long as each read sees the type
+   it expects, which liveness guarantees. */
+struct SlotAllocator {
+    size_t slots_before = 0;
+    size_t slots_after = 0;
+
+    typedef std::vector<uint64_t> Bitset;
+
+    static bool is_local_access(Opcode opcode) {
+        return opcode == Opcode::ILOAD || opcode == Opcode::FLOAD || opcode == Opcode::ALOAD ||
+               opcode == Opcode::ISTORE || opcode == Opcode::FSTORE || opcode == Opcode::ASTORE ||
+               opcode == Opcode::IINC;
+    }
+
+    static bool is_use(Opcode opcode) {
+        return opcode == Opcode::ILOAD || opcode == Opcode::FLOAD || opcode == Opcode::ALOAD || opcode == Opcode::IINC;
+    }
+
+    static bool is_def(Opcode opcode) {
+        return opcode == Opcode::ISTORE || opcode == Opcode::FSTORE || opcode == Opcode::ASTORE || opcode == Opcode::IINC;
+    }
+
+    static bool test(const Bitset &set, int i) { return (set[i >> 6] >> (i & 63)) & 1; }
+    static void set(Bitset &set, int i) { set[i >> 6] |= uint64_t(1) << (i & 63); }
+    static void reset(Bitset &set, int i) { set[i >> 6] &= ~(uint64_t(1) << (i & 63)); }
+
+    void run(Method &method) {
+        std::vector<Insn> &code = method.code;
+        int params = descriptor_arg_count(method.descriptor) + (method.access.find("static") == std::string::npos);
+        int slots = params;
+        for (const Insn &insn : code)
+            if (is_local_access(insn.opcode))
+                slots = std::max(slots, insn.ival + 1);
+        slots_before += slots;
+        if (slots == params) {
+            slots_after += slots;
+            return;
+        }
+        size_t words = (slots + 63) / 64;
+
+        /* basic blocks: a label or the instruction after a jump starts one */
+        std::vector<size_t> block_start;
+        std::vector<size_t> block_of(code.size() + 1, 0);
+        std::unordered_map<int, size_t> label_block;
+        for (size_t i = 0; i < code.size(); i++) {
+            bool leader = i == 0 || code[i].opcode == Opcode::LABEL ||
+                          is_branch(code[i - 1].opcode) || !falls_through(code[i - 1].opcode);
+            if (leader && (block_start.empty() || block_start.back() != i))
+                block_start.push_back(i);
+            block_of[i] = block_start.size() - 1;
+            if (code[i].opcode == Opcode::LABEL)
+                label_block[code[i].ival] = block_of[i];
+        }
+        size_t blocks = block_start.size();
+        block_start.push_back(code.size());
+
+        std::vector<std::vector<size_t>> successors(blocks);
+        std::vector<Bitset> use(blocks, Bitset(words, 0)), def(blocks, Bitset(words, 0));
+        for (size_t b = 0; b < blocks; b++) {
+            for (size_t i = block_start[b]; i < block_start[b + 1]; i++) {
+                const Insn &insn = code[i];
+                if (is_use(insn.opcode) && !test(def[b], insn.ival))
+                    set(use[b], insn.ival);
+                if (is_def(insn.opcode))
+                    set(def[b], insn.ival);
+            }
+            const Insn &last = code[block_start[b + 1] - 1];
+            if (is_branch(last.opcode))
+                successors[b].push_back(label_block.at(last.ival));
+            if (falls_through(last.opcode) && b + 1 < blocks)
+                successors[b].push_back(b + 1);
+        }
+
+        /* live_in = use | (live_out & ~def), iterated backwards to a fixpoint */
+        std::vector<Bitset> live_in(blocks, Bitset(words, 0)), live_out(blocks, Bitset(words, 0));
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t b = blocks; b-- > 0;) {
+                Bitset out(words, 0);
+                for (size_t s : successors[b])
+                    for (size_t w = 0; w < words; w++)
+                        out[w] |= live_in[s][w];
+                for (size_t w = 0; w < words; w++) {
+                    uint64_t in = use[b][w] | (out[w] & ~def[b][w]);
+                    if (in != live_in[b][w]) {
+                        live_in[b][w] = in;
+                        changed = true;
+                    }
+                }
+                live_out[b] = std::move(out);
+            }
+        }
+
+        /* a definition interferes with everything live after it; whatever
+           is live on entry (parameters, reads before any write) is defined
+           together at the start */
+        std::vector<Bitset> interferes(slots, Bitset(words, 0));
+        auto add_edge = [&](int a, int b) {
+            if (a != b) {
+                set(interferes[a], b);
+                set(interferes[b], a);
+            }
+        };
+        for (size_t b = 0; b < blocks; b++) {
+            Bitset live = live_out[b];
+            for (size_t i = block_start[b + 1]; i-- > block_start[b];) {
+                const Insn &insn = code[i];
+                if (is_def(insn.opcode)) {
+                    for (int l = 0; l < slots; l++)
+                        if (test(live, l))
+                            add_edge(insn.ival, l);
+                    reset(live, insn.ival);
+                }
+                if (is_use(insn.opcode))
+                    set(live, insn.ival);
+            }
+        }
+        Bitset entry = live_in[0];
+        for (int p = 0; p < params; p++)
+            set(entry, p);
+        for (int a = 0; a < slots; a++)
+            for (int b = a + 1; b < slots; b++)
+                if (test(entry, a) && test(entry, b))
+                    add_edge(a, b);
+
+        std::vector<int> color(slots, -1);
+        for (int p = 0; p < params; p++)
+            color[p] = p;
+        int used = params;
+        for (int s = params; s < slots; s++) {
+            std::vector<bool> taken(slots, false);
+            for (int n = 0; n < slots; n++)
+                if (test(interferes[s], n) && color[n] != -1)
+                    taken[color[n]] = true;
+            int c = 0;
+            while (taken[c])
+                c++;
+            color[s] = c;
+            used = std::max(used, c + 1);
+        }
+
+        for (Insn &insn : code)
+            if (is_local_access(insn.opcode))
+                insn.ival = color[insn.ival];
+        slots_after += used;
+    }
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef SOURCE_BUFFER_H
+#define SOURCE_BUFFER_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* The whole source in one block followed by the two NUL bytes flex needs to
+   scan a buffer in place, so the scanner never copies the input and a line
+   of the listing is just a pointer range. A regular file is mapped
+   copy-on-write (flex NUL-terminates each token in the buffer while it
+   works) over a zeroed anonymous mapping one page longer than needed, which
+   supplies the trailing NULs. Pipes, terminals and memory streams are read
+   into a heap block instead. */
+struct SourceBuffer {
+    char *data = nullptr;
+    size_t size = 0;
+    size_t mapped = 0;
+
+    SourceBuffer() = default;
+    SourceBuffer(const SourceBuffer&) = delete;
+    SourceBuffer& operator=(const SourceBuffer&) = delete;
+    ~SourceBuffer() { release(); }
+
+    bool load(FILE *fp) {
+        release();
+        struct stat st;
+        int fd = fileno(fp);
+        if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && map(fd, st.st_size))
+            return true;
+        return read(fp);
+    }
+
+    /* the size to hand to yy_scan_buffer */
+    size_t scan_size() const { return size + 2; }
+
+    bool map(int fd, size_t file_size) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t length = (file_size + 2 + page - 1) / page * page;
+        void *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return false;
+        if (mmap(base, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            munmap(base, length);
+            return false;
+        }
+        madvise(base, file_size, MADV_SEQUENTIAL);
+        data = static_cast<char*>(base);
+        size = file_size;
+        mapped = length;
+        return true;
+    }
+
+    bool read(FILE *fp) {
+        size_t capacity = 1 << 16;
+        data = static_cast<char*>(malloc(capacity));
+        size_t n;
+        while (data && (n = fread(data + size, 1, capacity - size - 2, fp)) > 0) {
+            size += n;
+            if (capacity - size - 2 > 0)
+                continue;
+            char *grown = static_cast<char*>(realloc(data, capacity *= 2));
+            if (grown == nullptr)
+                free(data);
+            data = grown;
+        }
+        if (data == nullptr) {
+            size = 0;
+            return false;
+        }
+        data[size] = data[size + 1] = 0;
+        return true;
+    }
+
+    void release() {
+        if (mapped)
+            munmap(data, mapped);
+        else
+            free(data);
+        data = nullptr;
+        size = mapped = 0;
+    }
+};
+
+#endif
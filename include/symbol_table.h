@@ -1,7 +1,6 @@
 #ifndef SYMBOL_TABLE_H
 #define SYMBOL_TABLE_H
 
-#include <algorithm>
 #include <cassert>
 #include <string>
 #include <unordered_map>
@@ -17,11 +16,6 @@ struct TypeDescriptor {
     TypeDescriptor *next;
 };
 
-struct SymbolTableEntry {
-    int timestamp;
-    TypeDescriptor *type_descriptor;
-};
-
 struct SymbolTableResult {
     int timestamp;
     TypeDescriptor *type_descriptor;
@@ -52,42 +46,103 @@ static std::string get_jvm_type_str(TypeDescriptor *type_descriptor) {
     return "UNKNOWN";
 }
 
+/* Identifiers are interned (see InternTable), so a name is its pointer and
+   gets a dense id the first time it is seen. Each id keeps the stack of its
+   active bindings as a chain from its innermost binding through the ones it
+   shadows, and the bindings themselves form one undo log in which every
+   scope owns a suffix. Lookup and add touch only the innermost binding, and
+   closing a scope unwinds just the bindings it made, however deep the
+   nesting. */
 struct SymbolTable {
+    struct Binding {
+        int id;
+        int timestamp;
+        TypeDescriptor *type_descriptor;
+        int scope;
+        int shadowed;
+    };
+
     int curr_timestamp = 0;
     int curr_scope = -1;
-    std::vector<std::unordered_map<std::string, SymbolTableEntry>> symbol_table;
-
-    SymbolTableResult add(const std::string &identifier, TypeDescriptor *type_descriptor) {
-        if (symbol_table[curr_scope].count(identifier)) {
-            assert(false);
-        } else {
-            SHOW_NEWSYM(identifier.c_str());
-            curr_timestamp++;
-            symbol_table[curr_scope][identifier] = SymbolTableEntry{curr_timestamp, type_descriptor};
-            return {curr_timestamp, type_descriptor, curr_scope};
-        }
+    std::unordered_map<const char*, int> ids;
+    std::vector<int> innermost;
+    std::vector<Binding> bindings;
+    std::vector<size_t> scope_start;
+
+    /* the scope and symbol trace, written to trace_out (the compile's
+       ctx.trace); off when stdout belongs to the program (--run) */
+    bool trace = true;
+    FILE *trace_out = stdout;
+
+    /* for --stats */
+    size_t adds = 0;
+    size_t lookups = 0;
+    size_t scopes_walked = 0;
+
+    int id_of(const char *identifier) {
+        auto inserted = ids.emplace(identifier, (int)innermost.size());
+        if (inserted.second)
+            innermost.push_back(-1);
+        return inserted.first->second;
     }
-    
-    SymbolTableResult get(const std::string &identifier) {
-        for (int i = curr_scope; i >= 0; i--) {
-            if (symbol_table[i].count(identifier)) {
-                SymbolTableEntry symbol_table_entry = symbol_table[i][identifier];
-                return {symbol_table_entry.timestamp, symbol_table_entry.type_descriptor, i};
-            }
-        }
-        assert(false);
+
+    /* the innermost binding of the name, or -1 */
+    int binding_of(const char *identifier) const {
+        auto it = ids.find(identifier);
+        return it == ids.end() ? -1 : innermost[it->second];
+    }
+
+    SymbolTableResult add(const char *identifier, TypeDescriptor *type_descriptor) {
+        int id = id_of(identifier);
+        assert(innermost[id] == -1 || bindings[innermost[id]].scope != curr_scope);
+        if (trace)
+            SHOW_NEWSYM(trace_out, identifier);
+        adds++;
+        curr_timestamp++;
+        bindings.push_back(Binding{id, curr_timestamp, type_descriptor, curr_scope, innermost[id]});
+        innermost[id] = (int)bindings.size() - 1;
+        return {curr_timestamp, type_descriptor, curr_scope};
+    }
+
+    /* true if the name is already declared in the innermost scope */
+    bool declared_in_scope(const char *identifier) const {
+        int binding = binding_of(identifier);
+        return binding != -1 && bindings[binding].scope == curr_scope;
+    }
+
+    /* like get, for names that may not be declared */
+    bool find(const char *identifier, SymbolTableResult &result) {
+        lookups++;
+        scopes_walked++;
+        int binding = binding_of(identifier);
+        if (binding == -1)
+            return false;
+        result = {bindings[binding].timestamp, bindings[binding].type_descriptor, bindings[binding].scope};
+        return true;
+    }
+
+    SymbolTableResult get(const char *identifier) {
+        SymbolTableResult result;
+        bool found = find(identifier, result);
+        assert(found);
+        (void)found;
+        return result;
     }
 
     void open_scope() {
-        SHOW_NEWSCP();
+        if (trace)
+            SHOW_NEWSCP(trace_out);
         curr_scope++;
-        symbol_table.emplace_back();
+        scope_start.push_back(bindings.size());
     }
 
     void close_scope() {
-        SHOW_CLSSCP();
+        if (trace)
+            SHOW_CLSSCP(trace_out);
+        for (size_t start = scope_start.back(); bindings.size() > start; bindings.pop_back())
+            innermost[bindings.back().id] = bindings.back().shadowed;
+        scope_start.pop_back();
         curr_scope--;
-        symbol_table.pop_back();
     }
 };
 
@@ -1,514 +1,1438 @@
 #ifndef TRAVERSER_H
 #define TRAVERSER_H
 
+#include <algorithm>
 #include <cstring>
+#include <map>
 #include <stack>
-#include <sstream>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
-#include "symbol_table.h"
+#include "arena.h"
+#include "class_writer.h"
+#include "compile_stats.h"
+#include "frame_limits.h"
+#include "jasmin_writer.h"
+#include "jvm.h"
+#include "loop_optimizer.h"
+#include "method_cache.h"
+#include "output_sink.h"
+#include "peephole.h"
+#include "semantic.h"
+#include "slot_allocator.h"
 
 struct Traverser {
-    std::ofstream &out_file;
+    enum class ExprTask { EVAL, OP, NOT, NEGATE, CALL, SUBSCRIPT, FLAT_SCALE, FLAT_SCALE_ADD, FLAT_LOAD, STRING, APPEND, TO_STRING };
+    enum class StmtTask { EXEC, IF_ELSE, IF_END, WHILE_END };
+    enum class CondTask { TEST, LABEL };
+
+    struct ExprFrame {
+        ExprTask task;
+        NodeId node;
+        TypeDescriptor *type_descriptor;
+        /* STRING: the quoted literal to push */
+        const char *text = nullptr;
+    };
+
+    struct StmtFrame {
+        StmtTask task;
+        NodeId node;
+        int label_1;
+        int label_2;
+    };
+
+    struct CondFrame {
+        CondTask task;
+        NodeId node;
+        bool sense;
+        int label;
+    };
+
+    std::ostream &out_file;
     std::string basename;
+    Ast &ast;
+    Arena &arena;
+    const SemanticAnalysis &sema;
+    CompileStats &stats;
+    EmitFormat emit_format;
+    int opt_level;
+    FILE *diag;
 
-    SymbolTable symbol_table;
+    JvmClass jvm_class;
+    Method vinit;
+    std::stack<Method> buffer;
+    std::vector<Method> functions;
+    Peephole peephole;
+    SlotAllocator slot_allocator;
 
-    std::stringstream vinit;
-    std::stack<std::stringstream> buffer;
-    std::vector<std::string> functions;
+    /* finished methods are optimized and written out right away, so only
+       the subprogram being generated is held as instructions */
+    ChunkedSink sink;
+    std::ostream out;
+    JasminWriter jasmin_writer;
+    ClassWriter class_writer;
+    size_t largest_method = 0;
 
-    std::stack<std::unordered_map<int, int>> reg_map;
-    std::stack<int> reg_used;
-    std::stack<int> return_symbol_reg;
+    std::vector<ExprFrame> expr_work;
 
-    IDType curr_type = IDType::VOID;
+    /* subprograms being generated; top-level ones are written out when done */
+    int subprog_depth = 0;
     int label_used = 0;
+
+    /* -O1: the tail self-calls in the body being generated, sorted, and the
+       label at the start of its method that they jump back to */
+    std::vector<NodeId> tail_call_sites;
+    int entry_label = 0;
+    /* subprograms that had tail self-calls turned into jumps, and how many */
+    std::vector<std::pair<const char*, size_t>> tail_calls;
+
+    /* set for --incremental: top-level subprograms whose key is cached are
+       not regenerated */
+    MethodCache *method_cache = nullptr;
+
+    /* set for --flat-arrays: multi-dimensional arrays are one primitive
+       array in row-major order, except the shapes whose rows are used as
+       values somewhere in the program (see find_nested_shapes) */
+    bool flat_arrays = false;
+    std::unordered_set<std::string> nested_shapes;
+    std::unordered_map<const TypeDescriptor*, bool> flat_cache;
+
+    /* off for --unbuffered-io: writeln goes straight to System.out and
+       readlnI reads System.in a byte at a time */
+    bool buffered_io = true;
+    static const int IO_BUFFER = 65536;
+
+    /* -O2: loop-invariant code motion and strength reduction. While a loop
+       is generated, these map what its preheader computed to the locals
+       holding it: expressions, subscripts already minus their lower bound,
+       and global array references; the increments of its counters step the
+       derived locals. next_slot is the first local the method leaves free. */
+    LoopOptimizer loop_optimizer;
+    std::unordered_map<NodeId, std::pair<int, IDType>> loop_values;
+    std::unordered_map<NodeId, int> loop_subscripts;
+    std::unordered_map<const Symbol*, int> loop_arrays;
+    std::vector<std::vector<const Symbol*>> loop_array_scopes;
+    std::unordered_map<NodeId, std::vector<std::pair<int, uint32_t>>> counter_steps;
+    int next_slot = 0;
+    /* past this, loops hoist nothing more: slots stay one-byte operands */
+    static const int LOOP_LOCALS = 256;
     
-    Traverser(std::ofstream &out_file, std::string basename) : out_file(out_file), basename(std::move(basename)) {}
-
-    TypeDescriptor* get_type_descriptor(Node *root) {
-        assert(root->node_type == NodeType::TYPE);
-        
-        if (root->metadata.tval == IDType::INT ||
-            root->metadata.tval == IDType::REAL ||
-            root->metadata.tval == IDType::STRING ||
-            root->metadata.tval == IDType::VOID)
-            return new TypeDescriptor{root->metadata.tval};
-        else if (root->metadata.tval == IDType::ARRAY)
-            return new TypeDescriptor{IDType::ARRAY, root->child[0]->metadata.ival, root->child[1]->metadata.ival, 
-                                      get_type_descriptor(root->child[2]), nullptr};
-        
-        assert(false);
-    }
-
-    void gen_expr(Node *root) {
-        if (root->node_type == NodeType::LITERAL_INT) {
-            buffer.top() << "    ldc " << root->metadata.ival << "\n";
-            curr_type = IDType::INT;
-        } else if (root->node_type == NodeType::LITERAL_DBL) {
-            buffer.top() << "    ldc " << std::showpoint << root->metadata.dval << std::noshowpoint << "\n";
-            curr_type = IDType::REAL;
-        } else if (root->node_type == NodeType::LITERAL_STR) {
-            buffer.top() << "    ldc " << root->metadata.sval << "\n";
-            curr_type = IDType::STRING;
-        } else if (root->node_type == NodeType::OP) {
-            gen_expr(root->child[0]);
-            gen_expr(root->child[1]);
-            if (root->metadata.oval == OpType::AND) {
-                buffer.top() << "    iand\n";
-            } else if (root->metadata.oval == OpType::OR) {
-                buffer.top() << "    ior\n";
-            } else if (root->metadata.oval == OpType::LT || 
-                       root->metadata.oval == OpType::GT ||
-                       root->metadata.oval == OpType::EQ ||
-                       root->metadata.oval == OpType::LET ||
-                       root->metadata.oval == OpType::GET ||
-                       root->metadata.oval == OpType::NEQ) {
-                if (curr_type == IDType::INT) {
-                    if (root->metadata.oval == OpType::LT) 
-                        buffer.top() << "    if_icmplt";
-                    else if (root->metadata.oval == OpType::GT) 
-                        buffer.top() << "    if_icmpgt";
-                    else if (root->metadata.oval == OpType::EQ) 
-                        buffer.top() << "    if_icmpeq";
-                    else if (root->metadata.oval == OpType::LET) 
-                        buffer.top() << "    if_icmple";
-                    else if (root->metadata.oval == OpType::GET) 
-                        buffer.top() << "    if_icmpge";
-                    else if (root->metadata.oval == OpType::NEQ) 
-                        buffer.top() << "    if_icmpne";
-                } else if (curr_type == IDType::REAL) {
-                    buffer.top() << "    fcmpg\n";
-                    if (root->metadata.oval == OpType::LT) {
-                        buffer.top() << "    iconst_m1\n";
-                        buffer.top() << "    if_icmpeq";
-                    } else if (root->metadata.oval == OpType::GT) {
-                        buffer.top() << "    iconst_1\n";
-                        buffer.top() << "    if_icmpeq";
-                    } else if (root->metadata.oval == OpType::EQ) {
-                        buffer.top() << "    iconst_0\n";
-                        buffer.top() << "    if_icmpeq";
-                    } else if (root->metadata.oval == OpType::LET) {
-                        buffer.top() << "    iconst_0\n";
-                        buffer.top() << "    if_icmple";
-                    } else if (root->metadata.oval == OpType::GET) {
-                        buffer.top() << "    iconst_0\n";
-                        buffer.top() << "    if_icmpge";
-                    } else if (root->metadata.oval == OpType::NEQ) {
-                        buffer.top() << "    iconst_0\n";
-                        buffer.top() << "    if_icmpne";
-                    }
-                }
-                int true_label = ++label_used;
-                int end_label = ++label_used;
-                buffer.top() << " L" << true_label << "\n";
-                buffer.top() << "    iconst_0\n";
-                buffer.top() << "    goto L" << end_label << "\n";
-                buffer.top() << "L" << true_label << ":\n";
-                buffer.top() << "    iconst_1\n";
-                buffer.top() << "L" << end_label << ":\n";
-                curr_type = IDType::INT;
-            } else if (root->metadata.oval == OpType::ADD) {
-                if (curr_type == IDType::INT)
-                    buffer.top() << "    iadd\n";
-                else if (curr_type == IDType::REAL)
-                    buffer.top() << "    fadd\n";
-                else if (curr_type == IDType::STRING) {
-                    int first_reg = reg_used.top();
-                    reg_used.top()++;
-                    int second_reg = reg_used.top();
-                    reg_used.top()++;
-                    buffer.top() << "    astore " << second_reg << "\n";
-                    buffer.top() << "    astore " << first_reg << "\n";
-                    buffer.top() << "    new java/lang/StringBuffer\n";
-                    buffer.top() << "    dup\n";
-                    buffer.top() << "    invokespecial java/lang/StringBuffer/<init>()V\n";
-                    buffer.top() << "    aload " << first_reg << "\n";
-                    buffer.top() << "    invokevirtual java/lang/StringBuffer/append(Ljava/lang/String;)Ljava/lang/StringBuffer;\n";
-                    buffer.top() << "    aload " << second_reg << "\n";
-                    buffer.top() << "    invokevirtual java/lang/StringBuffer/append(Ljava/lang/String;)Ljava/lang/StringBuffer;\n";
-                    buffer.top() << "    invokevirtual java/lang/StringBuffer/toString()Ljava/lang/String;\n";
-                }
-            } else if (root->metadata.oval == OpType::SUB) {
-                if (curr_type == IDType::INT)
-                    buffer.top() << "    isub\n";
-                else if (curr_type == IDType::REAL)
-                    buffer.top() << "    fsub\n";
-            } else if (root->metadata.oval == OpType::MUL) {
-                if (curr_type == IDType::INT)
-                    buffer.top() << "    imul\n";
-                else if (curr_type == IDType::REAL)
-                    buffer.top() << "    fmul\n";
-            } else if (root->metadata.oval == OpType::DIV) {
-                if (curr_type == IDType::INT)
-                    buffer.top() << "    idiv\n";
-                else if (curr_type == IDType::REAL)
-                    buffer.top() << "    fdiv\n";
+    /* names, slots and expression types come from sema, which has already
+       checked the program; the traverser itself does no lookups */
+    Traverser(std::ostream &out_file, std::string basename, Ast &ast, Arena &arena, const SemanticAnalysis &sema, CompileStats &stats, EmitFormat emit_format, int opt_level, FILE *diag = stderr) : out_file(out_file), basename(std::move(basename)), ast(ast), arena(arena), sema(sema), stats(stats), emit_format(emit_format), opt_level(opt_level), diag(diag), sink(out_file), out(&sink), jasmin_writer(out), class_writer(out, diag), loop_optimizer(ast, sema) {
+        loop_optimizer.is_flat = [this](TypeDescriptor *type_descriptor) { return is_flat(type_descriptor); };
+    }
+
+    /* Expressions are walked with an explicit worklist instead of recursion, so
+       arbitrarily long operator chains cannot exhaust the native stack. EVAL
+       frames expand a node; the other frames emit the code that follows the
+       node's operands. */
+    void gen_expr(NodeId root) {
+        size_t base = expr_work.size();
+        expr_work.push_back(ExprFrame{ExprTask::EVAL, root, nullptr});
+        run_expr_work(base);
+    }
+
+    /* runs the frames above base */
+    void run_expr_work(size_t base) {
+        while (expr_work.size() > base) {
+            ExprFrame frame = expr_work.back();
+            expr_work.pop_back();
+            if (frame.task == ExprTask::EVAL)
+                gen_expr_eval(frame.node);
+            else if (frame.task == ExprTask::OP)
+                gen_expr_op(frame.node);
+            else if (frame.task == ExprTask::NOT) {
+                buffer.top().emit(Opcode::ICONST_1);
+                buffer.top().emit(Opcode::IXOR);
+            } else if (frame.task == ExprTask::NEGATE) {
+                if (sema.type(frame.node) == IDType::INT)
+                    buffer.top().emit(Opcode::INEG);
+                else if (sema.type(frame.node) == IDType::REAL)
+                    buffer.top().emit(Opcode::FNEG);
+            } else if (frame.task == ExprTask::CALL) {
+                buffer.top().emit(Opcode::INVOKESTATIC, basename + "/" + ast.metadata[frame.node].sval + jvm_type(frame.type_descriptor));
+            } else if (frame.task == ExprTask::FLAT_SCALE || frame.task == ExprTask::FLAT_SCALE_ADD) {
+                gen_scale(flat_stride(frame.type_descriptor));
+                if (frame.task == ExprTask::FLAT_SCALE_ADD)
+                    buffer.top().emit(Opcode::IADD);
+            } else if (frame.task == ExprTask::FLAT_LOAD) {
+                gen_flat_offset(frame.node);
+                IDType element = element_type(frame.type_descriptor);
+                if (element == IDType::INT)
+                    buffer.top().emit(Opcode::IALOAD);
+                else if (element == IDType::REAL)
+                    buffer.top().emit(Opcode::FALOAD);
+                else
+                    buffer.top().emit(Opcode::AALOAD);
+            } else if (frame.task == ExprTask::SUBSCRIPT) {
+                gen_subscript_index(frame.node, frame.type_descriptor);
+                if (frame.type_descriptor->base->id_type == IDType::INT)
+                    buffer.top().emit(Opcode::IALOAD);
+                else if (frame.type_descriptor->base->id_type == IDType::REAL)
+                    buffer.top().emit(Opcode::FALOAD);
+                else
+                    buffer.top().emit(Opcode::AALOAD);
+            } else if (frame.task == ExprTask::STRING) {
+                buffer.top().emit(Opcode::LDC_STRING, frame.text);
+            } else if (frame.task == ExprTask::APPEND) {
+                buffer.top().emit(Opcode::INVOKEVIRTUAL, "java/lang/StringBuilder/append(Ljava/lang/String;)Ljava/lang/StringBuilder;");
+            } else if (frame.task == ExprTask::TO_STRING) {
+                buffer.top().emit(Opcode::INVOKEVIRTUAL, "java/lang/StringBuilder/toString()Ljava/lang/String;");
             }
-        } else if (root->node_type == NodeType::VAR) {
-            if (strcmp(root->metadata.sval, "readlnI") == 0) {
-                buffer.top() << "    invokestatic " << basename << "/readlnI()I\n";
+        }
+    }
+
+    void gen_expr_eval(NodeId root) {
+        if (!loop_values.empty()) {
+            auto hoisted = loop_values.find(root);
+            if (hoisted != loop_values.end()) {
+                gen_local_load(hoisted->second.second, hoisted->second.first);
+                return;
+            }
+        }
+        if (ast.kind[root] == NodeType::LITERAL_INT) {
+            buffer.top().emit(Opcode::LDC_INT, ast.metadata[root].ival);
+        } else if (ast.kind[root] == NodeType::LITERAL_DBL) {
+            buffer.top().emit_float(ast.metadata[root].dval);
+        } else if (ast.kind[root] == NodeType::LITERAL_STR) {
+            buffer.top().emit(Opcode::LDC_STRING, ast.metadata[root].sval);
+        } else if (ast.kind[root] == NodeType::OP && is_condition(root)) {
+            int false_label = ++label_used;
+            int end_label = ++label_used;
+            gen_cond(root, false, false_label);
+            buffer.top().emit(Opcode::ICONST_1);
+            buffer.top().emit(Opcode::GOTO, end_label);
+            buffer.top().emit(Opcode::LABEL, false_label);
+            buffer.top().emit(Opcode::ICONST_0);
+            buffer.top().emit(Opcode::LABEL, end_label);
+        } else if (ast.kind[root] == NodeType::OP && ast.metadata[root].oval == OpType::ADD && sema.type(root) == IDType::STRING) {
+            gen_concat(root);
+        } else if (ast.kind[root] == NodeType::OP) {
+            expr_work.push_back(ExprFrame{ExprTask::OP, root, nullptr});
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[root][1], nullptr});
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[root][0], nullptr});
+        } else if (ast.kind[root] == NodeType::VAR) {
+            if (strcmp(ast.metadata[root].sval, "readlnI") == 0) {
+                buffer.top().emit(Opcode::INVOKESTATIC, basename + "/readlnI()I");
             } else {
-                char *node_name = root->metadata.sval;
-                SymbolTableResult symbol_table_result = symbol_table.get(node_name);
-                if (symbol_table_result.type_descriptor->id_type == IDType::SUBPROG) {
-                    if (symbol_table_result.scope != 0)
-                        gen_additional_vars();
-                    for (Node *curr = root->child[0]; curr != nullptr; curr = curr->next)
-                        gen_expr(curr->child[0]);
-                    buffer.top() << "    invokestatic " << basename << "/" << node_name << get_jvm_type_str(symbol_table_result.type_descriptor) << "\n";
-                    curr_type = symbol_table_result.type_descriptor->base->id_type;
+                const Symbol &symbol = sema.symbol(root);
+                if (symbol.storage == Storage::SUBPROG) {
+                    gen_call(root, symbol);
                 } else {
-                    if (symbol_table_result.scope == 0) {
-                        buffer.top() << "    getstatic " << basename << "/" << node_name << " " << get_jvm_type_str(symbol_table_result.type_descriptor) << "\n";
-                    } else {
-                        if (symbol_table_result.type_descriptor->id_type == IDType::INT) 
-                            buffer.top() << "    iload " << reg_map.top()[symbol_table_result.timestamp] << "\n";
-                        else if (symbol_table_result.type_descriptor->id_type == IDType::REAL) 
-                            buffer.top() << "    fload " << reg_map.top()[symbol_table_result.timestamp] << "\n";
-                        else
-                            buffer.top() << "    aload " << reg_map.top()[symbol_table_result.timestamp] << "\n";
-                    }
-                    curr_type = symbol_table_result.type_descriptor->id_type;
-                }
-                if (symbol_table_result.type_descriptor->id_type == IDType::ARRAY) {
-                    Node *curr_var_tail = root->child[0];
-                    TypeDescriptor *curr_type_descriptor = symbol_table_result.type_descriptor;
-                    for (; curr_var_tail != nullptr; curr_var_tail = curr_var_tail->next, curr_type_descriptor = curr_type_descriptor->base) {
-                        gen_expr(curr_var_tail->child[0]);
-                        buffer.top() << "    ldc " << curr_type_descriptor->lower_bound << "\n";
-                        buffer.top() << "    isub\n";
-                        if (curr_type_descriptor->base->id_type == IDType::INT)
-                            buffer.top() << "    iaload\n";
-                        else if (curr_type_descriptor->base->id_type == IDType::REAL)
-                            buffer.top() << "    faload\n";
-                        else
-                            buffer.top() << "    aaload\n";
+                    gen_var_load(symbol);
+                    if (is_flat(symbol.type_descriptor) && ast.child[root][0] != NIL_NODE) {
+                        expr_work.push_back(ExprFrame{ExprTask::FLAT_LOAD, root, symbol.type_descriptor});
+                        push_flat_index(root, symbol.type_descriptor);
+                    } else if (symbol.type_descriptor->id_type == IDType::ARRAY) {
+                        size_t mark = expr_work.size();
+                        TypeDescriptor *curr_type_descriptor = symbol.type_descriptor;
+                        for (NodeId curr_var_tail = ast.child[root][0]; curr_var_tail != NIL_NODE; curr_var_tail = ast.next[curr_var_tail], curr_type_descriptor = curr_type_descriptor->base) {
+                            if (loop_subscripts.count(curr_var_tail) == 0)
+                                expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[curr_var_tail][0], nullptr});
+                            expr_work.push_back(ExprFrame{ExprTask::SUBSCRIPT, curr_var_tail, curr_type_descriptor});
+                        }
+                        std::reverse(expr_work.begin() + mark, expr_work.end());
                     }
                 }
             }
-        } else if (root->node_type == NodeType::PROCEDURE) {
-            char *node_name = root->metadata.sval;
-            SymbolTableResult symbol_table_result = symbol_table.get(node_name);
-            if (symbol_table_result.scope != 0)
-                gen_additional_vars();
-            for (Node *curr = root->child[0]; curr != nullptr; curr = curr->next)
-                gen_expr(curr->child[0]);
-            buffer.top() << "    invokestatic " << basename << "/" << node_name << get_jvm_type_str(symbol_table_result.type_descriptor) << "\n";
-        } else if (root->node_type == NodeType::NOT) {
-            gen_expr(root->child[0]);
-            buffer.top() << "    iconst_1\n";
-            buffer.top() << "    ixor\n";
-        } else if (root->node_type == NodeType::NEGATE) {
-            gen_expr(root->child[0]);
-            if (curr_type == IDType::INT)
-                buffer.top() << "    ineg\n";
-            else if (curr_type == IDType::REAL)
-                buffer.top() << "    fneg\n";
+        } else if (ast.kind[root] == NodeType::PROCEDURE) {
+            gen_call(root, sema.symbol(root));
+        } else if (ast.kind[root] == NodeType::NOT) {
+            expr_work.push_back(ExprFrame{ExprTask::NOT, root, nullptr});
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[root][0], nullptr});
+        } else if (ast.kind[root] == NodeType::NEGATE) {
+            expr_work.push_back(ExprFrame{ExprTask::NEGATE, root, nullptr});
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[root][0], nullptr});
         } else {
             assert(false);
         }
     }
-    
-    void gen_prog(Node *root) {
-        assert(root->node_type == NodeType::PROG);
-        // Node *id_list_node = root->child[0];
-        Node *decl_list_node = root->child[1];
-        Node *subprog_decl_list_node = root->child[2];
-        Node *stmt_list_node = root->child[3];
-
-        buffer.emplace();
-        symbol_table.open_scope();
-
-        symbol_table.add(root->metadata.sval, new TypeDescriptor{IDType::VOID});
-        buffer.top() << ".class public " << basename << "\n.super java/lang/Object\n\n";
+
+    void gen_expr_op(NodeId root) {
+        IDType type = sema.type(root);
+        if (ast.metadata[root].oval == OpType::AND) {
+            buffer.top().emit(Opcode::IAND);
+        } else if (ast.metadata[root].oval == OpType::OR) {
+            buffer.top().emit(Opcode::IOR);
+        } else if (ast.metadata[root].oval == OpType::ADD) {
+            if (type == IDType::INT)
+                buffer.top().emit(Opcode::IADD);
+            else if (type == IDType::REAL)
+                buffer.top().emit(Opcode::FADD);
+        } else if (ast.metadata[root].oval == OpType::SUB) {
+            if (type == IDType::INT)
+                buffer.top().emit(Opcode::ISUB);
+            else if (type == IDType::REAL)
+                buffer.top().emit(Opcode::FSUB);
+        } else if (ast.metadata[root].oval == OpType::MUL) {
+            if (type == IDType::INT)
+                buffer.top().emit(Opcode::IMUL);
+            else if (type == IDType::REAL)
+                buffer.top().emit(Opcode::FMUL);
+        } else if (ast.metadata[root].oval == OpType::DIV) {
+            if (type == IDType::INT)
+                buffer.top().emit(Opcode::IDIV);
+            else if (type == IDType::REAL)
+                buffer.top().emit(Opcode::FDIV);
+        } else if (ast.metadata[root].oval == OpType::SHL) {
+            buffer.top().emit(Opcode::ISHL);
+        }
+    }
+
+    /* String a + b + ... is flattened into one StringBuilder chain with no
+       intermediate strings. Adjacent literals are merged at compile time,
+       and a literal first piece becomes the builder's initial contents. */
+    void gen_concat(NodeId root) {
+        /* a piece is an expression, or a run of literals merged here (the
+           tree is left as written: the incremental key hashes it) */
+        struct Piece {
+            NodeId node;
+            std::string text;
+        };
+        std::vector<Piece> pieces;
+        std::vector<NodeId> pending{root};
+        while (!pending.empty()) {
+            NodeId node = pending.back();
+            pending.pop_back();
+            if (ast.kind[node] == NodeType::OP && ast.metadata[node].oval == OpType::ADD && sema.type(node) == IDType::STRING) {
+                pending.push_back(ast.child[node][1]);
+                pending.push_back(ast.child[node][0]);
+            } else if (ast.kind[node] == NodeType::LITERAL_STR && strcmp(ast.metadata[node].sval, "\"\"") == 0) {
+                continue;
+            } else if (ast.kind[node] == NodeType::LITERAL_STR && !pieces.empty() && pieces.back().node == NIL_NODE) {
+                /* both are quoted: drop the closing quote of one and the opening quote of the other */
+                pieces.back().text.pop_back();
+                pieces.back().text += ast.metadata[node].sval + 1;
+            } else if (ast.kind[node] == NodeType::LITERAL_STR) {
+                pieces.push_back(Piece{NIL_NODE, ast.metadata[node].sval});
+            } else {
+                pieces.push_back(Piece{node, std::string()});
+            }
+        }
+
+        if (pieces.empty()) {
+            buffer.top().emit(Opcode::LDC_STRING, "\"\"");
+            return;
+        }
+        if (pieces.size() == 1 && pieces[0].node == NIL_NODE) {
+            buffer.top().emit(Opcode::LDC_STRING, pieces[0].text);
+            return;
+        }
+        if (pieces.size() == 1) {
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, pieces[0].node, nullptr});
+            return;
+        }
+        buffer.top().emit(Opcode::NEW, "java/lang/StringBuilder");
+        buffer.top().emit(Opcode::DUP);
+        size_t first = 0;
+        if (pieces[0].node == NIL_NODE) {
+            buffer.top().emit(Opcode::LDC_STRING, pieces[0].text);
+            buffer.top().emit(Opcode::INVOKESPECIAL, "java/lang/StringBuilder/<init>(Ljava/lang/String;)V");
+            first = 1;
+        } else {
+            buffer.top().emit(Opcode::INVOKESPECIAL, "java/lang/StringBuilder/<init>()V");
+        }
+        expr_work.push_back(ExprFrame{ExprTask::TO_STRING, root, nullptr});
+        for (size_t i = pieces.size(); i-- > first;) {
+            expr_work.push_back(ExprFrame{ExprTask::APPEND, pieces[i].node, nullptr});
+            if (pieces[i].node != NIL_NODE)
+                expr_work.push_back(ExprFrame{ExprTask::EVAL, pieces[i].node, nullptr});
+            else
+                expr_work.push_back(ExprFrame{ExprTask::STRING, NIL_NODE, nullptr, arena.strdup(pieces[i].text.c_str(), pieces[i].text.size())});
+        }
+    }
+
+    /* comparisons, and AND/OR of booleans, are generated as branches */
+    bool is_condition(NodeId root) {
+        if (is_relop(ast.metadata[root].oval))
+            return true;
+        return (ast.metadata[root].oval == OpType::AND || ast.metadata[root].oval == OpType::OR) && is_boolean(ast, root);
+    }
+
+    /* Jumps to label when the truth value of root equals sense and falls
+       through otherwise. AND/OR of booleans short-circuit: the right operand
+       is skipped once the left one decides the result. */
+    void gen_cond(NodeId root, bool sense, int label) {
+        std::vector<CondFrame> work;
+        work.push_back(CondFrame{CondTask::TEST, root, sense, label});
+        while (!work.empty()) {
+            CondFrame frame = work.back();
+            work.pop_back();
+            NodeId node = frame.node;
+            if (frame.task == CondTask::LABEL) {
+                buffer.top().emit(Opcode::LABEL, frame.label);
+            } else if (ast.kind[node] == NodeType::OP && is_relop(ast.metadata[node].oval)) {
+                gen_compare_branch(node, frame.sense, frame.label);
+            } else if (ast.kind[node] == NodeType::OP && is_condition(node)) {
+                bool is_and = ast.metadata[node].oval == OpType::AND;
+                if (is_and == frame.sense) {
+                    /* a AND b is true / a OR b is false only if both sides agree */
+                    int skip_label = ++label_used;
+                    work.push_back(CondFrame{CondTask::LABEL, NIL_NODE, false, skip_label});
+                    work.push_back(CondFrame{CondTask::TEST, ast.child[node][1], frame.sense, frame.label});
+                    work.push_back(CondFrame{CondTask::TEST, ast.child[node][0], !frame.sense, skip_label});
+                } else {
+                    work.push_back(CondFrame{CondTask::TEST, ast.child[node][1], frame.sense, frame.label});
+                    work.push_back(CondFrame{CondTask::TEST, ast.child[node][0], frame.sense, frame.label});
+                }
+            } else if (ast.kind[node] == NodeType::NOT && is_boolean(ast, ast.child[node][0])) {
+                work.push_back(CondFrame{CondTask::TEST, ast.child[node][0], !frame.sense, frame.label});
+            } else if (ast.kind[node] == NodeType::LITERAL_INT) {
+                if ((ast.metadata[node].ival != 0) == frame.sense)
+                    buffer.top().emit(Opcode::GOTO, frame.label);
+            } else {
+                gen_expr(node);
+                buffer.top().emit(frame.sense ? Opcode::IFNE : Opcode::IFEQ, frame.label);
+            }
+        }
+    }
+
+    void gen_compare_branch(NodeId root, bool sense, int label) {
+        OpType op = ast.metadata[root].oval;
+        OpType branch_op = sense ? op : negate_relop(op);
+        NodeId rhs = ast.child[root][1];
+        gen_expr(ast.child[root][0]);
+        if (sema.type(ast.child[root][0]) == IDType::INT && ast.kind[rhs] == NodeType::LITERAL_INT && ast.metadata[rhs].ival == 0) {
+            buffer.top().emit(zero_branch_opcode(branch_op), label);
+            return;
+        }
+        gen_expr(rhs);
+        if (sema.type(rhs) == IDType::REAL) {
+            /* pick the variant that makes a NaN operand fail the original
+               comparison: fcmpg yields 1 for <, <=; fcmpl yields -1 for >, >= */
+            buffer.top().emit(op == OpType::LT || op == OpType::LET ? Opcode::FCMPG : Opcode::FCMPL);
+            buffer.top().emit(zero_branch_opcode(branch_op), label);
+        } else {
+            buffer.top().emit(icmp_branch_opcode(branch_op), label);
+        }
+    }
+
+    static OpType negate_relop(OpType op) {
+        if (op == OpType::LT) return OpType::GET;
+        if (op == OpType::GT) return OpType::LET;
+        if (op == OpType::EQ) return OpType::NEQ;
+        if (op == OpType::LET) return OpType::GT;
+        if (op == OpType::GET) return OpType::LT;
+        return OpType::EQ;
+    }
+
+    static Opcode zero_branch_opcode(OpType op) {
+        if (op == OpType::LT) return Opcode::IFLT;
+        if (op == OpType::GT) return Opcode::IFGT;
+        if (op == OpType::EQ) return Opcode::IFEQ;
+        if (op == OpType::LET) return Opcode::IFLE;
+        if (op == OpType::GET) return Opcode::IFGE;
+        return Opcode::IFNE;
+    }
+
+    static Opcode icmp_branch_opcode(OpType op) {
+        if (op == OpType::LT) return Opcode::IF_ICMPLT;
+        if (op == OpType::GT) return Opcode::IF_ICMPGT;
+        if (op == OpType::EQ) return Opcode::IF_ICMPEQ;
+        if (op == OpType::LET) return Opcode::IF_ICMPLE;
+        if (op == OpType::GET) return Opcode::IF_ICMPGE;
+        return Opcode::IF_ICMPNE;
+    }
+
+    /* pushes the captured variables, then schedules the arguments and the invokestatic */
+    void gen_call(NodeId root, const Symbol &callee) {
+        gen_captured_vars(root);
+        expr_work.push_back(ExprFrame{ExprTask::CALL, root, callee.type_descriptor});
+        size_t mark = expr_work.size();
+        for (NodeId curr = ast.child[root][0]; curr != NIL_NODE; curr = ast.next[curr])
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[curr][0], nullptr});
+        std::reverse(expr_work.begin() + mark, expr_work.end());
+    }
+
+    void gen_var_load(const Symbol &symbol) {
+        if (!loop_arrays.empty()) {
+            auto hoisted = loop_arrays.find(&symbol);
+            if (hoisted != loop_arrays.end()) {
+                buffer.top().emit(Opcode::ALOAD, hoisted->second);
+                return;
+            }
+        }
+        if (symbol.storage == Storage::GLOBAL) {
+            buffer.top().emit(Opcode::GETSTATIC, basename + "/" + symbol.name + " " + jvm_type(symbol.type_descriptor));
+        } else {
+            if (symbol.type_descriptor->id_type == IDType::INT) 
+                buffer.top().emit(Opcode::ILOAD, symbol.slot);
+            else if (symbol.type_descriptor->id_type == IDType::REAL) 
+                buffer.top().emit(Opcode::FLOAD, symbol.slot);
+            else
+                buffer.top().emit(Opcode::ALOAD, symbol.slot);
+        }
+    }
+
+    void gen_local_load(IDType type, int slot) {
+        if (type == IDType::INT)
+            buffer.top().emit(Opcode::ILOAD, slot);
+        else if (type == IDType::REAL)
+            buffer.top().emit(Opcode::FLOAD, slot);
+        else
+            buffer.top().emit(Opcode::ALOAD, slot);
+    }
+
+    void gen_local_store(IDType type, int slot) {
+        if (type == IDType::INT)
+            buffer.top().emit(Opcode::ISTORE, slot);
+        else if (type == IDType::REAL)
+            buffer.top().emit(Opcode::FSTORE, slot);
+        else
+            buffer.top().emit(Opcode::ASTORE, slot);
+    }
+
+    /* the subscript's value is on the stack, or was derived before the loop */
+    void gen_subscript_index(NodeId tail, TypeDescriptor *dimension) {
+        auto derived = loop_subscripts.find(tail);
+        if (derived != loop_subscripts.end()) {
+            buffer.top().emit(Opcode::ILOAD, derived->second);
+            return;
+        }
+        buffer.top().emit(Opcode::LDC_INT, dimension->lower_bound);
+        buffer.top().emit(Opcode::ISUB);
+    }
+
+    /* A shape is the array type with its bounds. Rows of a multi-dimensional
+       array can be passed on as arrays in their own right, which a flat array
+       cannot do, so with --flat-arrays a shape stays nested wherever some
+       variable of it is used with fewer subscripts than dimensions, and so
+       does the shape of such a row if it has more than one dimension. Equal
+       shapes are interchangeable as arguments, so the choice is per shape. */
+    void find_nested_shapes() {
+        for (NodeId node = 0; node < (NodeId)ast.size(); node++) {
+            if (ast.kind[node] != NodeType::VAR || sema.symbol_of[node] == NO_SYMBOL)
+                continue;
+            TypeDescriptor *type_descriptor = sema.symbol(node).type_descriptor;
+            if (type_descriptor->id_type != IDType::ARRAY || ast.child[node][0] == NIL_NODE)
+                continue;
+            TypeDescriptor *row = type_descriptor;
+            for (NodeId tail = ast.child[node][0]; tail != NIL_NODE && row->id_type == IDType::ARRAY; tail = ast.next[tail])
+                row = row->base;
+            if (row->id_type != IDType::ARRAY)
+                continue;
+            nested_shapes.insert(type_key(type_descriptor));
+            if (row->base->id_type == IDType::ARRAY)
+                nested_shapes.insert(type_key(row));
+        }
+    }
+
+    /* the number of elements, or -1 if it does not fit in an int or an
+       extent is negative (multianewarray then throws as before) */
+    static int64_t element_count(const TypeDescriptor *type_descriptor) {
+        int64_t count = 1;
+        for (; type_descriptor->id_type == IDType::ARRAY; type_descriptor = type_descriptor->base) {
+            int64_t extent = (int64_t)type_descriptor->upper_bound - type_descriptor->lower_bound + 1;
+            if (extent < 0)
+                return -1;
+            count *= extent;
+            if (count > INT32_MAX)
+                return -1;
+        }
+        return count;
+    }
+
+    bool is_flat(TypeDescriptor *type_descriptor) {
+        if (!flat_arrays || type_descriptor->id_type != IDType::ARRAY || type_descriptor->base->id_type != IDType::ARRAY)
+            return false;
+        auto found = flat_cache.find(type_descriptor);
+        if (found != flat_cache.end())
+            return found->second;
+        bool flat = element_count(type_descriptor) >= 0 && nested_shapes.count(type_key(type_descriptor)) == 0;
+        flat_cache.emplace(type_descriptor, flat);
+        return flat;
+    }
+
+    /* get_jvm_type_str, with flattened arrays one-dimensional */
+    std::string jvm_type(TypeDescriptor *type_descriptor) {
+        if (is_flat(type_descriptor))
+            return "[" + get_jvm_type_str(element_descriptor(type_descriptor));
+        if (type_descriptor->id_type == IDType::ARRAY)
+            return "[" + jvm_type(type_descriptor->base);
+        if (type_descriptor->id_type == IDType::SUBPROG) {
+            std::string s = "(";
+            for (TypeDescriptor *p = type_descriptor->base->next; p != nullptr; p = p->next)
+                s += jvm_type(p);
+            return s + ")" + jvm_type(type_descriptor->base);
+        }
+        return get_jvm_type_str(type_descriptor);
+    }
+
+    static TypeDescriptor* element_descriptor(TypeDescriptor *type_descriptor) {
+        while (type_descriptor->id_type == IDType::ARRAY)
+            type_descriptor = type_descriptor->base;
+        return type_descriptor;
+    }
+
+    static IDType element_type(TypeDescriptor *type_descriptor) {
+        return element_descriptor(type_descriptor)->id_type;
+    }
+
+    /* elements between consecutive indexes of this dimension */
+    static int32_t flat_stride(const TypeDescriptor *dimension) {
+        return (int32_t)element_count(dimension->base);
+    }
+
+    /* A subscript as a part computed at run time and a constant: i+1 is
+       (i, 1), 5 is (NIL_NODE, 5). The constants of all subscripts and the
+       lower bounds fold into one offset. */
+    NodeId split_subscript(NodeId expr, int32_t &constant) {
+        constant = 0;
+        if (ast.kind[expr] == NodeType::LITERAL_INT) {
+            constant = ast.metadata[expr].ival;
+            return NIL_NODE;
+        }
+        if (ast.kind[expr] == NodeType::OP && (ast.metadata[expr].oval == OpType::ADD || ast.metadata[expr].oval == OpType::SUB)) {
+            NodeId lhs = ast.child[expr][0];
+            NodeId rhs = ast.child[expr][1];
+            if (ast.kind[rhs] == NodeType::LITERAL_INT) {
+                constant = ast.metadata[expr].oval == OpType::ADD ? ast.metadata[rhs].ival : (int32_t)(0u - (uint32_t)ast.metadata[rhs].ival);
+                return lhs;
+            }
+            if (ast.kind[lhs] == NodeType::LITERAL_INT && ast.metadata[expr].oval == OpType::ADD) {
+                constant = ast.metadata[lhs].ival;
+                return rhs;
+            }
+        }
+        return expr;
+    }
+
+    /* schedules the run-time part of a flattened element index: each
+       subscript's non-constant part times the stride of its dimension,
+       summed; gen_flat_offset adds the rest */
+    void push_flat_index(NodeId var, TypeDescriptor *type_descriptor) {
+        size_t mark = expr_work.size();
+        bool first = true;
+        TypeDescriptor *dimension = type_descriptor;
+        for (NodeId tail = ast.child[var][0]; tail != NIL_NODE; tail = ast.next[tail], dimension = dimension->base) {
+            int32_t constant;
+            NodeId part = split_subscript(ast.child[tail][0], constant);
+            if (part == NIL_NODE)
+                continue;
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, part, nullptr});
+            expr_work.push_back(ExprFrame{first ? ExprTask::FLAT_SCALE : ExprTask::FLAT_SCALE_ADD, tail, dimension});
+            first = false;
+        }
+        std::reverse(expr_work.begin() + mark, expr_work.end());
+    }
+
+    /* the compile-time part of the index, (constant - lower bound) * stride
+       over all dimensions, in wrapping int arithmetic like the JVM's */
+    void gen_flat_offset(NodeId var) {
+        TypeDescriptor *dimension = sema.symbol(var).type_descriptor;
+        uint32_t offset = 0;
+        bool computed = false;
+        for (NodeId tail = ast.child[var][0]; tail != NIL_NODE; tail = ast.next[tail], dimension = dimension->base) {
+            int32_t constant;
+            computed |= split_subscript(ast.child[tail][0], constant) != NIL_NODE;
+            offset += ((uint32_t)constant - (uint32_t)dimension->lower_bound) * (uint32_t)flat_stride(dimension);
+        }
+        if (!computed || offset != 0)
+            buffer.top().emit(Opcode::LDC_INT, (int32_t)offset);
+        if (computed && offset != 0)
+            buffer.top().emit(Opcode::IADD);
+    }
+
+    /* times a stride: nothing for 1, a shift for other powers of two */
+    void gen_scale(int32_t stride) {
+        if (stride == 1)
+            return;
+        if ((stride & (stride - 1)) == 0) {
+            int shift = 0;
+            while ((1 << shift) != stride)
+                shift++;
+            buffer.top().emit(Opcode::LDC_INT, shift);
+            buffer.top().emit(Opcode::ISHL);
+        } else {
+            buffer.top().emit(Opcode::LDC_INT, stride);
+            buffer.top().emit(Opcode::IMUL);
+        }
+    }
+
+    /* an array allocation: flattened arrays as one dimension of all the
+       elements; extents go out in the shortest push that holds them */
+    void gen_new_array(Method &method, TypeDescriptor *type_descriptor) {
+        if (is_flat(type_descriptor)) {
+            gen_push(method, (int32_t)element_count(type_descriptor));
+            method.emit(Opcode::MULTIANEWARRAY, jvm_type(type_descriptor), 1);
+            return;
+        }
+        int arr_dim = 0;
+        for (TypeDescriptor *curr = type_descriptor; curr->id_type == IDType::ARRAY; curr = curr->base, arr_dim++)
+            gen_push(method, curr->upper_bound - curr->lower_bound + 1);
+        method.emit(Opcode::MULTIANEWARRAY, jvm_type(type_descriptor), arr_dim);
+    }
+
+    static void gen_push(Method &method, int32_t value) {
+        if (value >= -128 && value <= 127)
+            method.emit(Opcode::BIPUSH, value);
+        else if (value >= -32768 && value <= 32767)
+            method.emit(Opcode::SIPUSH, value);
+        else
+            method.emit(Opcode::LDC_INT, value);
+    }
+
+    bool gen_prog(NodeId root) {
+        assert(ast.kind[root] == NodeType::PROG);
+        // NodeId id_list_node = ast.child[root][0];
+        NodeId decl_list_node = ast.child[root][1];
+        NodeId subprog_decl_list_node = ast.child[root][2];
+        NodeId stmt_list_node = ast.child[root][3];
+
+        CompileStats::Clock::time_point start = stats.start();
+        double passes_before = stats.seconds[CompileStats::PEEPHOLE] + stats.seconds[CompileStats::SLOTS] +
+                               stats.seconds[CompileStats::FRAMES] + stats.seconds[CompileStats::WRITE];
+        if (flat_arrays)
+            find_nested_shapes();
+        jvm_class.name = basename;
+        jvm_class.super_name = "java/lang/Object";
+        vinit = Method{"public static", "vinit", "()V", {}, 0, 0};
+        if (buffered_io)
+            gen_io_init();
         gen_decl_list_prog(decl_list_node);
-        buffer.top() << '\n';
-        buffer.top() << ".method public static readlnI()I\n    .limit locals 10\n    .limit stack 10\n    ldc 0\n    istore 1\nLAB1:\n    getstatic java/lang/System/in Ljava/io/InputStream;\n    invokevirtual java/io/InputStream/read()I\n    istore 2\n    iload 2\n    ldc 10\n    isub\n    ifeq LAB2\n    iload 2\n    ldc 32\n    isub\n    ifeq LAB2\n    iload 2\n    ldc 48\n    isub\n    ldc 10\n    iload 1\n    imul\n    iadd\n    istore 1\n    goto LAB1\nLAB2:\n    iload 1\n    ireturn\n.end method\n\n";
-        buffer.top() << ".method public static vinit()V\n    .limit locals 100\n    .limit stack 100\n" << vinit.str() << "    return\n.end method\n\n";
-        buffer.top() << ".method public <init>()V\n    aload_0\n    invokenonvirtual java/lang/Object/<init>()V\n    return\n.end method\n\n";
+        vinit.emit(Opcode::RETURN);
+        if (emit_format == EmitFormat::CLASS)
+            class_writer.begin(jvm_class);
+        else
+            jasmin_writer.write_header(jvm_class);
 
-        gen_subprog_decl_list(subprog_decl_list_node);
-        for (auto &function : functions)
-            buffer.top() << function;
+        if (buffered_io)
+            gen_in_fill();
+        gen_readlnI();
+        write_method(vinit);
+
+        Method init{"public", "<init>", "()V", {}, 0, 0};
+        init.emit(Opcode::ALOAD, 0);
+        init.emit(Opcode::INVOKESPECIAL, "java/lang/Object/<init>()V");
+        init.emit(Opcode::RETURN);
+        write_method(init);
 
-        buffer.top() << ".method public static main([Ljava/lang/String;)V\n    .limit locals 100\n    .limit stack 100\n    invokestatic " + basename + "/vinit()V\n";
-        reg_map.emplace();
-        reg_used.push(0);
-        gen_stmt(stmt_list_node);
-        buffer.top() << "    return\n.end method\n";
+        gen_subprog_decl_list(subprog_decl_list_node);
 
-        out_file << buffer.top().str();
+        buffer.push(Method{"public static", "main", "([Ljava/lang/String;)V", {}, 0, 0});
+        if (buffered_io) {
+            /* the output is flushed on the way out, also when an exception
+               ends the program, which then goes on as if uncaught */
+            Handler handler{++label_used, ++label_used, ++label_used};
+            buffer.top().emit(Opcode::LABEL, handler.start);
+            buffer.top().emit(Opcode::INVOKESTATIC, basename + "/vinit()V");
+            next_slot = 1;
+            gen_stmt(stmt_list_node);
+            buffer.top().emit(Opcode::LABEL, handler.end);
+            buffer.top().emit(Opcode::GETSTATIC, basename + "/out$ Ljava/io/PrintStream;");
+            buffer.top().emit(Opcode::INVOKEVIRTUAL, "java/io/PrintStream/flush()V");
+            buffer.top().emit(Opcode::RETURN);
+            buffer.top().emit(Opcode::LABEL, handler.handler);
+            buffer.top().emit(Opcode::GETSTATIC, basename + "/out$ Ljava/io/PrintStream;");
+            buffer.top().emit(Opcode::INVOKEVIRTUAL, "java/io/PrintStream/flush()V");
+            buffer.top().emit(Opcode::ATHROW);
+            buffer.top().handlers.push_back(handler);
+        } else {
+            buffer.top().emit(Opcode::INVOKESTATIC, basename + "/vinit()V");
+            next_slot = 1;
+            gen_stmt(stmt_list_node);
+            buffer.top().emit(Opcode::RETURN);
+        }
+        write_method(buffer.top());
         buffer.pop();
-        symbol_table.close_scope();
-        reg_map.pop();
-        reg_used.pop();
+
+        CompileStats::Clock::time_point write_start = stats.start();
+        bool ok = emit_format == EmitFormat::CLASS ? class_writer.finish() : true;
+        ok = out.flush() && ok;
+        stats.stop(CompileStats::WRITE, write_start);
+
+        /* codegen is whatever gen_prog spent outside the per-method passes */
+        double passes_after = stats.seconds[CompileStats::PEEPHOLE] + stats.seconds[CompileStats::SLOTS] +
+                              stats.seconds[CompileStats::FRAMES] + stats.seconds[CompileStats::WRITE];
+        stats.stop(CompileStats::CODEGEN, start);
+        stats.seconds[CompileStats::CODEGEN] -= passes_after - passes_before;
+        stats.labels += label_used;
+        stats.bytes_written += sink.bytes_written;
+        return ok;
+    }
+
+    /* runs the per-method passes and appends the method to the output;
+       its instructions are released afterwards */
+    void write_method(Method &method) {
+        largest_method = std::max(largest_method, method.code.size());
+        stats.insns_generated += method.code.size();
+        if (opt_level >= 1) {
+            CompileStats::Clock::time_point start = stats.start();
+            peephole.run(method);
+            stats.stop(CompileStats::PEEPHOLE, start);
+            start = stats.start();
+            slot_allocator.run(method);
+            stats.stop(CompileStats::SLOTS, start);
+        }
+        CompileStats::Clock::time_point start = stats.start();
+        compute_frame_limits(method);
+        stats.stop(CompileStats::FRAMES, start);
+        start = stats.start();
+        if (emit_format == EmitFormat::CLASS)
+            class_writer.add_method(method);
+        else
+            jasmin_writer.write_method(method);
+        stats.stop(CompileStats::WRITE, start);
+        for (const Insn &insn : method.code)
+            stats.insns_written += insn.opcode != Opcode::LABEL;
+        std::vector<Insn>().swap(method.code);
+        stats.methods++;
+    }
+
+    /* Buffered I/O runs on fields of its own, named with a '$' so that no
+       Pascal identifier can clash: out$ is a PrintStream over a buffer on
+       the standard output, without autoflush, and in$buf holds the input
+       not yet consumed between in$pos and in$len. */
+    void gen_io_init() {
+        jvm_class.fields.push_back(Field{"public static", "out$", "Ljava/io/PrintStream;"});
+        jvm_class.fields.push_back(Field{"public static", "in$buf", "[B"});
+        jvm_class.fields.push_back(Field{"public static", "in$pos", "I"});
+        jvm_class.fields.push_back(Field{"public static", "in$len", "I"});
+        vinit.emit(Opcode::NEW, "java/io/PrintStream");
+        vinit.emit(Opcode::DUP);
+        vinit.emit(Opcode::NEW, "java/io/BufferedOutputStream");
+        vinit.emit(Opcode::DUP);
+        vinit.emit(Opcode::NEW, "java/io/FileOutputStream");
+        vinit.emit(Opcode::DUP);
+        vinit.emit(Opcode::GETSTATIC, "java/io/FileDescriptor/out Ljava/io/FileDescriptor;");
+        vinit.emit(Opcode::INVOKESPECIAL, "java/io/FileOutputStream/<init>(Ljava/io/FileDescriptor;)V");
+        vinit.emit(Opcode::LDC_INT, IO_BUFFER);
+        vinit.emit(Opcode::INVOKESPECIAL, "java/io/BufferedOutputStream/<init>(Ljava/io/OutputStream;I)V");
+        vinit.emit(Opcode::INVOKESPECIAL, "java/io/PrintStream/<init>(Ljava/io/OutputStream;)V");
+        vinit.emit(Opcode::PUTSTATIC, basename + "/out$ Ljava/io/PrintStream;");
+        vinit.emit(Opcode::LDC_INT, IO_BUFFER);
+        vinit.emit(Opcode::MULTIANEWARRAY, "[B", 1);
+        vinit.emit(Opcode::PUTSTATIC, basename + "/in$buf [B");
+    }
+
+    /* in$fill(): reads as much input as is available, up to the buffer
+       size; returns the count, -1 at the end of the input */
+    void gen_in_fill() {
+        Method method{"public static", "in$fill", "()I", {}, 0, 0};
+        method.emit(Opcode::GETSTATIC, "java/lang/System/in Ljava/io/InputStream;");
+        method.emit(Opcode::GETSTATIC, basename + "/in$buf [B");
+        method.emit(Opcode::ICONST_0);
+        method.emit(Opcode::LDC_INT, IO_BUFFER);
+        method.emit(Opcode::INVOKEVIRTUAL, "java/io/InputStream/read([BII)I");
+        method.emit(Opcode::DUP);
+        method.emit(Opcode::PUTSTATIC, basename + "/in$len I");
+        method.emit(Opcode::ICONST_0);
+        method.emit(Opcode::PUTSTATIC, basename + "/in$pos I");
+        method.emit(Opcode::IRETURN);
+        write_method(method);
+    }
+
+    /* pushes the next input byte, -1 at the end of the input */
+    void gen_read_byte(Method &method) {
+        if (!buffered_io) {
+            method.emit(Opcode::GETSTATIC, "java/lang/System/in Ljava/io/InputStream;");
+            method.emit(Opcode::INVOKEVIRTUAL, "java/io/InputStream/read()I");
+            return;
+        }
+        int have_label = ++label_used;
+        int done_label = ++label_used;
+        method.emit(Opcode::GETSTATIC, basename + "/in$pos I");
+        method.emit(Opcode::GETSTATIC, basename + "/in$len I");
+        method.emit(Opcode::IF_ICMPLT, have_label);
+        method.emit(Opcode::INVOKESTATIC, basename + "/in$fill()I");
+        method.emit(Opcode::IFGT, have_label);
+        method.emit(Opcode::ICONST_M1);
+        method.emit(Opcode::GOTO, done_label);
+        method.emit(Opcode::LABEL, have_label);
+        method.emit(Opcode::GETSTATIC, basename + "/in$buf [B");
+        method.emit(Opcode::GETSTATIC, basename + "/in$pos I");
+        method.emit(Opcode::DUP);
+        method.emit(Opcode::ICONST_1);
+        method.emit(Opcode::IADD);
+        method.emit(Opcode::PUTSTATIC, basename + "/in$pos I");
+        method.emit(Opcode::BALOAD);
+        method.emit(Opcode::LDC_INT, 255);
+        method.emit(Opcode::IAND);
+        method.emit(Opcode::LABEL, done_label);
+    }
+
+    /* readlnI(): parses one decimal integer, with an optional leading '-',
+       terminated by a space, a newline or the end of the input */
+    void gen_readlnI() {
+        Method method{"public static", "readlnI", "()I", {}, 0, 0};
+        int loop_label = ++label_used;
+        int end_label = ++label_used;
+        int return_label = ++label_used;
+        method.emit(Opcode::LDC_INT, 0);
+        method.emit(Opcode::ISTORE, 0);
+        method.emit(Opcode::LDC_INT, 0);
+        method.emit(Opcode::ISTORE, 2);
+        gen_read_byte(method);
+        method.emit(Opcode::ISTORE, 1);
+        method.emit(Opcode::ILOAD, 1);
+        method.emit(Opcode::LDC_INT, '-');
+        method.emit(Opcode::IF_ICMPNE, loop_label);
+        method.emit(Opcode::LDC_INT, 1);
+        method.emit(Opcode::ISTORE, 2);
+        gen_read_byte(method);
+        method.emit(Opcode::ISTORE, 1);
+        method.emit(Opcode::LABEL, loop_label);
+        method.emit(Opcode::ILOAD, 1);
+        method.emit(Opcode::LDC_INT, '\n');
+        method.emit(Opcode::IF_ICMPEQ, end_label);
+        method.emit(Opcode::ILOAD, 1);
+        method.emit(Opcode::LDC_INT, ' ');
+        method.emit(Opcode::IF_ICMPEQ, end_label);
+        method.emit(Opcode::ILOAD, 1);
+        method.emit(Opcode::IFLT, end_label);
+        method.emit(Opcode::ILOAD, 1);
+        method.emit(Opcode::LDC_INT, '0');
+        method.emit(Opcode::ISUB);
+        method.emit(Opcode::LDC_INT, 10);
+        method.emit(Opcode::ILOAD, 0);
+        method.emit(Opcode::IMUL);
+        method.emit(Opcode::IADD);
+        method.emit(Opcode::ISTORE, 0);
+        gen_read_byte(method);
+        method.emit(Opcode::ISTORE, 1);
+        method.emit(Opcode::GOTO, loop_label);
+        method.emit(Opcode::LABEL, end_label);
+        method.emit(Opcode::ILOAD, 0);
+        method.emit(Opcode::ILOAD, 2);
+        method.emit(Opcode::IFEQ, return_label);
+        method.emit(Opcode::INEG);
+        method.emit(Opcode::LABEL, return_label);
+        method.emit(Opcode::IRETURN);
+        write_method(method);
+    }
+
+    /* the stream writeln prints to */
+    void gen_out() {
+        if (buffered_io)
+            buffer.top().emit(Opcode::GETSTATIC, basename + "/out$ Ljava/io/PrintStream;");
+        else
+            buffer.top().emit(Opcode::GETSTATIC, "java/lang/System/out Ljava/io/PrintStream;");
     }
     
-    void gen_decl_list_prog(Node *root) {
-        if (root == nullptr) return;
-        assert(root->node_type == NodeType::DECL_LIST);
-        for (Node *decl_list_node = root; decl_list_node != nullptr; decl_list_node = decl_list_node->next) {
-            TypeDescriptor *type_descriptor = get_type_descriptor(decl_list_node->child[1]);
-            for (Node *id_list_node = decl_list_node->child[0]; id_list_node != nullptr; id_list_node = id_list_node->next) {
-                char *var_name = id_list_node->metadata.sval;
-                symbol_table.add(var_name, type_descriptor);
-                std::string jvm_type_str = get_jvm_type_str(type_descriptor);
-                buffer.top() << ".field public static " << var_name << " " << jvm_type_str << "\n";
-                if (type_descriptor->id_type == IDType::INT) 
-                    vinit << "    ldc 0\n    putstatic " << basename << "/" << var_name << " I\n";
-                else if (type_descriptor->id_type == IDType::REAL) 
-                    vinit << "    ldc 0.0\n    putstatic " << basename << "/" << var_name << " F\n";
-                else if (type_descriptor->id_type == IDType::STRING)
-                    vinit << "    ldc \"\"\n    putstatic " << basename << "/" << var_name << " Ljava/lang/String;\n";
-                else if (type_descriptor->id_type == IDType::ARRAY) {
-                    int arr_dim = 0;
-                    for (TypeDescriptor *curr = type_descriptor; curr->id_type == IDType::ARRAY; curr = curr->base, arr_dim++)
-                        vinit << "    bipush " << curr->upper_bound - curr->lower_bound + 1 << "\n";
-                    vinit << "    multianewarray " << jvm_type_str << " " << arr_dim << "\n";
-                    vinit << "    putstatic " << basename << "/" << var_name << " " << jvm_type_str << "\n";
+    void gen_decl_list_prog(NodeId root) {
+        if (root == NIL_NODE) return;
+        assert(ast.kind[root] == NodeType::DECL_LIST);
+        for (NodeId decl_list_node = root; decl_list_node != NIL_NODE; decl_list_node = ast.next[decl_list_node]) {
+            for (NodeId id_list_node = ast.child[decl_list_node][0]; id_list_node != NIL_NODE; id_list_node = ast.next[id_list_node]) {
+                char *var_name = ast.metadata[id_list_node].sval;
+                TypeDescriptor *type_descriptor = sema.symbol(id_list_node).type_descriptor;
+                std::string jvm_type_str = jvm_type(type_descriptor);
+                jvm_class.fields.push_back(Field{"public static", var_name, jvm_type_str});
+                if (type_descriptor->id_type == IDType::INT) {
+                    vinit.emit(Opcode::LDC_INT, 0);
+                    vinit.emit(Opcode::PUTSTATIC, basename + "/" + var_name + " I");
+                } else if (type_descriptor->id_type == IDType::REAL) {
+                    vinit.emit_float(0.0);
+                    vinit.emit(Opcode::PUTSTATIC, basename + "/" + var_name + " F");
+                } else if (type_descriptor->id_type == IDType::STRING) {
+                    vinit.emit(Opcode::LDC_STRING, "\"\"");
+                    vinit.emit(Opcode::PUTSTATIC, basename + "/" + var_name + " Ljava/lang/String;");
+                } else if (type_descriptor->id_type == IDType::ARRAY) {
+                    gen_new_array(vinit, type_descriptor);
+                    vinit.emit(Opcode::PUTSTATIC, basename + "/" + var_name + " " + jvm_type_str);
                 } else
                     assert(false);
             }
         }
     }
     
-    void gen_subprog_decl_list(Node *root) {
-        if (root == nullptr) return;
-        assert(root->node_type == NodeType::SUBPROG_DECL_LIST);
-        for (Node *subprog_decl_list_node = root; subprog_decl_list_node != nullptr; subprog_decl_list_node = subprog_decl_list_node->next) {
-            buffer.emplace();
-
-            reg_map.emplace();
-            reg_used.push(0);
-            return_symbol_reg.push(-1);
-
-            Node *subprog_head_node = subprog_decl_list_node->child[0];
-            Node *decl_list_node = subprog_decl_list_node->child[1];
-            Node *inner_subprog_decl_list_node = subprog_decl_list_node->child[2];
-            Node *stmt_list_node = subprog_decl_list_node->child[3];
+    void gen_subprog_decl_list(NodeId root) {
+        if (root == NIL_NODE) return;
+        assert(ast.kind[root] == NodeType::SUBPROG_DECL_LIST);
+        for (NodeId subprog_decl_list_node = root; subprog_decl_list_node != NIL_NODE; subprog_decl_list_node = ast.next[subprog_decl_list_node]) {
+            uint64_t key = 0;
+            int label_base = label_used;
+            size_t first_function = functions.size();
+            if (method_cache != nullptr && subprog_depth == 0) {
+                key = MethodCache::hash(subprog_key(subprog_decl_list_node));
+                int label_count;
+                if (method_cache->reuse(key, label_base, functions, label_count)) {
+                    label_used += label_count;
+                    write_functions();
+                    continue;
+                }
+            }
+            buffer.emplace(Method{});
+            subprog_depth++;
+
+            NodeId subprog_head_node = ast.child[subprog_decl_list_node][0];
+            NodeId decl_list_node = ast.child[subprog_decl_list_node][1];
+            NodeId inner_subprog_decl_list_node = ast.child[subprog_decl_list_node][2];
+            NodeId stmt_list_node = ast.child[subprog_decl_list_node][3];
+            std::vector<NodeId> sites;
+            if (opt_level >= 1)
+                sites = find_tail_calls(subprog_head_node, stmt_list_node);
+            int entry = sites.empty() ? 0 : ++label_used;
             gen_subprog_head(subprog_head_node);
+            /* before the locals are set up, so each iteration starts them afresh */
+            if (entry != 0)
+                buffer.top().emit(Opcode::LABEL, entry);
             gen_decl_list_subprog(decl_list_node);
             gen_subprog_decl_list(inner_subprog_decl_list_node);
+            tail_call_sites = std::move(sites);
+            entry_label = entry;
+            next_slot = first_free_slot(subprog_head_node, decl_list_node);
             gen_stmt(stmt_list_node);
+            if (!tail_call_sites.empty())
+                tail_calls.emplace_back(ast.metadata[subprog_head_node].sval, tail_call_sites.size());
+            tail_call_sites.clear();
 
-            SymbolTableResult symbol_table_result = symbol_table.get(subprog_head_node->metadata.sval);
-            if (symbol_table_result.type_descriptor->base->id_type == IDType::VOID) {
-                buffer.top() << "    return\n";
-            } else if (symbol_table_result.type_descriptor->base->id_type == IDType::INT) {
-                buffer.top() << "    iload " << return_symbol_reg.top() << "\n";
-                buffer.top() << "    ireturn\n";
-            } else if (symbol_table_result.type_descriptor->base->id_type == IDType::REAL) {
-                buffer.top() << "    fload " << return_symbol_reg.top() << "\n";
-                buffer.top() << "    freturn\n";
+            const Symbol &symbol = sema.symbol(subprog_head_node);
+            if (symbol.type_descriptor->base->id_type == IDType::VOID) {
+                buffer.top().emit(Opcode::RETURN);
+            } else if (symbol.type_descriptor->base->id_type == IDType::INT) {
+                buffer.top().emit(Opcode::ILOAD, symbol.slot);
+                buffer.top().emit(Opcode::IRETURN);
+            } else if (symbol.type_descriptor->base->id_type == IDType::REAL) {
+                buffer.top().emit(Opcode::FLOAD, symbol.slot);
+                buffer.top().emit(Opcode::FRETURN);
             } else {
-                buffer.top() << "    aload " << return_symbol_reg.top() << "\n";
-                buffer.top() << "    areturn\n";
+                buffer.top().emit(Opcode::ALOAD, symbol.slot);
+                buffer.top().emit(Opcode::ARETURN);
             }
-            buffer.top() << ".end method\n\n";
 
-            functions.push_back(buffer.top().str());
+            functions.push_back(std::move(buffer.top()));
             buffer.pop();
+            subprog_depth--;
+
+            if (method_cache != nullptr && subprog_depth == 0) {
+                method_cache->record(key, label_base, label_used - label_base, functions.data() + first_function, functions.data() + functions.size());
+                method_cache->rebuilt += functions.size() - first_function;
+            }
+            if (subprog_depth == 0)
+                write_functions();
+        }
+    }
+
+    /* a top-level subprogram is done: its methods and those of the
+       subprograms nested in it go out */
+    void write_functions() {
+        for (Method &function : functions)
+            write_method(function);
+        functions.clear();
+    }
 
-            reg_map.pop();
-            reg_used.pop();
-            return_symbol_reg.pop();
+    /* What the code generated for a top-level subprogram depends on: its own
+       subtree, and where each name it uses lives: the storage, slot and type
+       of the resolved symbol, and for calls the captured variables passed. */
+    std::string subprog_key(NodeId decl) {
+        std::string key = basename + '\0' + std::to_string(opt_level) + '\0';
+        if (!buffered_io)
+            key += std::string("unbuffered") + '\0';
+        if (flat_arrays) {
+            /* which shapes stay nested depends on the whole program */
+            std::vector<std::string> shapes(nested_shapes.begin(), nested_shapes.end());
+            std::sort(shapes.begin(), shapes.end());
+            key += "flat";
+            for (const std::string &shape : shapes)
+                key += '\0' + shape;
+            key += '\0';
+        }
+        std::vector<NodeId> pending{decl};
+        while (!pending.empty()) {
+            NodeId node = pending.back();
+            pending.pop_back();
+            if (node == NIL_NODE) {
+                key += '.';
+                continue;
+            }
+            key += (char)('A' + (int)ast.kind[node]);
+            const NodeData &data = ast.metadata[node];
+            switch (ast.kind[node]) {
+                case NodeType::ID_LIST:
+                case NodeType::SUBPROG_HEAD:
+                case NodeType::LITERAL_STR:
+                    key.append(data.sval).push_back('\0');
+                    break;
+                case NodeType::VAR:
+                case NodeType::PROCEDURE: {
+                    key.append(data.sval).push_back('\0');
+                    if (sema.symbol_of[node] != NO_SYMBOL) {
+                        const Symbol &symbol = sema.symbol(node);
+                        key += std::to_string((int)symbol.storage) + ':' + std::to_string(symbol.slot) + ':' + type_key(symbol.type_descriptor);
+                        if (symbol.storage == Storage::SUBPROG)
+                            for (const SymbolId *arg = sema.captures_begin(node); arg != sema.captures_end(node); arg++)
+                                key += ':' + std::to_string(sema.symbols[*arg].slot);
+                        /* what its loops may hoist depends on what callees write */
+                        if (symbol.storage == Storage::SUBPROG && opt_level >= 2)
+                            key += ':' + loop_optimizer.effects_key(sema.symbol_of[node]);
+                    }
+                    key += ';';
+                    break;
+                }
+                case NodeType::TYPE:
+                    key += std::to_string((int)data.tval);
+                    break;
+                case NodeType::OP:
+                    key += std::to_string((int)data.oval);
+                    break;
+                case NodeType::LITERAL_INT:
+                    key += std::to_string(data.ival);
+                    break;
+                case NodeType::LITERAL_DBL:
+                    key.append(reinterpret_cast<const char*>(&data.dval), sizeof(data.dval));
+                    break;
+                default:
+                    break;
+            }
+            key += ',';
+            if (node != decl)
+                pending.push_back(ast.next[node]);
+            for (int i = 3; i >= 0; i--)
+                pending.push_back(ast.child[node][i]);
+        }
+        return key;
+    }
 
-            symbol_table.close_scope();
-            symbol_table.close_scope();
+    /* unlike get_jvm_type_str, keeps array bounds */
+    static std::string type_key(TypeDescriptor *type_descriptor) {
+        switch (type_descriptor->id_type) {
+            case IDType::ARRAY:
+                return "[" + std::to_string(type_descriptor->lower_bound) + ":" + std::to_string(type_descriptor->upper_bound) + type_key(type_descriptor->base);
+            case IDType::SUBPROG: {
+                std::string s = "(";
+                for (TypeDescriptor *p = type_descriptor->base->next; p != nullptr; p = p->next)
+                    s += type_key(p);
+                return s + ")" + type_key(type_descriptor->base);
+            }
+            default:
+                return get_jvm_type_str(type_descriptor);
         }
     }
     
-    void gen_decl_list_subprog(Node *root) {
-        if (root == nullptr) return;
-        assert(root->node_type == NodeType::DECL_LIST);
-        for (Node *decl_list_node = root; decl_list_node != nullptr; decl_list_node = decl_list_node->next) {
-            TypeDescriptor *type_descriptor = get_type_descriptor(decl_list_node->child[1]);
-            for (Node *id_list_node = decl_list_node->child[0]; id_list_node != nullptr; id_list_node = id_list_node->next) {
-                char *var_name = id_list_node->metadata.sval;
-                SymbolTableResult symbol_table_result = symbol_table.add(var_name, type_descriptor);
-                reg_map.top()[symbol_table_result.timestamp] = reg_used.top();
-                std::string jvm_type_str = get_jvm_type_str(type_descriptor);
-                if (type_descriptor->id_type == IDType::INT) 
-                    buffer.top() << "    ldc 0\n    istore " << reg_used.top() << "\n";
-                else if (type_descriptor->id_type == IDType::REAL) 
-                    buffer.top() << "    ldc 0.0\n    fstore " << reg_used.top() << "\n";
-                else if (type_descriptor->id_type == IDType::ARRAY) {
-                    int arr_dim = 0;
-                    for (TypeDescriptor *curr = type_descriptor; curr->id_type == IDType::ARRAY; curr = curr->base, arr_dim++)
-                        buffer.top() << "    bipush " << curr->upper_bound - curr->lower_bound + 1 << "\n";
-                    buffer.top() << "    multianewarray " << jvm_type_str << " " << arr_dim << "\n";
-                    buffer.top() << "    astore " << reg_used.top() << "\n";
+    void gen_decl_list_subprog(NodeId root) {
+        if (root == NIL_NODE) return;
+        assert(ast.kind[root] == NodeType::DECL_LIST);
+        for (NodeId decl_list_node = root; decl_list_node != NIL_NODE; decl_list_node = ast.next[decl_list_node]) {
+            for (NodeId id_list_node = ast.child[decl_list_node][0]; id_list_node != NIL_NODE; id_list_node = ast.next[id_list_node]) {
+                const Symbol &symbol = sema.symbol(id_list_node);
+                TypeDescriptor *type_descriptor = symbol.type_descriptor;
+                if (type_descriptor->id_type == IDType::INT) {
+                    buffer.top().emit(Opcode::LDC_INT, 0);
+                    buffer.top().emit(Opcode::ISTORE, symbol.slot);
+                } else if (type_descriptor->id_type == IDType::REAL) {
+                    buffer.top().emit_float(0.0);
+                    buffer.top().emit(Opcode::FSTORE, symbol.slot);
+                } else if (type_descriptor->id_type == IDType::ARRAY) {
+                    gen_new_array(buffer.top(), type_descriptor);
+                    buffer.top().emit(Opcode::ASTORE, symbol.slot);
                 }
-                reg_used.top()++;
             }
         }
     }
     
-    void gen_subprog_head(Node *root) {
-        assert(root->node_type == NodeType::SUBPROG_HEAD);
-        auto *subprog_type_descriptor = new TypeDescriptor{IDType::SUBPROG, 0, 0, get_type_descriptor(root->child[1]), nullptr};
-        TypeDescriptor *subprog_type_descriptor_tail = subprog_type_descriptor->base;
-
-        std::vector<std::pair<std::string, TypeDescriptor*>> params_inherited;
-        for (int i = 1; i <= symbol_table.curr_scope; i++) {
-            for (const auto &result : symbol_table.symbol_table[i]) {
-                auto *dup_type_descriptor = new TypeDescriptor(*result.second.type_descriptor);
-                subprog_type_descriptor_tail = subprog_type_descriptor_tail->next = dup_type_descriptor;
-                params_inherited.emplace_back(result.first, dup_type_descriptor);
+    /* The statements that are a self-call whose result is the subprogram's
+       own: a procedure's call to itself, or a function's f := f(...), as the
+       last thing the body does. Empty statements after it do not count. Both branches of an IF in tail position are
+       in tail position; a WHILE body never is. */
+    std::vector<NodeId> find_tail_calls(NodeId head, NodeId stmt_list) {
+        SymbolId self = sema.symbol_of[head];
+        bool procedure = sema.symbol(head).type_descriptor->base->id_type == IDType::VOID;
+        std::vector<NodeId> sites;
+        std::vector<NodeId> pending{stmt_list};
+        while (!pending.empty()) {
+            NodeId node = pending.back();
+            pending.pop_back();
+            if (node == NIL_NODE)
+                continue;
+            if (ast.kind[node] == NodeType::STMT_LIST) {
+                /* the last statement that is not empty, as in "p(x); end" */
+                NodeId last = NIL_NODE;
+                for (; node != NIL_NODE; node = ast.next[node])
+                    if (ast.child[node][0] != NIL_NODE)
+                        last = ast.child[node][0];
+                pending.push_back(last);
+            } else if (ast.kind[node] == NodeType::IF) {
+                pending.push_back(ast.child[node][2]);
+                pending.push_back(ast.child[node][1]);
+            } else if (ast.kind[node] == NodeType::PROCEDURE) {
+                if (procedure && sema.symbol_of[node] == self)
+                    sites.push_back(node);
+            } else if (ast.kind[node] == NodeType::ASSIGN) {
+                NodeId value = ast.child[node][1];
+                if (!procedure && sema.symbol_of[ast.child[node][0]] == self &&
+                    (ast.kind[value] == NodeType::PROCEDURE || ast.kind[value] == NodeType::VAR) && sema.symbol_of[value] == self)
+                    sites.push_back(node);
             }
         }
+        std::sort(sites.begin(), sites.end());
+        return sites;
+    }
 
-        std::vector<std::pair<std::string, TypeDescriptor*>> params;
-        for (Node *param_list_node = root->child[0]; param_list_node != nullptr; param_list_node = param_list_node->next) {
-            TypeDescriptor *param_type_descriptor = get_type_descriptor(param_list_node->child[1]);
-            for (Node *id_list_node = param_list_node->child[0]; id_list_node != nullptr; id_list_node = id_list_node->next) {
-                auto *dup_param_type_descriptor = new TypeDescriptor(*param_type_descriptor);
-                subprog_type_descriptor_tail = subprog_type_descriptor_tail->next = dup_param_type_descriptor;
-                params.emplace_back(id_list_node->metadata.sval, dup_param_type_descriptor);
-            }
+    /* A tail self-call: the arguments are evaluated, become the parameters,
+       and the method starts over. An argument that is already in its
+       parameter's slot, like a captured variable passed on, is left alone. */
+    void gen_tail_call(NodeId call) {
+        std::vector<std::pair<int, IDType>> stores;
+        TypeDescriptor *param = sema.symbol(call).type_descriptor->base->next;
+        int slot = 0;
+        for (const SymbolId *arg = sema.captures_begin(call); arg != sema.captures_end(call); arg++, param = param->next, slot++) {
+            if (sema.symbols[*arg].storage == Storage::LOCAL && sema.symbols[*arg].slot == slot)
+                continue;
+            gen_var_load(sema.symbols[*arg]);
+            stores.emplace_back(slot, param->id_type);
         }
-
-        symbol_table.add(root->metadata.sval, subprog_type_descriptor);
-        buffer.top() << ".method public static " << root->metadata.sval << get_jvm_type_str(subprog_type_descriptor) << "\n";
-        buffer.top() << "    .limit locals 100\n    .limit stack 100\n";
-
-        symbol_table.open_scope();
-        for (auto &p : params_inherited) {
-            SymbolTableResult symbol_table_result = symbol_table.add(p.first, p.second);
-            reg_map.top()[symbol_table_result.timestamp] = reg_used.top();
-            reg_used.top()++;
+        for (NodeId curr = ast.child[call][0]; curr != NIL_NODE; curr = ast.next[curr], param = param->next, slot++) {
+            NodeId expr = ast.child[curr][0];
+            if (ast.kind[expr] == NodeType::VAR && ast.child[expr][0] == NIL_NODE && sema.symbol_of[expr] != NO_SYMBOL &&
+                sema.symbol(expr).storage == Storage::LOCAL && sema.symbol(expr).slot == slot)
+                continue;
+            gen_expr(expr);
+            stores.emplace_back(slot, param->id_type);
         }
-
-        symbol_table.open_scope();
-        for (auto &p : params) {
-            SymbolTableResult symbol_table_result = symbol_table.add(p.first, p.second);
-            reg_map.top()[symbol_table_result.timestamp] = reg_used.top();
-            reg_used.top()++;
+        for (auto store = stores.rbegin(); store != stores.rend(); ++store) {
+            if (store->second == IDType::INT)
+                buffer.top().emit(Opcode::ISTORE, store->first);
+            else if (store->second == IDType::REAL)
+                buffer.top().emit(Opcode::FSTORE, store->first);
+            else
+                buffer.top().emit(Opcode::ASTORE, store->first);
         }
-        
-        reg_map.top()[symbol_table.get(root->metadata.sval).timestamp] = reg_used.top();
-        return_symbol_reg.top() = reg_used.top();
-        reg_used.top()++;
+        buffer.top().emit(Opcode::GOTO, entry_label);
+    }
+
+    void gen_subprog_head(NodeId root) {
+        assert(ast.kind[root] == NodeType::SUBPROG_HEAD);
+        buffer.top().access = "public static";
+        buffer.top().name = ast.metadata[root].sval;
+        buffer.top().descriptor = jvm_type(sema.symbol(root).type_descriptor);
     }
     
-    void gen_stmt(Node *root) {
-        if (root == nullptr) return;
-        if (root->node_type == NodeType::STMT_LIST) {
-            for (Node *stmt_list_node = root; stmt_list_node != nullptr; stmt_list_node = stmt_list_node->next)
-                gen_stmt(stmt_list_node->child[0]);
-        } else if (root->node_type == NodeType::ASSIGN) {
-            Node *var_node = root->child[0];
-            char *var_name = var_node->metadata.sval;
-            Node *expr_node = root->child[1];
-            SymbolTableResult symbol_table_result = symbol_table.get(var_name);
-            bool is_return_var = (reg_map.top().count(symbol_table_result.timestamp) != 0 && reg_map.top()[symbol_table_result.timestamp] == return_symbol_reg.top());
-            bool is_global_var = symbol_table_result.scope == 0 && !is_return_var;
-            if (symbol_table_result.type_descriptor->id_type == IDType::ARRAY) {
-                if (is_global_var) 
-                    buffer.top() << "    getstatic " << basename << "/" << var_name << " " << get_jvm_type_str(symbol_table_result.type_descriptor) << "\n";
+    /* Statements use the same worklist scheme as gen_expr: nested IF/WHILE
+       bodies are pushed as frames, and the label bookkeeping that follows a
+       body is a frame of its own. */
+    void gen_stmt(NodeId root) {
+        std::vector<StmtFrame> work;
+        work.push_back(StmtFrame{StmtTask::EXEC, root, 0, 0});
+        while (!work.empty()) {
+            StmtFrame frame = work.back();
+            work.pop_back();
+            if (frame.task == StmtTask::EXEC) {
+                gen_stmt_exec(frame.node, work);
+            } else if (frame.task == StmtTask::IF_ELSE) {
+                buffer.top().emit(Opcode::GOTO, frame.label_2);
+                buffer.top().emit(Opcode::LABEL, frame.label_1);
+            } else if (frame.task == StmtTask::IF_END) {
+                buffer.top().emit(Opcode::LABEL, frame.label_2);
+            } else if (frame.task == StmtTask::WHILE_END) {
+                buffer.top().emit(Opcode::LABEL, frame.label_2);
+                gen_cond(ast.child[frame.node][0], true, frame.label_1);
+                if (opt_level >= 2) {
+                    for (const Symbol *symbol : loop_array_scopes.back())
+                        loop_arrays.erase(symbol);
+                    loop_array_scopes.pop_back();
+                }
+            }
+        }
+    }
+
+    void gen_stmt_exec(NodeId root, std::vector<StmtFrame> &work) {
+        if (root == NIL_NODE) return;
+        if (ast.kind[root] == NodeType::STMT_LIST) {
+            size_t mark = work.size();
+            for (NodeId stmt_list_node = root; stmt_list_node != NIL_NODE; stmt_list_node = ast.next[stmt_list_node])
+                work.push_back(StmtFrame{StmtTask::EXEC, ast.child[stmt_list_node][0], 0, 0});
+            std::reverse(work.begin() + mark, work.end());
+        } else if (!tail_call_sites.empty() && std::binary_search(tail_call_sites.begin(), tail_call_sites.end(), root)) {
+            gen_tail_call(ast.kind[root] == NodeType::ASSIGN ? ast.child[root][1] : root);
+        } else if (ast.kind[root] == NodeType::ASSIGN) {
+            NodeId var_node = ast.child[root][0];
+            NodeId expr_node = ast.child[root][1];
+            const Symbol &symbol = sema.symbol(var_node);
+            if (is_flat(symbol.type_descriptor)) {
+                gen_var_load(symbol);
+                size_t base = expr_work.size();
+                push_flat_index(var_node, symbol.type_descriptor);
+                run_expr_work(base);
+                gen_flat_offset(var_node);
+                gen_expr(expr_node);
+                IDType element = element_type(symbol.type_descriptor);
+                if (element == IDType::INT)
+                    buffer.top().emit(Opcode::IASTORE);
+                else if (element == IDType::REAL)
+                    buffer.top().emit(Opcode::FASTORE);
                 else
-                    buffer.top() << "    aload " << reg_map.top()[symbol_table_result.timestamp] << "\n";
-                Node *curr_var_tail = var_node->child[0];
-                TypeDescriptor *curr_type_descriptor = symbol_table_result.type_descriptor;
-                for (; curr_var_tail != nullptr; curr_var_tail = curr_var_tail->next, curr_type_descriptor = curr_type_descriptor->base) {
-                    gen_expr(curr_var_tail->child[0]);
-                    buffer.top() << "    ldc " << curr_type_descriptor->lower_bound << "\n";
-                    buffer.top() << "    isub\n";
-                    if (curr_var_tail->next != nullptr)
-                        buffer.top() << "    aaload\n";
+                    buffer.top().emit(Opcode::AASTORE);
+            } else if (symbol.type_descriptor->id_type == IDType::ARRAY) {
+                gen_var_load(symbol);
+                NodeId curr_var_tail = ast.child[var_node][0];
+                TypeDescriptor *curr_type_descriptor = symbol.type_descriptor;
+                for (; curr_var_tail != NIL_NODE; curr_var_tail = ast.next[curr_var_tail], curr_type_descriptor = curr_type_descriptor->base) {
+                    if (loop_subscripts.count(curr_var_tail) == 0)
+                        gen_expr(ast.child[curr_var_tail][0]);
+                    gen_subscript_index(curr_var_tail, curr_type_descriptor);
+                    if (ast.next[curr_var_tail] != NIL_NODE)
+                        buffer.top().emit(Opcode::AALOAD);
                 }
                 gen_expr(expr_node);
                 if (curr_type_descriptor->id_type == IDType::INT) 
-                    buffer.top() << "    iastore\n";
+                    buffer.top().emit(Opcode::IASTORE);
                 else if (curr_type_descriptor->id_type == IDType::REAL) 
-                    buffer.top() << "    fastore\n";
+                    buffer.top().emit(Opcode::FASTORE);
                 else
-                    buffer.top() << "    aastore\n";
-            } else if (is_global_var) {
+                    buffer.top().emit(Opcode::AASTORE);
+            } else if (symbol.storage == Storage::GLOBAL) {
                 gen_expr(expr_node);
-                buffer.top() << "    putstatic " << basename << "/" << var_name << " " << get_jvm_type_str(symbol_table_result.type_descriptor) << "\n";
-            } else if (is_return_var) {
-                gen_expr(expr_node);
-                if (symbol_table_result.type_descriptor->base->id_type == IDType::INT) 
-                    buffer.top() << "    istore " << return_symbol_reg.top() << "\n";
-                else if (symbol_table_result.type_descriptor->base->id_type == IDType::REAL)
-                    buffer.top() << "    fstore " << return_symbol_reg.top() << "\n";
-                else
-                    buffer.top() << "    astore " << return_symbol_reg.top() << "\n";
+                buffer.top().emit(Opcode::PUTSTATIC, basename + "/" + symbol.name + " " + jvm_type(symbol.type_descriptor));
             } else {
+                /* a local, or the return value of the function being generated */
+                IDType type = sema.type(var_node);
                 gen_expr(expr_node);
-                if (symbol_table_result.type_descriptor->id_type == IDType::INT) 
-                    buffer.top() << "    istore " << reg_map.top()[symbol_table_result.timestamp] << "\n";
-                else if (symbol_table_result.type_descriptor->id_type == IDType::REAL) 
-                    buffer.top() << "    fstore " << reg_map.top()[symbol_table_result.timestamp] << "\n";
+                if (type == IDType::INT) 
+                    buffer.top().emit(Opcode::ISTORE, symbol.slot);
+                else if (type == IDType::REAL) 
+                    buffer.top().emit(Opcode::FSTORE, symbol.slot);
                 else
-                    buffer.top() << "    astore " << reg_map.top()[symbol_table_result.timestamp] << "\n";
+                    buffer.top().emit(Opcode::ASTORE, symbol.slot);
+            }
+            if (!counter_steps.empty()) {
+                auto steps = counter_steps.find(root);
+                if (steps != counter_steps.end()) {
+                    for (const auto &step : steps->second) {
+                        buffer.top().emit(Opcode::ILOAD, step.first);
+                        buffer.top().emit(Opcode::LDC_INT, (int32_t)step.second);
+                        buffer.top().emit(Opcode::IADD);
+                        buffer.top().emit(Opcode::ISTORE, step.first);
+                    }
+                }
             }
-        } else if (root->node_type == NodeType::IF) {
-            Node *expr_node = root->child[0];
-            Node *stmt_1_node = root->child[1];
-            Node *stmt_2_node = root->child[2];
-            gen_expr(expr_node);
+        } else if (ast.kind[root] == NodeType::IF) {
+            NodeId expr_node = ast.child[root][0];
+            NodeId stmt_1_node = ast.child[root][1];
+            NodeId stmt_2_node = ast.child[root][2];
             int false_label = ++label_used;
             int end_label = ++label_used;
-            buffer.top() << "    ifeq L" << false_label << "\n";
-            gen_stmt(stmt_1_node);
-            buffer.top() << "    goto L" << end_label << "\n";
-            buffer.top() << "L" << false_label << ":\n";
-            gen_stmt(stmt_2_node);
-            buffer.top() << "L" << end_label << ":\n";
-        } else if (root->node_type == NodeType::WHILE) {
-            Node *expr_node = root->child[0];
-            Node *stmt_node = root->child[1];
+            gen_cond(expr_node, false, false_label);
+            if (stmt_2_node == NIL_NODE) {
+                /* empty ELSE: the false branch jumps straight past the THEN part */
+                work.push_back(StmtFrame{StmtTask::IF_END, root, 0, false_label});
+            } else {
+                work.push_back(StmtFrame{StmtTask::IF_END, root, false_label, end_label});
+                work.push_back(StmtFrame{StmtTask::EXEC, stmt_2_node, 0, 0});
+                work.push_back(StmtFrame{StmtTask::IF_ELSE, root, false_label, end_label});
+            }
+            work.push_back(StmtFrame{StmtTask::EXEC, stmt_1_node, 0, 0});
+        } else if (ast.kind[root] == NodeType::WHILE) {
+            /* rotated loop: the test sits at the bottom, so each iteration
+               runs one conditional branch and no goto */
+            NodeId stmt_node = ast.child[root][1];
+            int body_label = ++label_used;
             int test_label = ++label_used;
-            int end_label = ++label_used;
-            buffer.top() << "L" << test_label << ":\n";
-            gen_expr(expr_node);
-            buffer.top() << "    ifeq L" << end_label << "\n";
-            gen_stmt(stmt_node);
-            buffer.top() << "    goto L" << test_label << "\n";
-            buffer.top() << "L" << end_label << ":\n";
-        } else if (root->node_type == NodeType::PROCEDURE) {
-            if (strcmp(root->metadata.sval, "writelnI") == 0) {
-                buffer.top() << "    getstatic java/lang/System/out Ljava/io/PrintStream;\n";
-                gen_expr(root->child[0]->child[0]);
-                buffer.top() << "    invokevirtual java/io/PrintStream/println(I)V\n";
-            } else if (strcmp(root->metadata.sval, "writelnR") == 0) {
-                buffer.top() << "    getstatic java/lang/System/out Ljava/io/PrintStream;\n";
-                gen_expr(root->child[0]->child[0]);
-                buffer.top() << "    invokevirtual java/io/PrintStream/println(F)V\n";
-            } else if (strcmp(root->metadata.sval, "writelnS") == 0) {
-                buffer.top() << "    getstatic java/lang/System/out Ljava/io/PrintStream;\n";
-                gen_expr(root->child[0]->child[0]);
-                buffer.top() << "    invokevirtual java/io/PrintStream/println(Ljava/lang/String;)V\n";
+            if (opt_level >= 2)
+                gen_loop_preheader(root);
+            buffer.top().emit(Opcode::GOTO, test_label);
+            buffer.top().emit(Opcode::LABEL, body_label);
+            work.push_back(StmtFrame{StmtTask::WHILE_END, root, body_label, test_label});
+            work.push_back(StmtFrame{StmtTask::EXEC, stmt_node, 0, 0});
+        } else if (ast.kind[root] == NodeType::PROCEDURE) {
+            if (strcmp(ast.metadata[root].sval, "writelnI") == 0) {
+                gen_out();
+                gen_expr(ast.child[ast.child[root][0]][0]);
+                buffer.top().emit(Opcode::INVOKEVIRTUAL, "java/io/PrintStream/println(I)V");
+            } else if (strcmp(ast.metadata[root].sval, "writelnR") == 0) {
+                gen_out();
+                gen_expr(ast.child[ast.child[root][0]][0]);
+                buffer.top().emit(Opcode::INVOKEVIRTUAL, "java/io/PrintStream/println(F)V");
+            } else if (strcmp(ast.metadata[root].sval, "writelnS") == 0) {
+                gen_out();
+                gen_expr(ast.child[ast.child[root][0]][0]);
+                buffer.top().emit(Opcode::INVOKEVIRTUAL, "java/io/PrintStream/println(Ljava/lang/String;)V");
             } else {
-                SymbolTableResult symbol_table_result = symbol_table.get(root->metadata.sval);
-                if (symbol_table_result.scope != 0)
-                    gen_additional_vars();
-                for (Node *expr_list_node = root->child[0]; expr_list_node != nullptr; expr_list_node = expr_list_node->next)
-                    gen_expr(expr_list_node->child[0]);
-                buffer.top() << "    invokestatic " << basename << "/" << root->metadata.sval << get_jvm_type_str(symbol_table_result.type_descriptor) << "\n";
+                gen_captured_vars(root);
+                for (NodeId expr_list_node = ast.child[root][0]; expr_list_node != NIL_NODE; expr_list_node = ast.next[expr_list_node])
+                    gen_expr(ast.child[expr_list_node][0]);
+                buffer.top().emit(Opcode::INVOKESTATIC, basename + "/" + ast.metadata[root].sval + jvm_type(sema.symbol(root).type_descriptor));
             }
         } else {
             assert(false);
         }
     }
 
-    void gen_additional_vars() {
-        for (int i = 1; i <= symbol_table.curr_scope; i++) {
-            for (const auto &result : symbol_table.symbol_table[i]) {
-                if (result.second.type_descriptor->id_type == IDType::INT ||
-                    result.second.type_descriptor->id_type == IDType::REAL ||
-                    result.second.type_descriptor->id_type == IDType::STRING ||
-                    result.second.type_descriptor->id_type == IDType::ARRAY) {
-                    Node *var_node = new Node{NodeType::VAR, {}, {}, {}};
-                    var_node->metadata.sval = strdup(result.first.c_str());
-                    gen_expr(var_node);
+    /* the locals after the parameters, the return value and the declared
+       variables of a subprogram */
+    int first_free_slot(NodeId head, NodeId decl_list) {
+        int slot = sema.symbol(head).slot;
+        for (NodeId decl = decl_list; decl != NIL_NODE; decl = ast.next[decl])
+            for (NodeId id = ast.child[decl][0]; id != NIL_NODE; id = ast.next[id])
+                slot = std::max(slot, sema.symbol(id).slot);
+        return slot + 1;
+    }
+
+    /* Computes, ahead of the loop, what its plan hoists, and registers the
+       locals holding it. Whatever an enclosing loop has hoisted already is
+       left to that loop. Equal invariants, and equal derived values, share
+       a local. */
+    void gen_loop_preheader(NodeId loop) {
+        LoopOptimizer::Plan plan = loop_optimizer.plan(loop);
+        loop_array_scopes.emplace_back();
+        for (SymbolId id : plan.arrays) {
+            const Symbol *symbol = &sema.symbols[id];
+            if (loop_arrays.count(symbol) != 0 || next_slot >= LOOP_LOCALS)
+                continue;
+            gen_var_load(*symbol);
+            buffer.top().emit(Opcode::ASTORE, next_slot);
+            loop_arrays.emplace(symbol, next_slot++);
+            loop_array_scopes.back().push_back(symbol);
+            loop_optimizer.hoisted++;
+        }
+        std::unordered_map<std::string, std::pair<int, IDType>> same;
+        for (NodeId node : plan.invariants) {
+            if (loop_values.count(node) != 0)
+                continue;
+            std::string key = loop_optimizer.expr_key(node);
+            auto found = same.find(key);
+            if (found == same.end()) {
+                if (next_slot >= LOOP_LOCALS)
+                    continue;
+                IDType type = sema.type(node);
+                gen_expr(node);
+                gen_local_store(type, next_slot);
+                found = same.emplace(key, std::make_pair(next_slot++, type)).first;
+            }
+            loop_values.emplace(node, found->second);
+            loop_optimizer.hoisted++;
+        }
+        std::map<std::tuple<SymbolId, uint32_t, uint32_t>, int> derived_slots;
+        for (const LoopOptimizer::Derived &derived : plan.derived) {
+            if (loop_values.count(derived.node) != 0 || loop_subscripts.count(derived.node) != 0)
+                continue;
+            auto key = std::make_tuple(derived.counter, derived.scale, derived.offset);
+            auto found = derived_slots.find(key);
+            int slot;
+            if (found != derived_slots.end()) {
+                slot = found->second;
+            } else if (next_slot >= LOOP_LOCALS) {
+                continue;
+            } else {
+                slot = next_slot++;
+                gen_var_load(sema.symbols[derived.counter]);
+                if (derived.scale != 1) {
+                    buffer.top().emit(Opcode::LDC_INT, (int32_t)derived.scale);
+                    buffer.top().emit(Opcode::IMUL);
+                }
+                if (derived.offset != 0) {
+                    buffer.top().emit(Opcode::LDC_INT, (int32_t)derived.offset);
+                    buffer.top().emit(Opcode::IADD);
                 }
+                buffer.top().emit(Opcode::ISTORE, slot);
+                derived_slots.emplace(key, slot);
+                counter_steps[derived.increment].emplace_back(slot, derived.step);
             }
+            if (derived.var == NIL_NODE)
+                loop_values.emplace(derived.node, std::make_pair(slot, IDType::INT));
+            else
+                loop_subscripts.emplace(derived.node, slot);
+            loop_optimizer.reduced++;
         }
     }
+
+    /* pushes the enclosing-scope variables the callee captures, ahead of its own arguments */
+    void gen_captured_vars(NodeId call) {
+        for (const SymbolId *arg = sema.captures_begin(call); arg != sema.captures_end(call); arg++)
+            gen_var_load(sema.symbols[*arg]);
+    }
 };
 
 #endif
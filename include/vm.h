@@ -0,0 +1,430 @@
+#ifndef VM_H
+#define VM_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+#include "ast.h"
+#include "runtime_shared.h"
+
+/* One register: the slot's type is known statically, so no tag is kept.
+   A null string is the JVM's null; arrays are VmArray. */
+union Value {
+    int32_t i;
+    float f;
+    const char *s;
+    struct VmArray *a;
+};
+
+struct VmArray {
+    int32_t length;
+    int32_t padding;
+
+    Value* elements() { return reinterpret_cast<Value*>(this + 1); }
+};
+
+/* Register-based bytecode for --run. Registers are numbered per call
+   frame: the subprogram's JVM slots first (captured variables, parameters,
+   return value, locals), then the temporaries of one statement. Comments
+   give the operands; r[x] is a register, pc is an index into the code. */
+enum class VmOp : int32_t {
+    MOV,        /* r[a] = r[b] */
+    LOADK,      /* r[a] = constants[b] */
+    GLOAD,      /* r[a] = globals[b] */
+    GSTORE,     /* globals[a] = r[b] */
+    IADD, ISUB, IMUL, IDIV, ISHL, IAND, IOR,    /* r[a] = r[b] op r[c], wrapping */
+    INOT,       /* r[a] = r[b] ^ 1 */
+    INEG,
+    ILT, IGT, IEQ, ILE, IGE, INE,               /* r[a] = r[b] op r[c] ? 1 : 0 */
+    IADDK,                                      /* r[a] = r[b] + c */
+    ILTK, IGTK, IEQK, ILEK, IGEK, INEK,         /* r[a] = r[b] op c ? 1 : 0 */
+    FADD, FSUB, FMUL, FDIV,
+    FNEG,
+    FLT, FGT, FEQ, FLE, FGE, FNE,
+    CONCAT,     /* r[a] = r[b] + ... + r[b + c - 1] */
+    NEWARRAY,   /* r[a] = new array_types[b] */
+    ALOAD,      /* r[a] = r[b][r[c] - d] */
+    ASTORE,     /* r[a][r[b] - d] = r[c] */
+    JMP,        /* pc = a */
+    JZ, JNZ,    /* if r[a] is 0 (not 0): pc = b */
+    JLT, JGT, JEQ, JLE, JGE, JNE,               /* if r[a] op r[b]: pc = c */
+    JLTK, JGTK, JEQK, JLEK, JGEK, JNEK,         /* if r[a] op b: pc = c */
+    CALL,       /* functions[b] with its arguments in r[a]...; the result goes to r[a] */
+    RET,        /* returns r[a] */
+    READI,      /* r[a] = readlnI */
+    WRITEI, WRITER, WRITES,                     /* writeln r[a] */
+    HALT,
+    OP_COUNT
+};
+
+struct VmInsn {
+    VmOp op;
+    int32_t a, b, c, d;
+};
+
+struct VmFunction {
+    std::string name;
+    int entry;
+    int params;     /* captured variables and parameters, passed in r[0]... */
+    int slots;      /* params, the return value and the locals: zeroed by the call */
+    int regs;       /* slots and temporaries */
+};
+
+/* what the lowering produces; the last function is the program body */
+struct VmProgram {
+    std::vector<VmInsn> code;
+    std::vector<Value> constants;
+    std::deque<std::string> strings;
+    std::vector<const TypeDescriptor*> array_types;
+    std::vector<VmFunction> functions;
+    int globals = 0;
+};
+
+/* Runs a lowered program in-process. Dispatch is threaded through a table
+   of label addresses (computed goto) where the compiler supports it, a
+   switch elsewhere. The semantics are the JVM's, like the C runtime:
+   integer arithmetic wraps, a failed division, index or allocation stops
+   the program with the JVM's exception text, and reals print like
+   Float.toString. Strings and arrays live until the program ends. */
+struct Vm {
+    /* about 128 MB of registers, then StackOverflowError */
+    static const size_t MAX_STACK = size_t(1) << 24;
+
+    struct CallFrame {
+        const VmInsn *return_pc;
+        size_t base;
+        int function;
+    };
+
+    const VmProgram &program;
+    std::vector<Value> globals;
+    std::vector<Value> stack;
+    std::vector<CallFrame> calls;
+    std::vector<void*> heap;
+    std::string failure;
+
+    /* --profile: per function */
+    std::vector<size_t> insns;
+    std::vector<size_t> call_counts;
+    std::vector<double> self_seconds;
+
+    Vm(const VmProgram &program) : program(program) {}
+
+    ~Vm() {
+        for (void *block : heap)
+            free(block);
+    }
+
+    void* allocate(size_t size) {
+        void *block = calloc(1, size);
+        if (block == NULL) {
+            fprintf(stderr, "[ERROR] vm: out of memory\n");
+            exit(1);
+        }
+        heap.push_back(block);
+        return block;
+    }
+
+    VmArray* new_array(const TypeDescriptor *type_descriptor) {
+        int32_t length = type_descriptor->upper_bound - type_descriptor->lower_bound + 1;
+        if (length < 0) {
+            failure = "java.lang.NegativeArraySizeException: " + std::to_string(length);
+            return nullptr;
+        }
+        VmArray *array = (VmArray*)allocate(sizeof(VmArray) + (size_t)length * sizeof(Value));
+        array->length = length;
+        for (int32_t i = 0; type_descriptor->base->id_type == IDType::ARRAY && i < length; i++)
+            if ((array->elements()[i].a = new_array(type_descriptor->base)) == nullptr)
+                return nullptr;
+        return array;
+    }
+
+    const char* concat(const Value *pieces, int count) {
+        size_t length = 0;
+        for (int i = 0; i < count; i++)
+            length += strlen(pieces[i].s != nullptr ? pieces[i].s : "null");
+        char *s = (char*)allocate(length + 1);
+        char *end = s;
+        for (int i = 0; i < count; i++) {
+            const char *piece = pieces[i].s != nullptr ? pieces[i].s : "null";
+            size_t n = strlen(piece);
+            memcpy(end, piece, n);
+            end += n;
+        }
+        return s;
+    }
+
+    /* makes room for a frame of regs registers at base; false on overflow */
+    bool reserve(size_t base, int regs) {
+        size_t need = base + (size_t)regs;
+        if (need <= stack.size())
+            return true;
+        if (need > MAX_STACK)
+            return false;
+        size_t size = std::max(need, 2 * stack.size());
+        stack.resize(size < MAX_STACK ? size : MAX_STACK);
+        return true;
+    }
+
+    /* runs the program body; 0, or 1 after an uncaught exception */
+    int run(bool profile) {
+        globals.assign(program.globals, Value{});
+        stack.assign(1024, Value{});
+        size_t count = program.functions.size();
+        insns.assign(count, 0);
+        call_counts.assign(count, 0);
+        self_seconds.assign(count, 0.0);
+        call_counts[count - 1] = 1;
+        int status = profile ? execute<true>() : execute<false>();
+        fflush(stdout);
+        if (status != 0)
+            fprintf(stderr, "Exception in thread \"main\" %s\n", failure.c_str());
+        return status;
+    }
+
+    template <bool PROFILE>
+    int execute() {
+        typedef std::chrono::steady_clock Clock;
+        const VmInsn *code = program.code.data();
+        const Value *constants = program.constants.data();
+        Value *g = globals.data();
+        int function = (int)program.functions.size() - 1;
+        size_t base = 0;
+        if (!reserve(0, program.functions[function].regs)) {
+            failure = "java.lang.StackOverflowError";
+            return 1;
+        }
+        Value *r = stack.data();
+        const VmInsn *pc = code + program.functions[function].entry;
+        Clock::time_point since = PROFILE ? Clock::now() : Clock::time_point();
+        int status = 1;
+
+#if defined(__GNUC__)
+        static const void *handlers[] = {
+            &&op_MOV, &&op_LOADK, &&op_GLOAD, &&op_GSTORE,
+            &&op_IADD, &&op_ISUB, &&op_IMUL, &&op_IDIV, &&op_ISHL, &&op_IAND, &&op_IOR, &&op_INOT, &&op_INEG,
+            &&op_ILT, &&op_IGT, &&op_IEQ, &&op_ILE, &&op_IGE, &&op_INE,
+            &&op_IADDK, &&op_ILTK, &&op_IGTK, &&op_IEQK, &&op_ILEK, &&op_IGEK, &&op_INEK,
+            &&op_FADD, &&op_FSUB, &&op_FMUL, &&op_FDIV, &&op_FNEG,
+            &&op_FLT, &&op_FGT, &&op_FEQ, &&op_FLE, &&op_FGE, &&op_FNE,
+            &&op_CONCAT, &&op_NEWARRAY, &&op_ALOAD, &&op_ASTORE,
+            &&op_JMP, &&op_JZ, &&op_JNZ, &&op_JLT, &&op_JGT, &&op_JEQ, &&op_JLE, &&op_JGE, &&op_JNE,
+            &&op_JLTK, &&op_JGTK, &&op_JEQK, &&op_JLEK, &&op_JGEK, &&op_JNEK,
+            &&op_CALL, &&op_RET, &&op_READI, &&op_WRITEI, &&op_WRITER, &&op_WRITES, &&op_HALT
+        };
+        static_assert(sizeof(handlers) / sizeof(handlers[0]) == (size_t)VmOp::OP_COUNT, "one handler per opcode");
+#define VM_CASE(op) op_##op:
+#define VM_DISPATCH() { if (PROFILE) insns[function]++; goto *handlers[(int)pc->op]; }
+#else
+#define VM_CASE(op) case VmOp::op:
+#define VM_DISPATCH() { continue; }
+#endif
+#define VM_NEXT() { pc++; VM_DISPATCH(); }
+#define VM_JUMP(target) { pc = code + (target); VM_DISPATCH(); }
+#define VM_INT_OP(op, expr) VM_CASE(op) r[pc->a].i = (int32_t)(expr); VM_NEXT();
+#define VM_FLOAT_OP(op, expr) VM_CASE(op) r[pc->a].f = (expr); VM_NEXT();
+#define VM_BRANCH(op, cmp) VM_CASE(op) if (r[pc->a].i cmp r[pc->b].i) VM_JUMP(pc->c); VM_NEXT();
+#define VM_BRANCH_K(op, cmp) VM_CASE(op) if (r[pc->a].i cmp pc->b) VM_JUMP(pc->c); VM_NEXT();
+
+#if defined(__GNUC__)
+        VM_DISPATCH();
+        {
+#else
+        for (;;) {
+            if (PROFILE)
+                insns[function]++;
+            switch (pc->op) {
+#endif
+            VM_CASE(MOV) r[pc->a] = r[pc->b]; VM_NEXT();
+            VM_CASE(LOADK) r[pc->a] = constants[pc->b]; VM_NEXT();
+            VM_CASE(GLOAD) r[pc->a] = g[pc->b]; VM_NEXT();
+            VM_CASE(GSTORE) g[pc->a] = r[pc->b]; VM_NEXT();
+
+            VM_INT_OP(IADD, (uint32_t)r[pc->b].i + (uint32_t)r[pc->c].i)
+            VM_INT_OP(ISUB, (uint32_t)r[pc->b].i - (uint32_t)r[pc->c].i)
+            VM_INT_OP(IMUL, (uint32_t)r[pc->b].i * (uint32_t)r[pc->c].i)
+            VM_CASE(IDIV) {
+                int32_t divisor = r[pc->c].i;
+                if (divisor == 0) {
+                    failure = "java.lang.ArithmeticException: / by zero";
+                    goto done;
+                }
+                r[pc->a].i = divisor == -1 ? (int32_t)(0u - (uint32_t)r[pc->b].i) : r[pc->b].i / divisor;
+                VM_NEXT();
+            }
+            VM_INT_OP(ISHL, (uint32_t)r[pc->b].i << (r[pc->c].i & 31))
+            VM_INT_OP(IAND, r[pc->b].i & r[pc->c].i)
+            VM_INT_OP(IOR, r[pc->b].i | r[pc->c].i)
+            VM_INT_OP(INOT, r[pc->b].i ^ 1)
+            VM_INT_OP(INEG, 0u - (uint32_t)r[pc->b].i)
+            VM_INT_OP(ILT, r[pc->b].i < r[pc->c].i)
+            VM_INT_OP(IGT, r[pc->b].i > r[pc->c].i)
+            VM_INT_OP(IEQ, r[pc->b].i == r[pc->c].i)
+            VM_INT_OP(ILE, r[pc->b].i <= r[pc->c].i)
+            VM_INT_OP(IGE, r[pc->b].i >= r[pc->c].i)
+            VM_INT_OP(INE, r[pc->b].i != r[pc->c].i)
+            VM_INT_OP(IADDK, (uint32_t)r[pc->b].i + (uint32_t)pc->c)
+            VM_INT_OP(ILTK, r[pc->b].i < pc->c)
+            VM_INT_OP(IGTK, r[pc->b].i > pc->c)
+            VM_INT_OP(IEQK, r[pc->b].i == pc->c)
+            VM_INT_OP(ILEK, r[pc->b].i <= pc->c)
+            VM_INT_OP(IGEK, r[pc->b].i >= pc->c)
+            VM_INT_OP(INEK, r[pc->b].i != pc->c)
+
+            VM_FLOAT_OP(FADD, r[pc->b].f + r[pc->c].f)
+            VM_FLOAT_OP(FSUB, r[pc->b].f - r[pc->c].f)
+            VM_FLOAT_OP(FMUL, r[pc->b].f * r[pc->c].f)
+            VM_FLOAT_OP(FDIV, r[pc->b].f / r[pc->c].f)
+            VM_FLOAT_OP(FNEG, -r[pc->b].f)
+            VM_INT_OP(FLT, r[pc->b].f < r[pc->c].f)
+            VM_INT_OP(FGT, r[pc->b].f > r[pc->c].f)
+            VM_INT_OP(FEQ, r[pc->b].f == r[pc->c].f)
+            VM_INT_OP(FLE, r[pc->b].f <= r[pc->c].f)
+            VM_INT_OP(FGE, r[pc->b].f >= r[pc->c].f)
+            VM_INT_OP(FNE, r[pc->b].f != r[pc->c].f)
+
+            VM_CASE(CONCAT) r[pc->a].s = concat(r + pc->b, pc->c); VM_NEXT();
+            VM_CASE(NEWARRAY) {
+                if ((r[pc->a].a = new_array(program.array_types[pc->b])) == nullptr)
+                    goto done;
+                VM_NEXT();
+            }
+            VM_CASE(ALOAD) {
+                VmArray *array = r[pc->b].a;
+                uint32_t index = (uint32_t)r[pc->c].i - (uint32_t)pc->d;
+                if (index >= (uint32_t)array->length) {
+                    index_failure(index, array->length);
+                    goto done;
+                }
+                r[pc->a] = array->elements()[index];
+                VM_NEXT();
+            }
+            VM_CASE(ASTORE) {
+                VmArray *array = r[pc->a].a;
+                uint32_t index = (uint32_t)r[pc->b].i - (uint32_t)pc->d;
+                if (index >= (uint32_t)array->length) {
+                    index_failure(index, array->length);
+                    goto done;
+                }
+                array->elements()[index] = r[pc->c];
+                VM_NEXT();
+            }
+
+            VM_CASE(JMP) VM_JUMP(pc->a);
+            VM_CASE(JZ) if (r[pc->a].i == 0) VM_JUMP(pc->b); VM_NEXT();
+            VM_CASE(JNZ) if (r[pc->a].i != 0) VM_JUMP(pc->b); VM_NEXT();
+            VM_BRANCH(JLT, <)
+            VM_BRANCH(JGT, >)
+            VM_BRANCH(JEQ, ==)
+            VM_BRANCH(JLE, <=)
+            VM_BRANCH(JGE, >=)
+            VM_BRANCH(JNE, !=)
+            VM_BRANCH_K(JLTK, <)
+            VM_BRANCH_K(JGTK, >)
+            VM_BRANCH_K(JEQK, ==)
+            VM_BRANCH_K(JLEK, <=)
+            VM_BRANCH_K(JGEK, >=)
+            VM_BRANCH_K(JNEK, !=)
+
+            /* the callee's frame starts at its first argument, so arguments are not copied */
+            VM_CASE(CALL) {
+                const VmFunction &callee = program.functions[pc->b];
+                size_t callee_base = base + (size_t)pc->a;
+                if (!reserve(callee_base, callee.regs)) {
+                    failure = "java.lang.StackOverflowError";
+                    goto done;
+                }
+                calls.push_back(CallFrame{pc + 1, base, function});
+                if (PROFILE) {
+                    Clock::time_point now = Clock::now();
+                    self_seconds[function] += std::chrono::duration<double>(now - since).count();
+                    since = now;
+                    call_counts[pc->b]++;
+                }
+                function = pc->b;
+                base = callee_base;
+                r = stack.data() + base;
+                std::fill(r + callee.params, r + callee.slots, Value{});
+                VM_JUMP(callee.entry);
+            }
+            VM_CASE(RET) {
+                Value result = r[pc->a];
+                CallFrame frame = calls.back();
+                calls.pop_back();
+                if (PROFILE) {
+                    Clock::time_point now = Clock::now();
+                    self_seconds[function] += std::chrono::duration<double>(now - since).count();
+                    since = now;
+                }
+                r = stack.data() + frame.base;
+                r[base - frame.base] = result;
+                base = frame.base;
+                function = frame.function;
+                VM_JUMP(frame.return_pc - code);
+            }
+
+            VM_CASE(READI) r[pc->a].i = mp_readlnI(); VM_NEXT();
+            VM_CASE(WRITEI) printf("%d\n", (int)r[pc->a].i); VM_NEXT();
+            VM_CASE(WRITER) {
+                char text[48];
+                mp_format_float(r[pc->a].f, text);
+                puts(text);
+                VM_NEXT();
+            }
+            VM_CASE(WRITES) puts(r[pc->a].s != nullptr ? r[pc->a].s : "null"); VM_NEXT();
+            VM_CASE(HALT) {
+                status = 0;
+                goto done;
+            }
+#if !defined(__GNUC__)
+            default:
+                goto done;
+            }
+#endif
+        }
+    done:
+        if (PROFILE)
+            self_seconds[function] += std::chrono::duration<double>(Clock::now() - since).count();
+#undef VM_CASE
+#undef VM_DISPATCH
+#undef VM_NEXT
+#undef VM_JUMP
+#undef VM_INT_OP
+#undef VM_FLOAT_OP
+#undef VM_BRANCH
+#undef VM_BRANCH_K
+        return status;
+    }
+
+    void index_failure(uint32_t index, int32_t length) {
+        failure = "java.lang.ArrayIndexOutOfBoundsException: Index " + std::to_string((int32_t)index) +
+                  " out of bounds for length " + std::to_string(length);
+    }
+
+    /* --profile: one line per function that ran, busiest first */
+    void print_profile(FILE *out) const {
+        std::vector<size_t> order;
+        size_t total_insns = 0;
+        double total_seconds = 0;
+        for (size_t i = 0; i < program.functions.size(); i++) {
+            total_insns += insns[i];
+            total_seconds += self_seconds[i];
+            if (call_counts[i] != 0)
+                order.push_back(i);
+        }
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return insns[a] > insns[b]; });
+        fprintf(out, "[INFO ] profile: %zu instructions in %.3f ms\n", total_insns, total_seconds * 1e3);
+        fprintf(out, "[INFO ]   %-20s %12s %14s %12s %6s\n", "subprogram", "calls", "instructions", "self ms", "time");
+        for (size_t i : order)
+            fprintf(out, "[INFO ]   %-20s %12zu %14zu %12.3f %5.1f%%\n", program.functions[i].name.c_str(), call_counts[i], insns[i],
+                    self_seconds[i] * 1e3, total_seconds > 0 ? 100.0 * self_seconds[i] / total_seconds : 0.0);
+    }
+};
+
+#endif
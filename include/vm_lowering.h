@@ -0,0 +1,523 @@
+#ifndef VM_LOWERING_H
+#define VM_LOWERING_H
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "ast.h"
+#include "class_writer.h"
+#include "compile_stats.h"
+#include "semantic.h"
+#include "vm.h"
+
+/* Lowers the checked program to VM bytecode for --run, from the same
+   resolved symbols and types as the other back ends. Subprograms are
+   lifted the same way and keep their JVM slot numbers as registers, so a
+   captured variable arrives as a leading argument. Each operation writes a
+   temporary allocated stack-wise above the slots: an operator's result
+   takes the register of its first operand's temporaries, and arguments
+   and concatenation pieces are built in consecutive registers. Locals are
+   read in place; globals and array elements are loaded into temporaries,
+   in the order the JVM evaluates them. */
+struct VmLowering {
+    enum class ExprTask { EVAL, OP, NOT, NEGATE, CALL, SUBSCRIPT, SHORT_CIRCUIT, JOIN, CONCAT, ARG, ARG_END };
+    enum class StmtTask { EXEC, JUMP, LABEL, LOOP_TEST };
+
+    struct ExprFrame {
+        ExprTask task;
+        NodeId node;
+        TypeDescriptor *type_descriptor;
+        int mark;
+        int value;
+    };
+
+    struct StmtFrame {
+        StmtTask task;
+        NodeId node;
+        int label;
+        int target;
+    };
+
+    Ast &ast;
+    const SemanticAnalysis &sema;
+    CompileStats &stats;
+    VmProgram program;
+    std::vector<int> global_index;
+
+    /* the function being lowered */
+    int slots = 0;
+    int top = 0;
+    int regs = 0;
+    size_t function_start = 0;
+    int last_value = -1;
+    std::vector<int> label_pos;
+
+    std::vector<ExprFrame> expr_work;
+    std::vector<int> values;
+
+    VmLowering(Ast &ast, const SemanticAnalysis &sema, CompileStats &stats) : ast(ast), sema(sema), stats(stats) {}
+
+    int emit(VmOp op, int a = 0, int b = 0, int c = 0, int d = 0) {
+        program.code.push_back(VmInsn{op, a, b, c, d});
+        return (int)program.code.size() - 1;
+    }
+
+    /* an instruction whose only effect is writing r[dest]: a store may retarget it */
+    void emit_value(VmOp op, int dest, int b = 0, int c = 0, int d = 0) {
+        last_value = emit(op, dest, b, c, d);
+    }
+
+    bool just_computed(int reg) const {
+        return reg >= slots && last_value == (int)program.code.size() - 1 && program.code.back().a == reg;
+    }
+
+    int alloc() {
+        int reg = top++;
+        regs = std::max(regs, top);
+        return reg;
+    }
+
+    int new_label() {
+        label_pos.push_back(-1);
+        return (int)label_pos.size() - 1;
+    }
+
+    void place(int label) {
+        label_pos[label] = (int)program.code.size();
+        last_value = -1;
+    }
+
+    int constant(Value value) {
+        program.constants.push_back(value);
+        return (int)program.constants.size() - 1;
+    }
+
+    int int_constant(int32_t i) {
+        Value value{};
+        value.i = i;
+        return constant(value);
+    }
+
+    int float_constant(float f) {
+        Value value{};
+        value.f = f;
+        return constant(value);
+    }
+
+    int string_constant(std::string s) {
+        program.strings.push_back(std::move(s));
+        Value value{};
+        value.s = program.strings.back().c_str();
+        return constant(value);
+    }
+
+    int array_type(const TypeDescriptor *type_descriptor) {
+        program.array_types.push_back(type_descriptor);
+        return (int)program.array_types.size() - 1;
+    }
+
+    int pop_value() {
+        int value = values.back();
+        values.pop_back();
+        return value;
+    }
+
+    void lower(NodeId root) {
+        assert(ast.kind[root] == NodeType::PROG);
+        global_index.assign(sema.symbols.size(), -1);
+        for (NodeId decl_list = ast.child[root][1]; decl_list != NIL_NODE; decl_list = ast.next[decl_list])
+            for (NodeId id = ast.child[decl_list][0]; id != NIL_NODE; id = ast.next[id])
+                global_index[sema.symbol_of[id]] = program.globals++;
+
+        for (const FreeVarAnalysis::Subprog &subprog : sema.free_vars.subprogs)
+            lower_subprog(subprog.decl);
+
+        /* the body, after initializing the globals like vinit: "" and allocated arrays */
+        begin_function(0);
+        for (NodeId decl_list = ast.child[root][1]; decl_list != NIL_NODE; decl_list = ast.next[decl_list]) {
+            for (NodeId id = ast.child[decl_list][0]; id != NIL_NODE; id = ast.next[id]) {
+                const TypeDescriptor *type_descriptor = sema.symbol(id).type_descriptor;
+                top = slots;
+                if (type_descriptor->id_type == IDType::STRING) {
+                    int temp = alloc();
+                    emit(VmOp::LOADK, temp, string_constant(""));
+                    emit(VmOp::GSTORE, global_index[sema.symbol_of[id]], temp);
+                } else if (type_descriptor->id_type == IDType::ARRAY) {
+                    int temp = alloc();
+                    emit(VmOp::NEWARRAY, temp, array_type(type_descriptor));
+                    emit(VmOp::GSTORE, global_index[sema.symbol_of[id]], temp);
+                }
+            }
+        }
+        gen_stmt(ast.child[root][3]);
+        emit(VmOp::HALT);
+        end_function(ast.metadata[root].sval, 0);
+        stats.insns_generated += program.code.size();
+    }
+
+    void begin_function(int function_slots) {
+        slots = top = regs = function_slots;
+        function_start = program.code.size();
+        last_value = -1;
+        label_pos.clear();
+    }
+
+    /* resolves the function's labels to code indexes */
+    void end_function(const char *name, int params) {
+        for (size_t i = function_start; i < program.code.size(); i++) {
+            VmInsn &insn = program.code[i];
+            if (insn.op == VmOp::JMP)
+                insn.a = label_pos[insn.a];
+            else if (insn.op == VmOp::JZ || insn.op == VmOp::JNZ)
+                insn.b = label_pos[insn.b];
+            else if (insn.op >= VmOp::JLT && insn.op <= VmOp::JNEK)
+                insn.c = label_pos[insn.c];
+        }
+        stats.labels += label_pos.size();
+        stats.methods++;
+        program.functions.push_back(VmFunction{name, (int)function_start, params, slots, regs});
+    }
+
+    void lower_subprog(NodeId decl) {
+        NodeId head = ast.child[decl][0];
+        const Symbol &symbol = sema.symbol(head);
+        int function_slots = symbol.slot + 1;
+        for (NodeId decl_list = ast.child[decl][1]; decl_list != NIL_NODE; decl_list = ast.next[decl_list])
+            for (NodeId id = ast.child[decl_list][0]; id != NIL_NODE; id = ast.next[id])
+                function_slots = std::max(function_slots, sema.symbol(id).slot + 1);
+        begin_function(function_slots);
+        for (NodeId decl_list = ast.child[decl][1]; decl_list != NIL_NODE; decl_list = ast.next[decl_list]) {
+            for (NodeId id = ast.child[decl_list][0]; id != NIL_NODE; id = ast.next[id]) {
+                const Symbol &local = sema.symbol(id);
+                if (local.type_descriptor->id_type == IDType::ARRAY)
+                    emit(VmOp::NEWARRAY, local.slot, array_type(local.type_descriptor));
+            }
+        }
+        gen_stmt(ast.child[decl][3]);
+        emit(VmOp::RET, symbol.slot);
+        end_function(symbol.name, symbol.slot);
+    }
+
+    /* Lowers one expression and returns the register that holds its value,
+       with an explicit worklist like the other back ends. */
+    int gen_expr(NodeId root) {
+        size_t base = expr_work.size();
+        expr_work.push_back(ExprFrame{ExprTask::EVAL, root, nullptr, 0, 0});
+        while (expr_work.size() > base) {
+            ExprFrame frame = expr_work.back();
+            expr_work.pop_back();
+            NodeId node = frame.node;
+            if (frame.task == ExprTask::EVAL) {
+                gen_expr_eval(node);
+            } else if (frame.task == ExprTask::OP) {
+                gen_expr_op(node, frame.mark);
+            } else if (frame.task == ExprTask::NOT || frame.task == ExprTask::NEGATE) {
+                int operand = pop_value();
+                top = frame.mark;
+                int dest = alloc();
+                VmOp op = frame.task == ExprTask::NOT ? VmOp::INOT : sema.type(node) == IDType::INT ? VmOp::INEG : VmOp::FNEG;
+                emit_value(op, dest, operand);
+                values.push_back(dest);
+            } else if (frame.task == ExprTask::SUBSCRIPT) {
+                int index = pop_value();
+                int array = pop_value();
+                top = frame.mark;
+                int dest = alloc();
+                emit_value(VmOp::ALOAD, dest, array, index, frame.type_descriptor->lower_bound);
+                values.push_back(dest);
+            } else if (frame.task == ExprTask::SHORT_CIRCUIT) {
+                /* a AND b is false / a OR b is true without evaluating b */
+                int operand = pop_value();
+                top = frame.mark;
+                int dest = alloc();
+                if (operand != dest)
+                    emit(VmOp::MOV, dest, operand);
+                int label = new_label();
+                emit(ast.metadata[node].oval == OpType::AND ? VmOp::JZ : VmOp::JNZ, dest, label);
+                expr_work.push_back(ExprFrame{ExprTask::JOIN, node, nullptr, dest, label});
+                expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[node][1], nullptr, 0, 0});
+            } else if (frame.task == ExprTask::JOIN) {
+                int operand = pop_value();
+                if (operand != frame.mark)
+                    emit(VmOp::MOV, frame.mark, operand);
+                top = frame.mark + 1;
+                place(frame.value);
+                values.push_back(frame.mark);
+            } else if (frame.task == ExprTask::ARG) {
+                int reg = alloc();
+                expr_work.push_back(ExprFrame{ExprTask::ARG_END, node, nullptr, reg, 0});
+                expr_work.push_back(ExprFrame{ExprTask::EVAL, node, nullptr, 0, 0});
+            } else if (frame.task == ExprTask::ARG_END) {
+                int operand = pop_value();
+                if (operand != frame.mark)
+                    emit(VmOp::MOV, frame.mark, operand);
+                top = frame.mark + 1;
+            } else if (frame.task == ExprTask::CONCAT) {
+                top = frame.mark;
+                int dest = alloc();
+                emit_value(VmOp::CONCAT, dest, frame.mark, frame.value);
+                values.push_back(dest);
+            } else if (frame.task == ExprTask::CALL) {
+                top = frame.mark;
+                int dest = alloc();
+                emit(VmOp::CALL, dest, sema.symbol(node).subprog);
+                values.push_back(dest);
+            }
+        }
+        return pop_value();
+    }
+
+    void gen_expr_eval(NodeId root) {
+        NodeType kind = ast.kind[root];
+        int mark = top;
+        if (kind == NodeType::LITERAL_INT) {
+            int dest = alloc();
+            emit_value(VmOp::LOADK, dest, int_constant(ast.metadata[root].ival));
+            values.push_back(dest);
+        } else if (kind == NodeType::LITERAL_DBL) {
+            int dest = alloc();
+            emit_value(VmOp::LOADK, dest, float_constant((float)ast.metadata[root].dval));
+            values.push_back(dest);
+        } else if (kind == NodeType::LITERAL_STR) {
+            int dest = alloc();
+            emit_value(VmOp::LOADK, dest, string_constant(ClassWriter::unquote(ast.metadata[root].sval)));
+            values.push_back(dest);
+        } else if (kind == NodeType::OP && (ast.metadata[root].oval == OpType::AND || ast.metadata[root].oval == OpType::OR) && is_boolean(ast, root)) {
+            expr_work.push_back(ExprFrame{ExprTask::SHORT_CIRCUIT, root, nullptr, mark, 0});
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[root][0], nullptr, 0, 0});
+        } else if (kind == NodeType::OP && ast.metadata[root].oval == OpType::ADD && sema.type(root) == IDType::STRING) {
+            gen_concat(root);
+        } else if (kind == NodeType::OP) {
+            expr_work.push_back(ExprFrame{ExprTask::OP, root, nullptr, mark, 0});
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[root][1], nullptr, 0, 0});
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[root][0], nullptr, 0, 0});
+        } else if (kind == NodeType::VAR && strcmp(ast.metadata[root].sval, "readlnI") == 0) {
+            int dest = alloc();
+            emit_value(VmOp::READI, dest);
+            values.push_back(dest);
+        } else if (kind == NodeType::PROCEDURE || (kind == NodeType::VAR && sema.symbol(root).storage == Storage::SUBPROG)) {
+            gen_call(root);
+        } else if (kind == NodeType::VAR) {
+            /* a local is read in place: no call can change it */
+            const Symbol &symbol = sema.symbol(root);
+            if (symbol.storage == Storage::GLOBAL) {
+                int dest = alloc();
+                emit_value(VmOp::GLOAD, dest, global_index[sema.symbol_of[root]]);
+                values.push_back(dest);
+            } else {
+                values.push_back(symbol.slot);
+            }
+            size_t first = expr_work.size();
+            TypeDescriptor *type_descriptor = symbol.type_descriptor;
+            for (NodeId tail = ast.child[root][0]; tail != NIL_NODE; tail = ast.next[tail], type_descriptor = type_descriptor->base) {
+                expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[tail][0], nullptr, 0, 0});
+                expr_work.push_back(ExprFrame{ExprTask::SUBSCRIPT, tail, type_descriptor, mark, 0});
+            }
+            std::reverse(expr_work.begin() + first, expr_work.end());
+        } else if (kind == NodeType::NOT || kind == NodeType::NEGATE) {
+            expr_work.push_back(ExprFrame{kind == NodeType::NOT ? ExprTask::NOT : ExprTask::NEGATE, root, nullptr, mark, 0});
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, ast.child[root][0], nullptr, 0, 0});
+        } else {
+            assert(false);
+        }
+    }
+
+    /* an integer constant on the right of +, - or a comparison becomes an immediate */
+    void gen_expr_op(NodeId root, int mark) {
+        int rhs = pop_value();
+        int lhs = pop_value();
+        VmOp op = op_code(root);
+        bool immediate_form = op == VmOp::IADD || op == VmOp::ISUB || (op >= VmOp::ILT && op <= VmOp::INE);
+        top = mark;
+        int dest = alloc();
+        if (immediate_form && just_computed(rhs) && program.code.back().op == VmOp::LOADK && ast.kind[ast.child[root][1]] == NodeType::LITERAL_INT) {
+            int32_t k = program.constants[program.code.back().b].i;
+            program.code.pop_back();
+            if (op == VmOp::IADD || op == VmOp::ISUB)
+                emit_value(VmOp::IADDK, dest, lhs, op == VmOp::IADD ? k : (int32_t)(0u - (uint32_t)k));
+            else
+                emit_value((VmOp)((int)VmOp::ILTK + ((int)op - (int)VmOp::ILT)), dest, lhs, k);
+        } else {
+            emit_value(op, dest, lhs, rhs);
+        }
+        values.push_back(dest);
+    }
+
+    VmOp op_code(NodeId root) const {
+        static const VmOp int_ops[] = {VmOp::IAND, VmOp::IOR, VmOp::ILT, VmOp::IGT, VmOp::IEQ, VmOp::ILE, VmOp::IGE,
+                                       VmOp::INE, VmOp::IADD, VmOp::ISUB, VmOp::IMUL, VmOp::IDIV, VmOp::ISHL};
+        static const VmOp float_ops[] = {VmOp::HALT, VmOp::HALT, VmOp::FLT, VmOp::FGT, VmOp::FEQ, VmOp::FLE, VmOp::FGE,
+                                         VmOp::FNE, VmOp::FADD, VmOp::FSUB, VmOp::FMUL, VmOp::FDIV, VmOp::HALT};
+        int op = (int)ast.metadata[root].oval;
+        return sema.type(ast.child[root][1]) == IDType::REAL ? float_ops[op] : int_ops[op];
+    }
+
+    /* the pieces of a string a + b + ... in consecutive registers, joined once */
+    void gen_concat(NodeId root) {
+        std::vector<NodeId> pieces;
+        std::vector<NodeId> pending{root};
+        while (!pending.empty()) {
+            NodeId node = pending.back();
+            pending.pop_back();
+            if (ast.kind[node] == NodeType::OP && ast.metadata[node].oval == OpType::ADD && sema.type(node) == IDType::STRING) {
+                pending.push_back(ast.child[node][1]);
+                pending.push_back(ast.child[node][0]);
+            } else if (!(ast.kind[node] == NodeType::LITERAL_STR && strcmp(ast.metadata[node].sval, "\"\"") == 0)) {
+                pieces.push_back(node);
+            }
+        }
+        if (pieces.empty()) {
+            int dest = alloc();
+            emit_value(VmOp::LOADK, dest, string_constant(""));
+            values.push_back(dest);
+            return;
+        }
+        if (pieces.size() == 1) {
+            expr_work.push_back(ExprFrame{ExprTask::EVAL, pieces[0], nullptr, 0, 0});
+            return;
+        }
+        expr_work.push_back(ExprFrame{ExprTask::CONCAT, root, nullptr, top, (int)pieces.size()});
+        for (size_t i = pieces.size(); i-- > 0;)
+            expr_work.push_back(ExprFrame{ExprTask::ARG, pieces[i], nullptr, 0, 0});
+    }
+
+    /* captured variables, then the arguments, in the registers the callee's frame starts at */
+    void gen_call(NodeId root) {
+        int mark = top;
+        for (const SymbolId *arg = sema.captures_begin(root); arg != sema.captures_end(root); arg++)
+            emit(VmOp::MOV, alloc(), sema.symbols[*arg].slot);
+        size_t first = expr_work.size();
+        for (NodeId expr_list = ast.child[root][0]; expr_list != NIL_NODE; expr_list = ast.next[expr_list])
+            expr_work.push_back(ExprFrame{ExprTask::ARG, ast.child[expr_list][0], nullptr, 0, 0});
+        std::reverse(expr_work.begin() + first, expr_work.end());
+        expr_work.insert(expr_work.begin() + first, ExprFrame{ExprTask::CALL, root, nullptr, mark, 0});
+    }
+
+    /* jumps to label when the condition is true (false); an integer
+       comparison computed just for the jump is fused into it */
+    void gen_branch(NodeId cond, bool when, int label) {
+        int reg = gen_expr(cond);
+        VmOp op = just_computed(reg) ? program.code.back().op : VmOp::MOV;
+        bool immediate = op >= VmOp::ILTK && op <= VmOp::INEK;
+        if ((op >= VmOp::ILT && op <= VmOp::INE) || immediate) {
+            /* relations in VmOp order: <, >, =, <=, >=, != and the negation of each */
+            static const int negated[] = {4, 3, 5, 1, 0, 2};
+            int relation = (int)op - (int)(immediate ? VmOp::ILTK : VmOp::ILT);
+            if (!when)
+                relation = negated[relation];
+            VmInsn &insn = program.code.back();
+            insn = VmInsn{(VmOp)((int)(immediate ? VmOp::JLTK : VmOp::JLT) + relation), insn.b, insn.c, label, 0};
+            last_value = -1;
+            return;
+        }
+        emit(when ? VmOp::JNZ : VmOp::JZ, reg, label);
+    }
+
+    void gen_stmt(NodeId root) {
+        std::vector<StmtFrame> work{StmtFrame{StmtTask::EXEC, root, 0, 0}};
+        while (!work.empty()) {
+            StmtFrame frame = work.back();
+            work.pop_back();
+            top = slots;
+            if (frame.task == StmtTask::JUMP) {
+                emit(VmOp::JMP, frame.label);
+            } else if (frame.task == StmtTask::LABEL) {
+                place(frame.label);
+            } else if (frame.task == StmtTask::LOOP_TEST) {
+                place(frame.target);
+                gen_branch(ast.child[frame.node][0], true, frame.label);
+            } else {
+                gen_stmt_exec(frame.node, work);
+            }
+        }
+    }
+
+    void gen_stmt_exec(NodeId root, std::vector<StmtFrame> &work) {
+        if (root == NIL_NODE)
+            return;
+        NodeType kind = ast.kind[root];
+        if (kind == NodeType::STMT_LIST) {
+            size_t first = work.size();
+            for (NodeId stmt_list = root; stmt_list != NIL_NODE; stmt_list = ast.next[stmt_list])
+                work.push_back(StmtFrame{StmtTask::EXEC, ast.child[stmt_list][0], 0, 0});
+            std::reverse(work.begin() + first, work.end());
+        } else if (kind == NodeType::ASSIGN) {
+            gen_assign(root);
+        } else if (kind == NodeType::IF) {
+            int else_label = new_label();
+            gen_branch(ast.child[root][0], false, else_label);
+            if (ast.child[root][2] != NIL_NODE) {
+                int end_label = new_label();
+                work.push_back(StmtFrame{StmtTask::LABEL, root, end_label, 0});
+                work.push_back(StmtFrame{StmtTask::EXEC, ast.child[root][2], 0, 0});
+                work.push_back(StmtFrame{StmtTask::LABEL, root, else_label, 0});
+                work.push_back(StmtFrame{StmtTask::JUMP, root, end_label, 0});
+            } else {
+                work.push_back(StmtFrame{StmtTask::LABEL, root, else_label, 0});
+            }
+            work.push_back(StmtFrame{StmtTask::EXEC, ast.child[root][1], 0, 0});
+        } else if (kind == NodeType::WHILE) {
+            /* the test at the bottom, entered once from the top */
+            int body_label = new_label();
+            int test_label = new_label();
+            emit(VmOp::JMP, test_label);
+            place(body_label);
+            work.push_back(StmtFrame{StmtTask::LOOP_TEST, root, body_label, test_label});
+            work.push_back(StmtFrame{StmtTask::EXEC, ast.child[root][1], 0, 0});
+        } else if (kind == NodeType::PROCEDURE) {
+            const char *name = ast.metadata[root].sval;
+            VmOp op = strcmp(name, "writelnI") == 0 ? VmOp::WRITEI :
+                      strcmp(name, "writelnR") == 0 ? VmOp::WRITER :
+                      strcmp(name, "writelnS") == 0 ? VmOp::WRITES : VmOp::CALL;
+            if (op == VmOp::CALL)
+                gen_expr(root);
+            else
+                emit(op, gen_expr(ast.child[ast.child[root][0]][0]));
+        } else {
+            assert(false);
+        }
+    }
+
+    /* the value goes straight to a local when its last instruction can write it there */
+    void store_local(int slot, int value) {
+        if (just_computed(value))
+            program.code.back().a = slot;
+        else if (value != slot)
+            emit(VmOp::MOV, slot, value);
+        last_value = -1;
+    }
+
+    /* same order as the JVM: the array and its leading indexes, the value,
+       then the last index is checked by the store itself */
+    void gen_assign(NodeId root) {
+        NodeId var = ast.child[root][0];
+        const Symbol &symbol = sema.symbol(var);
+        if (symbol.storage == Storage::SUBPROG || (symbol.storage == Storage::LOCAL && ast.child[var][0] == NIL_NODE)) {
+            store_local(symbol.slot, gen_expr(ast.child[root][1]));
+            return;
+        }
+        if (ast.child[var][0] == NIL_NODE) {
+            emit(VmOp::GSTORE, global_index[sema.symbol_of[var]], gen_expr(ast.child[root][1]));
+            return;
+        }
+        int array = symbol.slot;
+        if (symbol.storage == Storage::GLOBAL) {
+            array = alloc();
+            emit(VmOp::GLOAD, array, global_index[sema.symbol_of[var]]);
+        }
+        TypeDescriptor *type_descriptor = symbol.type_descriptor;
+        NodeId tail = ast.child[var][0];
+        for (; ast.next[tail] != NIL_NODE; tail = ast.next[tail], type_descriptor = type_descriptor->base) {
+            int index = gen_expr(ast.child[tail][0]);
+            int element = alloc();
+            emit(VmOp::ALOAD, element, array, index, type_descriptor->lower_bound);
+            array = element;
+        }
+        int index = gen_expr(ast.child[tail][0]);
+        int value = gen_expr(ast.child[root][1]);
+        emit(VmOp::ASTORE, array, index, value, type_descriptor->lower_bound);
+    }
+};
+
+#endif
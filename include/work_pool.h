@@ -0,0 +1,82 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Work-stealing pool for a batch of jobs known up front. Each worker owns a
+   deque: it takes jobs from the front of its own and, once that is empty,
+   steals from the back of the others', so a few large files do not leave
+   the jobs queued behind them waiting while other threads are idle. */
+struct WorkPool {
+    typedef std::function<void()> Job;
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    size_t next_queue = 0;
+    std::atomic<size_t> steals{0};
+
+    explicit WorkPool(int threads) {
+        for (int i = 0; i < (threads < 1 ? 1 : threads); i++)
+            queues.emplace_back(new Queue);
+    }
+
+    /* deals the jobs round-robin over the workers */
+    void add(Job job) {
+        Queue &queue = *queues[next_queue++ % queues.size()];
+        queue.jobs.push_back(std::move(job));
+    }
+
+    /* runs every added job and returns once all of them are done */
+    void run() {
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < queues.size(); i++)
+            threads.emplace_back([this, i] { work(i); });
+        work(0);
+        for (std::thread &thread : threads)
+            thread.join();
+    }
+
+    void work(size_t self) {
+        Job job;
+        while (take(self, job) || steal(self, job))
+            job();
+    }
+
+    bool take(size_t self, Job &job) {
+        Queue &queue = *queues[self];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.jobs.empty())
+            return false;
+        job = std::move(queue.jobs.front());
+        queue.jobs.pop_front();
+        return true;
+    }
+
+    /* no job is ever added while the pool runs, so once every other deque
+       has been seen empty there is nothing left to steal */
+    bool steal(size_t self, Job &job) {
+        for (size_t k = 1; k < queues.size(); k++) {
+            Queue &queue = *queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.jobs.empty())
+                continue;
+            job = std::move(queue.jobs.back());
+            queue.jobs.pop_back();
+            steals++;
+            return true;
+        }
+        return false;
+    }
+};
+
+#endif
@@ -3,28 +3,58 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <chrono>
+#include <atomic>
 #include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "c_generator.h"
+#include "compile_server.h"
+#include "optimizer.h"
+#include "source_buffer.h"
 #include "traverser.h"
+#include "vm_lowering.h"
+#include "work_pool.h"
 
+#define YYMAXDEPTH 10000000
+%}
+
+%code requires {
+#include "compile_context.h"
 #define YYLTYPE LocType
+#define YYLTYPE_IS_TRIVIAL 1
+typedef void *yyscan_t;
+}
 
-#define MAX_LINE_LENG      256
-extern int line_no, col_no, opt_list;
-extern char buffer[MAX_LINE_LENG];
-extern FILE *yyin;        /* declared by lex */
-extern char *yytext;      /* declared by lex */
-extern int yyleng;
+%code {
+/* declared by lex */
+int yylex(YYSTYPE *yylval_param, YYLTYPE *yylloc_param, yyscan_t yyscanner);
+int yylex_init_extra(CompileContext *yy_user_defined, yyscan_t *yyscanner);
+int yylex_destroy(yyscan_t yyscanner);
+struct yy_buffer_state *yy_scan_buffer(char *base, size_t size, yyscan_t yyscanner);
+char *yyget_text(yyscan_t yyscanner);
 
-int yylex();
-int yyparse();
-void yyerror(const char *msg);
+void yyerror(YYLTYPE *loc, yyscan_t scanner, CompileContext &ctx, const char *msg);
 
-int pass_error = 0;
-char *output = NULL;
-Node* root = NULL;
-%}
+/* the parser's view of the scanner: counts tokens, and times them for --time-report */
+static int yylex(YYSTYPE *yylval_param, YYLTYPE *yylloc_param, yyscan_t yyscanner, CompileContext &ctx) {
+    ctx.stats.tokens++;
+    CompileStats::Clock::time_point start = ctx.stats.start();
+    int token = yylex(yylval_param, yylloc_param, yyscanner);
+    ctx.stats.stop(CompileStats::LEX, start);
+    return token;
+}
+}
 
+%define api.pure full
 %locations
+%lex-param {yyscan_t scanner} {CompileContext &ctx}
+%parse-param {yyscan_t scanner} {CompileContext &ctx}
 
 %token PROGRAM VAR ARRAY OF INTEGER REAL STRING FUNCTION PROCEDURE PBEGIN END IF THEN ELSE WHILE DO NOT AND OR
 
@@ -38,7 +68,8 @@ Node* root = NULL;
   char* sval;
   IDType tval;
   OpType oval;
-  Node* nval;
+  NodeId nval;
+  NodeList lval;
 }
 
 %type <ival> INTEGERNUM
@@ -46,21 +77,23 @@ Node* root = NULL;
 %type <sval> IDENTIFIER LITERALSTR
 %type <tval> standard_type
 %type <oval> addop mulop relop
-%type <nval> prog identifier_list declarations type subprogram_declarations subprogram_head arguments parameter_list parameter compound_statement statement_list statement variable tail procedure_statement expression_list expression boolexpression simple_expression term factor signed_num num
+%type <nval> prog type subprogram_head arguments parameter compound_statement statement variable tail procedure_statement expression boolexpression simple_expression term factor signed_num num
+%type <lval> identifier_list declarations subprogram_declarations parameter_list statement_list expression_list
 
 %%
 
     /* define your snytax here */
     /* @n return the sturct LocType of "n-th node", ex: @1 return the PROGRAM node's locType
        $n return the $$ result you assigned to the rule, ex: $1 */
+    /* lists are left-recursive so that their length does not grow the parser stack */
 prog: PROGRAM IDENTIFIER LPAREN identifier_list RPAREN SEMICOLON
       declarations
       subprogram_declarations
       compound_statement
       DOT 
 {
-    root = new Node{NodeType::PROG, @2, {$4, $7, $8, $9}, nullptr};
-    root->metadata.sval = $2;
+    ctx.root = ctx.ast.add(NodeType::PROG, @2, {$4.head, $7.head, $8.head, $9}, NIL_NODE);
+    ctx.ast.metadata[ctx.root].sval = $2;
     /*
     printf("program node is @ line: %d, column: %d\n",
                 @1.first_line, @1.first_column);
@@ -70,39 +103,41 @@ prog: PROGRAM IDENTIFIER LPAREN identifier_list RPAREN SEMICOLON
 
 identifier_list: IDENTIFIER
 {
-    $$ = new Node{NodeType::ID_LIST, @1, {}, nullptr};
-    $$->metadata.sval = $1;
+    NodeId id = ctx.ast.add(NodeType::ID_LIST, @1, {}, NIL_NODE);
+    ctx.ast.metadata[id].sval = $1;
+    $$ = NodeList{id, id};
 }
-               | IDENTIFIER COMMA identifier_list 
+               | identifier_list COMMA IDENTIFIER 
 {
-    $$ = new Node{NodeType::ID_LIST, @1, {}, $3};
-    $$->metadata.sval = $1;
+    NodeId id = ctx.ast.add(NodeType::ID_LIST, @3, {}, NIL_NODE);
+    ctx.ast.metadata[id].sval = $3;
+    $$ = ctx.ast.append($1, id);
 }
                ;
                
-declarations: VAR identifier_list COLON type SEMICOLON declarations 
+declarations: declarations VAR identifier_list COLON type SEMICOLON 
 {
-    $$ = new Node{NodeType::DECL_LIST, {}, {$2, $4}, $6};
+    $$ = ctx.ast.append($1, ctx.ast.add(NodeType::DECL_LIST, {}, {$3.head, $5}, NIL_NODE));
 }
             |
 {
-    $$ = nullptr;
+    $$ = NodeList{NIL_NODE, NIL_NODE};
 }
             ;
             
 type: standard_type
 {
-    $$ = new Node{NodeType::TYPE, @1, {}, nullptr};
-    $$->metadata.tval = $1;
+    $$ = ctx.ast.add(NodeType::TYPE, @1, {}, NIL_NODE);
+    ctx.ast.metadata[$$].tval = $1;
 }
     | ARRAY LBRACE INTEGERNUM DOTDOT INTEGERNUM RBRACE OF type
 {
-    Node *lower_bound = new Node{NodeType::LITERAL_INT, @3, {}, nullptr};
-    lower_bound->metadata.ival = $3;
-    Node *upper_bound = new Node{NodeType::LITERAL_INT, @5, {}, nullptr};
-    upper_bound->metadata.ival = $5;
-    $$ = new Node{NodeType::TYPE, @1, {lower_bound, upper_bound, $8}, nullptr};
-    $$->metadata.tval = IDType::ARRAY;
+    NodeId lower_bound = ctx.ast.add(NodeType::LITERAL_INT, @3, {}, NIL_NODE);
+    ctx.ast.metadata[lower_bound].ival = $3;
+    NodeId upper_bound = ctx.ast.add(NodeType::LITERAL_INT, @5, {}, NIL_NODE);
+    ctx.ast.metadata[upper_bound].ival = $5;
+    $$ = ctx.ast.add(NodeType::TYPE, @1, {lower_bound, upper_bound, $8}, NIL_NODE);
+    ctx.ast.metadata[$$].tval = IDType::ARRAY;
 }
     ;
     
@@ -120,58 +155,57 @@ standard_type: INTEGER
 }
              ;
 
-subprogram_declarations: subprogram_head 
+subprogram_declarations: subprogram_declarations
+                         subprogram_head 
                          declarations 
                          subprogram_declarations 
                          compound_statement SEMICOLON
-                         subprogram_declarations
 {
-    $$ = new Node{NodeType::SUBPROG_DECL_LIST, {}, {$1, $2, $3, $4}, $6};
+    $$ = ctx.ast.append($1, ctx.ast.add(NodeType::SUBPROG_DECL_LIST, {}, {$2, $3.head, $4.head, $5}, NIL_NODE));
 }
                        |
 {
-    $$ = nullptr;
+    $$ = NodeList{NIL_NODE, NIL_NODE};
 }
                        ;
 
 subprogram_head: FUNCTION IDENTIFIER arguments COLON type SEMICOLON
 {
-    $$ = new Node{NodeType::SUBPROG_HEAD, @1, {$3, $5}, nullptr};
-    $$->metadata.sval = $2;
+    $$ = ctx.ast.add(NodeType::SUBPROG_HEAD, @1, {$3, $5}, NIL_NODE);
+    ctx.ast.metadata[$$].sval = $2;
 }
                | PROCEDURE IDENTIFIER arguments SEMICOLON
 {
-    Node *type_node = new Node{NodeType::TYPE, {}, {}, nullptr};
-    type_node->metadata.tval = IDType::VOID;
-    $$ = new Node{NodeType::SUBPROG_HEAD, @1, {$3, type_node}, nullptr};
-    $$->metadata.sval = $2;
+    NodeId type_node = ctx.ast.add(NodeType::TYPE, {}, {}, NIL_NODE);
+    ctx.ast.metadata[type_node].tval = IDType::VOID;
+    $$ = ctx.ast.add(NodeType::SUBPROG_HEAD, @1, {$3, type_node}, NIL_NODE);
+    ctx.ast.metadata[$$].sval = $2;
 }
                ;
 
 arguments: LPAREN parameter_list RPAREN
 {
-    $$ = $2;
+    $$ = $2.head;
 }
          |
 {
-    $$ = nullptr;
+    $$ = NIL_NODE;
 }
          ;
          
 parameter_list: parameter
 {
-    $$ = $1;
+    $$ = NodeList{$1, $1};
 }
-              | parameter SEMICOLON parameter_list
+              | parameter_list SEMICOLON parameter
 {
-    $$ = $1;
-    $$->next = $3;
+    $$ = ctx.ast.append($1, $3);
 }
               ;
 
 parameter: optional_var identifier_list COLON type
 {
-    $$ = new Node{NodeType::PARAM_LIST, {}, {$2, $4}, nullptr};
+    $$ = ctx.ast.add(NodeType::PARAM_LIST, {}, {$2.head, $4}, NIL_NODE);
 }
               
 optional_var: VAR
@@ -182,23 +216,24 @@ compound_statement: PBEGIN
                     statement_list 
                     END
 {
-    $$ = $2;
+    $$ = $2.head;
 }
                   ;
                    
 statement_list: statement
 {
-    $$ = new Node{NodeType::STMT_LIST, {}, {$1}, nullptr};
+    NodeId stmt = ctx.ast.add(NodeType::STMT_LIST, {}, {$1}, NIL_NODE);
+    $$ = NodeList{stmt, stmt};
 }
-              | statement SEMICOLON statement_list
+              | statement_list SEMICOLON statement
 {
-    $$ = new Node{NodeType::STMT_LIST, {}, {$1}, $3};
+    $$ = ctx.ast.append($1, ctx.ast.add(NodeType::STMT_LIST, {}, {$3}, NIL_NODE));
 }
               ;
               
 statement: variable ASSIGNMENT expression
 {
-    $$ = new Node{NodeType::ASSIGN, {}, {$1, $3}, nullptr};
+    $$ = ctx.ast.add(NodeType::ASSIGN, {}, {$1, $3}, NIL_NODE);
 }
          | procedure_statement
 {
@@ -210,54 +245,55 @@ statement: variable ASSIGNMENT expression
 }
          | IF expression THEN statement ELSE statement
 {
-    $$ = new Node{NodeType::IF, {}, {$2, $4, $6}, nullptr};
+    $$ = ctx.ast.add(NodeType::IF, {}, {$2, $4, $6}, NIL_NODE);
 }
          | WHILE expression DO statement
 {
-    $$ = new Node{NodeType::WHILE, {}, {$2, $4}, nullptr};
+    $$ = ctx.ast.add(NodeType::WHILE, {}, {$2, $4}, NIL_NODE);
 }
          |
 {
-    $$ = nullptr;
+    $$ = NIL_NODE;
 }
          ;
 
 variable: IDENTIFIER tail
 {
-    $$ = new Node{NodeType::VAR, @1, {$2}, nullptr};
-    $$->metadata.sval = $1;
+    $$ = ctx.ast.add(NodeType::VAR, @1, {$2}, NIL_NODE);
+    ctx.ast.metadata[$$].sval = $1;
 }
         ;
 
 tail: LBRACE expression RBRACE tail
 {
-    $$ = new Node{NodeType::EXPR_LIST, {}, {$2}, $4};
+    $$ = ctx.ast.add(NodeType::EXPR_LIST, {}, {$2}, $4);
 }
     |
 {
-    $$ = nullptr;
+    $$ = NIL_NODE;
 }
     ;
 
 procedure_statement: IDENTIFIER
 {
-    $$ = new Node{NodeType::PROCEDURE, @1, {nullptr}, nullptr};
-    $$->metadata.sval = $1;
+    $$ = ctx.ast.add(NodeType::PROCEDURE, @1, {NIL_NODE}, NIL_NODE);
+    ctx.ast.metadata[$$].sval = $1;
 }
                    | IDENTIFIER LPAREN expression_list RPAREN
 {
-    $$ = new Node{NodeType::PROCEDURE, @1, {$3}, nullptr};
-    $$->metadata.sval = $1;
+    $$ = ctx.ast.add(NodeType::PROCEDURE, @1, {$3.head}, NIL_NODE);
+    ctx.ast.metadata[$$].sval = $1;
 }
                    ;
                    
 expression_list: expression
 {
-    $$ = new Node{NodeType::EXPR_LIST, {}, {$1}, nullptr};
+    NodeId expr = ctx.ast.add(NodeType::EXPR_LIST, {}, {$1}, NIL_NODE);
+    $$ = NodeList{expr, expr};
 }
-               | expression COMMA expression_list
+               | expression_list COMMA expression
 {
-    $$ = new Node{NodeType::EXPR_LIST, {}, {$1}, $3};
+    $$ = ctx.ast.append($1, ctx.ast.add(NodeType::EXPR_LIST, {}, {$3}, NIL_NODE));
 }
                ;
                
@@ -267,13 +303,13 @@ expression: boolexpression
 }
           | boolexpression AND boolexpression
 {
-    $$ = new Node{NodeType::OP, @2, {$1, $3}, nullptr};
-    $$->metadata.oval = OpType::AND;
+    $$ = ctx.ast.add(NodeType::OP, @2, {$1, $3}, NIL_NODE);
+    ctx.ast.metadata[$$].oval = OpType::AND;
 }
           | boolexpression OR boolexpression
 {
-    $$ = new Node{NodeType::OP, @2, {$1, $3}, nullptr};
-    $$->metadata.oval = OpType::OR;
+    $$ = ctx.ast.add(NodeType::OP, @2, {$1, $3}, NIL_NODE);
+    ctx.ast.metadata[$$].oval = OpType::OR;
 }
           ;
           
@@ -283,8 +319,8 @@ boolexpression: simple_expression
 }
               | simple_expression relop simple_expression
 {
-    $$ = new Node{NodeType::OP, @2, {$1, $3}, nullptr};
-    $$->metadata.oval = $2;
+    $$ = ctx.ast.add(NodeType::OP, @2, {$1, $3}, NIL_NODE);
+    ctx.ast.metadata[$$].oval = $2;
 }
               ;
               
@@ -294,8 +330,8 @@ simple_expression: term
 }
                  | simple_expression addop term
 {
-    $$ = new Node{NodeType::OP, @2, {$1, $3}, nullptr};
-    $$->metadata.oval = $2;
+    $$ = ctx.ast.add(NodeType::OP, @2, {$1, $3}, NIL_NODE);
+    ctx.ast.metadata[$$].oval = $2;
 }
                  ;
                  
@@ -305,8 +341,8 @@ term: factor
 }
     | term mulop factor
 {
-    $$ = new Node{NodeType::OP, @2, {$1, $3}, nullptr};
-    $$->metadata.oval = $2;
+    $$ = ctx.ast.add(NodeType::OP, @2, {$1, $3}, NIL_NODE);
+    ctx.ast.metadata[$$].oval = $2;
 }
     ;
     
@@ -316,8 +352,8 @@ factor: variable
 }
       | IDENTIFIER LPAREN expression_list RPAREN
 {
-    $$ = new Node{NodeType::VAR, @1, {$3}, nullptr};
-    $$->metadata.sval = $1; 
+    $$ = ctx.ast.add(NodeType::VAR, @1, {$3.head}, NIL_NODE);
+    ctx.ast.metadata[$$].sval = $1; 
 }
       | signed_num
 {
@@ -325,8 +361,8 @@ factor: variable
 }
       | LITERALSTR
 {
-    $$ = new Node{NodeType::LITERAL_STR, @1, {}, nullptr};
-    $$->metadata.sval = $1;
+    $$ = ctx.ast.add(NodeType::LITERAL_STR, @1, {}, NIL_NODE);
+    ctx.ast.metadata[$$].sval = $1;
 }
       | LPAREN expression RPAREN
 {
@@ -334,7 +370,7 @@ factor: variable
 }
       | NOT factor
 {
-    $$ = new Node{NodeType::NOT, {}, {$2}, nullptr};
+    $$ = ctx.ast.add(NodeType::NOT, {}, {$2}, NIL_NODE);
 }
       ;
       
@@ -390,71 +426,509 @@ signed_num: num
 }
           | SUBOP signed_num
 {
-    $$ = new Node{NodeType::NEGATE, {}, $2, nullptr};
+    $$ = ctx.ast.add(NodeType::NEGATE, {}, {$2}, NIL_NODE);
 }
           ;
      
 num: REALNUMBER
 {
-    $$ = new Node{NodeType::LITERAL_DBL, @1, {}, nullptr};
-    $$->metadata.dval = $1;
+    $$ = ctx.ast.add(NodeType::LITERAL_DBL, @1, {}, NIL_NODE);
+    ctx.ast.metadata[$$].dval = $1;
 }
    | INTEGERNUM
 {
-    $$ = new Node{NodeType::LITERAL_INT, @1, {}, nullptr};
-    $$->metadata.ival = $1;
+    $$ = ctx.ast.add(NodeType::LITERAL_INT, @1, {}, NIL_NODE);
+    ctx.ast.metadata[$$].ival = $1;
 }
    | SCIENTIFIC
 {
-    $$ = new Node{NodeType::LITERAL_DBL, @1, {}, nullptr};
-    $$->metadata.dval = $1;
+    $$ = ctx.ast.add(NodeType::LITERAL_DBL, @1, {}, NIL_NODE);
+    ctx.ast.metadata[$$].dval = $1;
 }
    ;
 
 %%
 
-void yyerror(const char *msg) {
-    fprintf(stderr,
-            "[ERROR] line %4d:%3d %s, Unmatched token: %s\n",
-            line_no, col_no - yyleng, buffer, yytext);
-    pass_error = 1;
+void yyerror(YYLTYPE *loc, yyscan_t scanner, CompileContext &ctx, const char *msg) {
+    fprintf(ctx.diag,
+            "[ERROR] line %4d:%3d %.*s, Unmatched token: %s\n",
+            ctx.line_no, (int)loc->first_column, (int)(yyget_text(scanner) + strlen(yyget_text(scanner)) - ctx.line_start), ctx.line_start,
+            yyget_text(scanner));
+    ctx.pass_error = 1;
+}
+
+struct Options {
+    int opt_level = 0;
+    int opt_report = 0;
+    int opt_mem_stats = 0;
+    int incremental = 0;
+    int opt_list = 0;
+    int stats_format = 0;    /* 0 none, 1 text, 2 json */
+    int run = 0;             /* --run: execute in-process instead of writing output */
+    int profile = 0;
+    int flat_arrays = 0;
+    int unbuffered_io = 0;
+    EmitFormat emit_format = EmitFormat::JASMIN;
+};
+
+/* a.p -> a.j (or a.class, a.c) next to the source */
+static std::string default_output(const std::string &input, EmitFormat emit_format) {
+    size_t dot = input.find_last_of('.');
+    size_t slash = input.find_last_of('/');
+    std::string stem = dot != std::string::npos && (slash == std::string::npos || dot > slash) ? input.substr(0, dot) : input;
+    return stem + (emit_format == EmitFormat::CLASS ? ".class" : emit_format == EmitFormat::C ? ".c" : ".j");
+}
+
+/* compiles one source into out as class basename, or runs it with --run;
+   returns nonzero on a syntax or write error or an uncaught exception */
+static int compile_stream(const Options &options, FILE *fp, const std::string &basename, std::ostream &out_file, CompileContext &ctx, MethodCache *method_cache = NULL) {
+    CompileStats &stats = ctx.stats;
+    stats.timing = options.stats_format != 0;
+    CompileStats::Clock::time_point start = stats.start();
+    SourceBuffer source;
+    if (!source.load(fp)) {
+        fprintf(ctx.diag, "[ERROR] cannot read the source\n");
+        return 1;
+    }
+    stats.stop(CompileStats::LEX, start);
+    ctx.opt_list = options.opt_list;
+    ctx.line_start = source.data;
+    yyscan_t scanner;
+    yylex_init_extra(&ctx, &scanner);
+    yy_scan_buffer(source.data, source.scan_size(), scanner);
+    double lex_before = stats.seconds[CompileStats::LEX];
+    start = stats.start();
+    yyparse(scanner, ctx);
+    stats.stop(CompileStats::PARSE, start);
+    stats.seconds[CompileStats::PARSE] -= stats.seconds[CompileStats::LEX] - lex_before;
+    yylex_destroy(scanner);
+    stats.nodes = ctx.ast.size();
+
+    SemanticAnalysis sema(ctx.ast, ctx.arena, ctx.diag);
+    sema.symbol_table.trace = !options.run;
+    sema.symbol_table.trace_out = ctx.trace;
+    if (!ctx.pass_error && ctx.root != NIL_NODE) {
+        start = stats.start();
+        if (!sema.run(ctx.root))
+            ctx.pass_error = 1;
+        stats.stop(CompileStats::SEMA, start);
+        stats.symbols_added = sema.symbol_table.adds;
+        stats.lookups = sema.symbol_table.lookups;
+        stats.scopes_walked = sema.symbol_table.scopes_walked;
+    }
+
+    /* after sema: the rewrites assume the types it checked */
+    Optimizer optimizer(ctx.ast, sema, options.opt_level);
+    if (!ctx.pass_error && ctx.root != NIL_NODE) {
+        start = stats.start();
+        optimizer.run();
+        stats.stop(CompileStats::FOLD, start);
+    }
+    if (options.opt_report) {
+        fprintf(ctx.diag, "[INFO ] optimizer: level %d, %zu nodes folded\n", options.opt_level, optimizer.folded);
+    }
+
+    Traverser traverser(out_file, basename, ctx.ast, ctx.arena, sema, stats, options.emit_format, options.opt_level, ctx.diag);
+    traverser.method_cache = method_cache;
+    traverser.flat_arrays = options.flat_arrays;
+    traverser.buffered_io = !options.unbuffered_io;
+    int write_error = 0;
+    if (!ctx.pass_error && ctx.root != NIL_NODE && options.run) {
+        start = stats.start();
+        VmLowering lowering(ctx.ast, sema, stats);
+        lowering.lower(ctx.root);
+        stats.stop(CompileStats::CODEGEN, start);
+        Vm vm(lowering.program);
+        write_error = vm.run(options.profile);
+        if (options.profile)
+            vm.print_profile(ctx.diag);
+    } else if (!ctx.pass_error && ctx.root != NIL_NODE && options.emit_format == EmitFormat::C) {
+        CGenerator c_generator(out_file, basename, ctx.ast, sema, stats);
+        write_error = !c_generator.gen_prog(ctx.root);
+    } else if (!ctx.pass_error && ctx.root != NIL_NODE) {
+        write_error = !traverser.gen_prog(ctx.root);
+    }
+    if (options.opt_report && options.opt_level >= 1) {
+        for (size_t i = 0; i < traverser.peephole.rules.size(); i++)
+            fprintf(ctx.diag, "[INFO ] peephole: %-18s %zu hits\n", traverser.peephole.rules[i].name, traverser.peephole.hits[i]);
+        fprintf(ctx.diag, "[INFO ] locals: %zu slots before allocation, %zu after\n",
+                traverser.slot_allocator.slots_before, traverser.slot_allocator.slots_after);
+        for (const auto &subprog : traverser.tail_calls)
+            fprintf(ctx.diag, "[INFO ] tail calls: %s: %zu self-calls turned into jumps\n", subprog.first, subprog.second);
+        if (options.opt_level >= 2)
+            fprintf(ctx.diag, "[INFO ] loops: %zu while loops, %zu values hoisted, %zu induction expressions reduced\n",
+                    traverser.loop_optimizer.loops, traverser.loop_optimizer.hoisted, traverser.loop_optimizer.reduced);
+    }
+
+    if (options.opt_mem_stats) {
+        fprintf(ctx.diag, "[INFO ] ast: %zu nodes, %zu bytes\n", ctx.ast.size(), ctx.ast.bytes());
+        fprintf(ctx.diag, "[INFO ] arena: %zu bytes used, %zu bytes reserved in %zu blocks\n",
+                ctx.arena.bytes_used, ctx.arena.bytes_reserved, ctx.arena.blocks.size());
+        fprintf(ctx.diag, "[INFO ] intern: %zu lookups, %zu hits (%.1f%%), %zu unique identifiers\n",
+                ctx.intern_table.lookups, ctx.intern_table.hits,
+                ctx.intern_table.lookups ? 100.0 * ctx.intern_table.hits / ctx.intern_table.lookups : 0.0,
+                ctx.intern_table.count);
+        fprintf(ctx.diag, "[INFO ] output: %zu methods, largest %zu instructions, %zu bytes in %zu writes\n",
+                stats.methods, traverser.largest_method, traverser.sink.bytes_written, traverser.sink.writes);
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        fprintf(ctx.diag, "[INFO ] peak rss: %ld KB\n", usage.ru_maxrss);
+    }
+    if (options.stats_format == 1)
+        stats.print(ctx.diag, basename.c_str());
+    else if (options.stats_format == 2)
+        stats.print_json(ctx.diag, basename.c_str());
+    return ctx.pass_error || write_error;
+}
+
+/* the class is named after the output file */
+static std::string class_name(const std::string &output) {
+    std::string basename = output.substr(output.find_last_of('/') + 1);
+    return basename.substr(0, basename.find_last_of('.'));
+}
+
+static int compile(const Options &options, FILE *fp, const std::string &output, CompileContext &ctx) {
+    std::ofstream out_file(output, options.emit_format == EmitFormat::CLASS ? std::ios::out | std::ios::binary : std::ios::out);
+    if (!options.incremental || options.emit_format == EmitFormat::C) {
+        int error = compile_stream(options, fp, class_name(output), out_file, ctx);
+        out_file.close();
+        return error;
+    }
+
+    /* the methods of the previous compile live next to the output */
+    MethodCache method_cache;
+    method_cache.load(output + ".cache");
+    int error = compile_stream(options, fp, class_name(output), out_file, ctx, &method_cache);
+    out_file.close();
+    if (!error && !method_cache.save(output + ".cache"))
+        fprintf(ctx.diag, "[ERROR] cannot write %s.cache\n", output.c_str());
+    fprintf(ctx.diag, "[INFO ] incremental: %zu methods reused, %zu rebuilt\n", method_cache.reused, method_cache.rebuilt);
+    return error;
+}
+
+/* server side of a cache miss: compiles from memory with the server's
+   long-lived context, capturing everything the client has to replay */
+static void compile_request(const CompileRequest &request, CompileResult &result, CompileContext &ctx) {
+    Options options;
+    options.opt_level = request.opt_level;
+    options.opt_report = request.opt_report;
+    options.opt_mem_stats = request.opt_mem_stats;
+    options.opt_list = request.opt_list;
+    options.flat_arrays = request.flat_arrays;
+    options.unbuffered_io = request.unbuffered_io;
+    options.emit_format = (EmitFormat)request.emit_format;
+
+    char *listing_text = NULL, *diag_text = NULL;
+    size_t listing_size = 0, diag_size = 0;
+    ctx.reset();
+    ctx.listing = open_memstream(&listing_text, &listing_size);
+    /* locally the trace goes to stdout between the listing lines, so it is
+       replayed as part of the listing */
+    ctx.trace = ctx.listing;
+    ctx.diag = open_memstream(&diag_text, &diag_size);
+    FILE *fp = request.source.empty() ? fopen("/dev/null", "r") : fmemopen((void*)request.source.data(), request.source.size(), "r");
+    std::ostringstream out;
+    result.status = compile_stream(options, fp, request.basename, out, ctx);
+    fclose(fp);
+    fclose(ctx.listing);
+    fclose(ctx.diag);
+    result.output = out.str();
+    result.listing.assign(listing_text, listing_size);
+    result.diag.assign(diag_text, diag_size);
+    free(listing_text);
+    free(diag_text);
+}
+
+/* client side: ships the source to the server and replays its answer as
+   if it had been compiled here; false if no server answered */
+static bool compile_remote(const std::string &socket_path, const Options &options, FILE *fp, const std::string &output, int &status) {
+    CompileRequest request;
+    request.opt_level = options.opt_level;
+    request.opt_report = options.opt_report;
+    request.opt_mem_stats = options.opt_mem_stats;
+    request.opt_list = options.opt_list;
+    request.flat_arrays = options.flat_arrays;
+    request.unbuffered_io = options.unbuffered_io;
+    request.emit_format = (uint32_t)options.emit_format;
+    request.basename = class_name(output);
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+        request.source.append(chunk, n);
+
+    CompileResult result;
+    if (!request_compile(socket_path, request, result))
+        return false;
+    std::ofstream out_file(output, std::ios::out | std::ios::binary);
+    out_file.write(result.output.data(), result.output.size());
+    fwrite(result.listing.data(), 1, result.listing.size(), stdout);
+    fwrite(result.diag.data(), 1, result.diag.size(), stderr);
+    status = result.status;
+    return true;
+}
+
+/* Compiles every input on a pool of jobs threads. Each file's listing, scope
+   and symbol trace and diagnostics are collected in memory and printed
+   together once the file is done, so the output of concurrent compiles does
+   not interleave. */
+static int compile_batch(const Options &options, const std::vector<std::string> &inputs, int jobs) {
+    WorkPool pool(jobs);
+    std::mutex report_mutex;
+    std::atomic<size_t> failed{0};
+    for (const std::string &input : inputs) {
+        pool.add([&options, &report_mutex, &failed, input] {
+            char *listing_text = NULL, *diag_text = NULL;
+            size_t listing_size = 0, diag_size = 0;
+            int error = 1;
+            {
+                CompileContext ctx;
+                ctx.listing = open_memstream(&listing_text, &listing_size);
+                ctx.trace = ctx.listing;
+                ctx.diag = open_memstream(&diag_text, &diag_size);
+                FILE *fp = fopen(input.c_str(), "r");
+                if (fp == NULL) {
+                    fprintf(ctx.diag, "[ERROR] Open file error\n");
+                } else {
+                    error = compile(options, fp, default_output(input, options.emit_format), ctx);
+                    fclose(fp);
+                }
+                fclose(ctx.listing);
+                fclose(ctx.diag);
+            }
+            {
+                std::lock_guard<std::mutex> lock(report_mutex);
+                fwrite(listing_text, 1, listing_size, stdout);
+                if (diag_size > 0)
+                    fprintf(stderr, "[INFO ] %s:\n", input.c_str());
+                fwrite(diag_text, 1, diag_size, stderr);
+                if (error)
+                    fprintf(stderr, "[ERROR] %s: compilation failed\n", input.c_str());
+            }
+            free(listing_text);
+            free(diag_text);
+            if (error)
+                failed++;
+        });
+    }
+    pool.run();
+    fprintf(stderr, "[INFO ] batch: %zu files, %zu failed, %zu threads, %zu jobs stolen\n",
+            inputs.size(), failed.load(), pool.queues.size(), pool.steals.load());
+    return failed != 0;
+}
+
+/* Scanner microbenchmark: lexes the file rounds times from one loaded
+   buffer, with no parser behind it, and reports the token rate */
+static int lex_bench(const std::string &input, int rounds) {
+    FILE *fp = fopen(input.c_str(), "r");
+    SourceBuffer source;
+    if (fp == NULL || !source.load(fp)) {
+        fprintf(stderr, "[ERROR] %s: cannot read the source\n", input.c_str());
+        return 1;
+    }
+    fclose(fp);
+
+    CompileContext ctx;
+    size_t tokens = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        ctx.reset();
+        ctx.line_start = source.data;
+        yyscan_t scanner;
+        yylex_init_extra(&ctx, &scanner);
+        yy_scan_buffer(source.data, source.scan_size(), scanner);
+        YYSTYPE value;
+        YYLTYPE loc;
+        while (yylex(&value, &loc, scanner) != 0)
+            tokens++;
+        yylex_destroy(scanner);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "[INFO ] lex-bench: %s: %zu bytes, %zu tokens x %d rounds in %.3f s, %.2f Mtokens/s, %.1f MB/s\n",
+            input.c_str(), source.size, rounds ? tokens / rounds : 0, rounds, seconds,
+            tokens / seconds / 1e6, (double)source.size * rounds / seconds / 1e6);
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"mem-stats", no_argument, NULL, 'm'},
+        {"emit", required_argument, NULL, 'e'},
+        {"opt-report", no_argument, NULL, 'r'},
+        {"incremental", no_argument, NULL, 'i'},
+        {"list", no_argument, NULL, 'l'},
+        {"time-report", no_argument, NULL, 't'},
+        {"stats", optional_argument, NULL, 'T'},
+        {"lex-bench", optional_argument, NULL, 'b'},
+        {"server", required_argument, NULL, 's'},
+        {"connect", required_argument, NULL, 'c'},
+        {"cache-dir", required_argument, NULL, 'd'},
+        {"cache-mem", required_argument, NULL, 'M'},
+        {"server-stats", no_argument, NULL, 'S'},
+        {"server-stop", no_argument, NULL, 'X'},
+        {"run", no_argument, NULL, 'R'},
+        {"profile", no_argument, NULL, 'P'},
+        {"flat-arrays", no_argument, NULL, 'F'},
+        {"unbuffered-io", no_argument, NULL, 'U'},
+        {NULL, 0, NULL, 0}
+    };
+    Options options;
+    char *output = NULL;
+    int jobs = 1;
+    const char *server_socket = NULL;
+    const char *connect_socket = getenv("COMPILER_SERVER");
+    const char *cache_dir = ".compiler-cache";
+    size_t cache_mem = 64;
+    RequestType control = RequestType::COMPILE;
+    int bench_rounds = 0;
     char c;
-    while((c=getopt(argc, argv, "o:")) != -1){
+    while((c=getopt_long(argc, argv, "o:O::j:", long_options, NULL)) != -1){
       switch(c){
         case 'o':
           output = optarg;
           break;
+        case 'm':
+          options.opt_mem_stats = 1;
+          break;
+        case 'O':
+          options.opt_level = optarg ? atoi(optarg) : 1;
+          break;
+        case 'r':
+          options.opt_report = 1;
+          break;
+        case 'i':
+          options.incremental = 1;
+          break;
+        case 'l':
+          options.opt_list = 1;
+          break;
+        case 't':
+          options.stats_format = 1;
+          break;
+        case 'T':
+          if (optarg == NULL || strcmp(optarg, "text") == 0)
+              options.stats_format = 1;
+          else if (strcmp(optarg, "json") == 0)
+              options.stats_format = 2;
+          else
+              fprintf(stderr, "Unknown stats format: %s\n", optarg), exit(-1);
+          break;
+        case 'b':
+          bench_rounds = optarg ? atoi(optarg) : 20;
+          break;
+        case 'j':
+          jobs = atoi(optarg);
+          if (jobs <= 0)
+              jobs = std::thread::hardware_concurrency();
+          break;
+        case 's':
+          server_socket = optarg;
+          break;
+        case 'c':
+          connect_socket = optarg;
+          break;
+        case 'd':
+          cache_dir = optarg;
+          break;
+        case 'M':
+          cache_mem = strtoul(optarg, NULL, 10);
+          break;
+        case 'S':
+          control = RequestType::STATS;
+          break;
+        case 'X':
+          control = RequestType::STOP;
+          break;
+        case 'R':
+          options.run = 1;
+          break;
+        case 'P':
+          options.profile = 1;
+          break;
+        case 'F':
+          options.flat_arrays = 1;
+          break;
+        case 'U':
+          options.unbuffered_io = 1;
+          break;
+        case 'e':
+          if (strcmp(optarg, "jasmin") == 0)
+              options.emit_format = EmitFormat::JASMIN;
+          else if (strcmp(optarg, "class") == 0)
+              options.emit_format = EmitFormat::CLASS;
+          else if (strcmp(optarg, "c") == 0)
+              options.emit_format = EmitFormat::C;
+          else
+              fprintf(stderr, "Unknown emit format: %s\n", optarg), exit(-1);
+          break;
         case '?':
             fprintf(stderr, "Illegal option:-%c\n", isprint(optopt)?optopt:'#');
             break;
         default:
-            fprintf( stderr, "Usage: %s [-o output] filename\n", argv[0]), exit(0);
+            fprintf( stderr, "Usage: %s [-o output] [-j jobs] [-O[level]] [--opt-report] [--incremental] [--list] [--time-report] [--stats[=text|json]] [--emit=jasmin|class|c] [--flat-arrays] [--unbuffered-io] [--mem-stats] [--connect=socket] filename...\n"
+                             "       %s --run [--profile] [-O[level]] filename\n"
+                             "       %s --lex-bench[=rounds] filename...\n"
+                             "       %s --server=socket [--cache-dir=dir] [--cache-mem=MB]\n"
+                             "       %s --connect=socket --server-stats|--server-stop\n", argv[0], argv[0], argv[0], argv[0], argv[0]), exit(0);
             break;
       }
     }
 
-    FILE *fp = argc == 1 ? stdin : fopen(argv[optind], "r");
+    if (server_socket != NULL) {
+        CompileCache cache(cache_dir, cache_mem << 20);
+        CompileContext ctx;
+        return run_compile_server(server_socket, cache, [&ctx](const CompileRequest &request, CompileResult &result) {
+            compile_request(request, result, ctx);
+        });
+    }
+    if (control != RequestType::COMPILE) {
+        if (connect_socket == NULL)
+            fprintf( stderr, "No server given: use --connect or COMPILER_SERVER\n" ), exit(-1);
+        return request_control(connect_socket, control);
+    }
+
+    std::vector<std::string> inputs(argv + optind, argv + argc);
+    if (bench_rounds > 0) {
+        int status = 0;
+        for (const std::string &input : inputs)
+            status |= lex_bench(input, bench_rounds);
+        return status;
+    }
+    if (options.profile && !options.run)
+        fprintf( stderr, "--profile needs --run\n" ), exit(-1);
+    if (options.run) {
+        /* the program reads standard input, so the source has to be a file */
+        if (inputs.size() != 1 || output != NULL)
+            fprintf( stderr, "--run takes one source file and no -o\n" ), exit(-1);
+        FILE *fp = fopen(inputs[0].c_str(), "r");
+        if (fp == NULL)
+            fprintf( stderr, "Open file error\n" ), exit(-1);
+        CompileContext ctx;
+        std::ostringstream unused;
+        int status = compile_stream(options, fp, class_name(inputs[0]), unused, ctx);
+        fclose(fp);
+        return status;
+    }
+    if (inputs.size() > 1) {
+        if (output != NULL)
+            fprintf( stderr, "-o cannot be used with several input files\n" ), exit(-1);
+        return compile_batch(options, inputs, jobs);
+    }
+
+    FILE *fp = inputs.empty() ? stdin : fopen(inputs[0].c_str(), "r");
 
     if(fp == NULL)
         fprintf( stderr, "Open file error\n" ), exit(-1);
+    if(output == NULL && inputs.empty())
+        fprintf( stderr, "No output file\n" ), exit(-1);
 
-    yyin = fp;
-    yyparse();
-    
-    std::string out_str(output);
-    std::ofstream out_file(out_str);
-    
-    std::string basename = out_str.substr(out_str.find_last_of('/') + 1);
-    basename = basename.substr(0, basename.find_last_of('.'));
-    
-    Traverser traverser(out_file, basename);
-    if (!pass_error && root) {
-        traverser.gen_prog(root);
+    std::string out_path = output != NULL ? output : default_output(inputs[0], options.emit_format);
+    int status;
+    if (connect_socket != NULL && *connect_socket != 0 && fp != stdin && !options.stats_format) {
+        /* a missing server is not an error: compile here instead */
+        if (compile_remote(connect_socket, options, fp, out_path, status))
+            return status;
+        rewind(fp);
     }
-    
-    out_file.close();
-    return 0;
+    CompileContext ctx;
+    return compile(options, fp, out_path, ctx);
 }
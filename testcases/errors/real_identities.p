@@ -0,0 +1,11 @@
+program realidentities(output);
+var r: real;
+begin
+    r := 2.5;
+    r := r * 1;
+    r := 0 - r;
+    r := r + 0;
+    r := r * 4;
+    r := r * 0;
+    writelnR(r)
+end.
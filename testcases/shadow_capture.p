@@ -0,0 +1,32 @@
+program shadow_capture(input, output);
+var g: integer;
+
+// m's x hides o's x from i, but c, called from i, still reads o's x
+procedure o(n: integer);
+var x: integer;
+  procedure c;
+  begin
+    writelnI(x)
+  end;
+  function m(k: integer): integer;
+  var x: integer;
+    function i(d: integer): integer;
+    begin
+      c;
+      writelnI(x);
+      i := x + d
+    end;
+  begin
+    x := k;
+    m := i(3)
+  end;
+begin
+  x := n;
+  writelnI(m(20));
+  writelnI(x)
+end;
+
+begin
+  g := 1;
+  o(g)
+end.